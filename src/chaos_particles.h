@@ -50,12 +50,11 @@ private:
     float flowScaleRampRate;
     float flowFilterRate;
 
+    // Velocity and age are in 'particles'; position is on the XZ plane, before the flow offset
     struct ParticleDynamics {
-        Vec2 position;
-        Vec2 velocity;
+        Vec3 position;
         bool escaped, dead;
         unsigned generation;
-        unsigned age;
     };
 
     CameraFlowCapture flow;
@@ -121,7 +120,7 @@ inline void ChaosParticles::reseed(Vec2 location, unsigned seed)
     totalIntensity = nanf("");
     flowScale = 0;
 
-    appearance.resize(numParticles);
+    particles.resize(numParticles);
     dynamics.resize(numParticles);
 
     PRNG prng;
@@ -133,9 +132,9 @@ inline void ChaosParticles::reseed(Vec2 location, unsigned seed)
     colorCycle = prng.uniform(0, M_PI * 2);
 
     for (unsigned i = 0; i < dynamics.size(); i++) {
-        dynamics[i].position = location;
-        dynamics[i].velocity = prng.ringVector(initialSpeedMin, initialSpeedMax);
-        dynamics[i].age = 0;
+        dynamics[i].position = XZ(location);
+        particles.velocity[i] = XZ(prng.ringVector(initialSpeedMin, initialSpeedMax));
+        particles.age[i] = 0;
         dynamics[i].generation = 0;
         dynamics[i].dead = false;
         dynamics[i].escaped = false;
@@ -180,17 +179,20 @@ inline void ChaosParticles::runStep(const FrameInfo &f)
     flow.capture(flowFilterRate);
     flowScale = std::min(flowScaleTarget, flowScale + flowScaleRampRate * stepSize);
 
-    // Update dynamics
+    /*
+     * Update dynamics. This stays one sequential pass: respawning copies state
+     * from another particle, which may or may not have been updated yet this step.
+     */
     for (unsigned i = 0; i < dynamics.size(); i++) {
         ParticleDynamics pd = dynamics[i];
-        ParticleAppearance pa = appearance[i];
+        Vec3 velocity = particles.velocity[i];
+        float age = particles.age[i] + 1;
 
-        pd.age++;
-        if (pd.age > maxAge && !pd.dead) {
+        if (age > maxAge && !pd.dead) {
             pd.dead = true;
-            pa.intensity = 0;
+            particles.intensity[i] = 0;
+            particles.age[i] = age;
             dynamics[i] = pd;
-            appearance[i] = pa;
         }
         if (pd.dead) {
             continue;
@@ -198,28 +200,31 @@ inline void ChaosParticles::runStep(const FrameInfo &f)
 
         // XZ plane
         // Horizontal flow -> position
-        pa.point[0] = pd.position[0] - flow.model[0] * flowScale;
-        pa.point[2] = pd.position[1];
+        Vec3 point = particles.point[i];
+        point[0] = pd.position[0] - flow.model[0] * flowScale;
+        point[2] = pd.position[2];
 
-        float ageF = pd.age / (float)maxAge;
+        float ageF = age / (float)maxAge;
         float c = (pd.generation + ageF) * generationScale;
 
         // Fade in/out
         float fade = pow(std::max(0.0f, sinf(ageF * M_PI)), intensityExp);
         float particleIntensity = intensity * fade;
 
-        pa.radius = f.modelRadius * relativeSize * fade;
+        float radius = f.modelRadius * relativeSize * fade;
         numLiveParticles++;
 
         // Dark matter, to break up the monotony of lightness
         bool darkParticle = i < numDarkParticles;
-        pa.intensity = darkParticle ? particleIntensity * darkMultiplier : particleIntensity;
-        pa.color = darkParticle ? Vec3(1,1,1) : palette.sample(c, 0.5 + 0.5 * sinf(colorCycle));
+        particles.intensity[i] = darkParticle ? particleIntensity * darkMultiplier : particleIntensity;
+        particles.color[i] = darkParticle ? Vec3(1,1,1) : palette.sample(c, 0.5 + 0.5 * sinf(colorCycle));
+        particles.radius[i] = radius;
+        particles.point[i] = point;
         intensityAccumulator += darkParticle ? particleIntensity : 0;
 
-        pd.position += pd.velocity;
-        pd.escaped = f.distanceOutsideBoundingBox(pa.point) >
-            outsideMargin * pa.radius;
+        pd.position += velocity;
+        pd.escaped = f.distanceOutsideBoundingBox(point) >
+            outsideMargin * radius;
 
         // Respawn escaped particles near a random other particle;
         // Appearance won't update until the next step.
@@ -231,8 +236,8 @@ inline void ChaosParticles::runStep(const FrameInfo &f)
                     // Fractal respawn at seed position
                     pd = dynamics[seed];
                     pd.generation++;
-                    pd.age = 0;
-                    Vec2 v = pd.velocity;
+                    age = 0;
+                    Vec3 v = particles.velocity[seed];
 
                     // Speed modulation
                     v *= prng.uniform(speedMin, speedMax);
@@ -241,20 +246,21 @@ inline void ChaosParticles::runStep(const FrameInfo &f)
                     float t = prng.uniform(spinMin, spinMax);
                     float c = cosf(t);
                     float s = sinf(t);
-                    v = Vec2( v[0] * c - v[1] * s ,
-                              v[0] * s + v[1] * c );
+                    v = Vec3( v[0] * c - v[2] * s, 0,
+                              v[0] * s + v[2] * c );
 
-                    pd.velocity = v;
+                    velocity = v;
                     break;
                 }
             }
         }
 
         prng.remix(pd.position[0] * 1e8);
-        prng.remix(pd.position[1] * 1e8);
+        prng.remix(pd.position[2] * 1e8);
 
         dynamics[i] = pd;
-        appearance[i] = pa;
+        particles.velocity[i] = velocity;
+        particles.age[i] = age;
     }
 
     totalIntensity = intensityAccumulator;
@@ -48,6 +48,7 @@ private:
 
     Texture palette;
     std::vector<TreeInfo> tree;
+    std::vector<uint8_t> keep;
     Vec2 newTexCoord;
     float travelAmount;
     float growthAmount;
@@ -74,12 +75,13 @@ inline Forest::Forest(const CameraFlowAnalyzer &flow, const rapidjson::Value &co
 
 inline void Forest::reseed(unsigned seed)
 {
-    appearance.clear();
+    particles.clear();
     tree.clear();
     flow.capture(1.0);
     flow.origin();
     s = Sampler(seed);
     travelAmount = 0;
+    growthAmount = 0;
 
     newTexCoord = s.value2D(config["newTexCoord"]);
     outsideMargin = s.value(config["outsideMargin"]);
@@ -95,7 +97,7 @@ inline void Forest::beginFrame(const FrameInfo &f)
 {
     growthAmount += growthPointsPerSecond * f.timeDelta;
     while (growthAmount > 1.0f) {
-        if (appearance.size() >= maxParticles) {
+        if (particles.size() >= maxParticles) {
             growthAmount = 0;
             break;
         }
@@ -118,39 +120,37 @@ inline void Forest::updateFlow(const FrameInfo &f)
 {
     flow.capture(flowFilterRate);
 
-    unsigned i = 0, j = 0;
-    for (; i < appearance.size(); i++) {
-        appearance[i].point = tree[i].point + pointOffset();
-        appearance[i].intensity = std::min(maxIntensity, appearance[i].intensity + f.timeDelta * intensityRate);
+    unsigned n = particles.size();
+    Vec3 offset = pointOffset();
+    float intensityDelta = f.timeDelta * intensityRate;
 
-        if (f.distanceOutsideBoundingBox(appearance[i].point) > outsideMargin * appearance[i].radius) {
-            // Escaped
-            continue;
-        }
+    for (unsigned i = 0; i < n; i++) {
+        particles.point[i] = tree[i].point + offset;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        particles.intensity[i] = std::min(maxIntensity, particles.intensity[i] + intensityDelta);
+    }
 
-        if (j != i) {
-            appearance[j] = appearance[i];
-            tree[j] = tree[i];
-        }
-        j++;
+    // Discard escaped particles
+    keep.resize(n);
+    for (unsigned i = 0; i < n; i++) {
+        keep[i] = !(f.distanceOutsideBoundingBox(particles.point[i]) > outsideMargin * particles.radius[i]);
     }
-    appearance.resize(j);
-    tree.resize(j);
+    particles.compact(keep);
+    ParticleVector::compactArray(tree, keep);
 }
 
 inline void Forest::addPoint()
 {
-    ParticleAppearance pa;
     TreeInfo ti;
 
-    pa.radius = s.value(config["radius"]);
-    pa.intensity = 0;
+    float radius = s.value(config["radius"]);
 
     int root = std::max<int>(0,
-        s.uniform(appearance.size() - s.value(config["historyDepth"]),
-                  appearance.size() + s.value(config["newnessBias"])));
+        s.uniform(particles.size() - s.value(config["historyDepth"]),
+                  particles.size() + s.value(config["newnessBias"])));
 
-    if (root >= (int)appearance.size()) {
+    if (root >= (int)particles.size()) {
         // Start a new tree
         newTexCoord += s.mRandom.circularVector() * s.value(config["walkTexCoord"]);
         ti.texCoord = newTexCoord;
@@ -168,14 +168,15 @@ inline void Forest::addPoint()
     ti.texCoord[0] = std::min(1.0f, std::max(0.0f, ti.texCoord[0]));
     ti.texCoord[1] = std::min(1.0f, std::max(0.0f, ti.texCoord[1]));
 
-    pa.color = palette.sample(ti.texCoord);
-
-    appearance.push_back(pa);
+    unsigned i = particles.add();
+    particles.radius[i] = radius;
+    particles.intensity[i] = 0;
+    particles.color[i] = palette.sample(ti.texCoord);
     tree.push_back(ti);
 }
 
 inline void Forest::debug(const DebugInfo &di)
 {
     ParticleEffect::debug(di);
-    fprintf(stderr, "\t[forest] numParticles = %d\n", (int)appearance.size());
+    fprintf(stderr, "\t[forest] numParticles = %d\n", (int)particles.size());
 }
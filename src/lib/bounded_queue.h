@@ -0,0 +1,154 @@
+/*
+ * Bounded queue, for handing work from a latency-sensitive producer
+ * (like the camera thread) to a background consumer.
+ *
+ * The producer never waits for the consumer. When the queue is full,
+ * the oldest item is dropped to make room, and the drop is counted.
+ * Slots are preallocated and recycled, so items holding containers like
+ * std::vector keep their storage from one use to the next.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "tinythread.h"
+
+
+template <typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(unsigned capacity = 1);
+
+    // Change the capacity. Only safe before the consumer starts.
+    void setCapacity(unsigned capacity);
+
+    // Add a copy of an item, dropping the oldest one if we're full. Never blocks
+    // on the consumer. Returns false if an item had to be dropped.
+    bool push(const T &item);
+
+    // Like push(), but swaps the item in instead of copying it. Afterward 'item'
+    // holds a recycled slot, whose old contents are there to be reused.
+    bool pushSwap(T &item);
+
+    // Wait for the oldest item, and swap it into 'item'.
+    // The consumer's old buffers go back into the queue for reuse.
+    void pop(T &item);
+
+    // Return the number of items dropped since the last call, and reset the count
+    unsigned takeDropped();
+
+private:
+    std::vector<T> slots;
+    unsigned head;
+    unsigned count;
+    unsigned dropped;
+    tthread::mutex lock;
+    tthread::condition_variable cond;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+template <typename T>
+inline BoundedQueue<T>::BoundedQueue(unsigned capacity)
+    : slots(std::max(1u, capacity)), head(0), count(0), dropped(0)
+{}
+
+template <typename T>
+inline void BoundedQueue<T>::setCapacity(unsigned capacity)
+{
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    slots.clear();
+    slots.resize(std::max(1u, capacity));
+    head = 0;
+    count = 0;
+}
+
+template <typename T>
+inline bool BoundedQueue<T>::push(const T &item)
+{
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    bool ok = true;
+
+    if (count == slots.size()) {
+        // Full; the oldest item is overwritten below
+        head = (head + 1) % slots.size();
+        count--;
+        dropped++;
+        ok = false;
+    }
+
+    slots[(head + count) % slots.size()] = item;
+    count++;
+    cond.notify_one();
+    return ok;
+}
+
+template <typename T>
+inline bool BoundedQueue<T>::pushSwap(T &item)
+{
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    bool ok = true;
+
+    if (count == slots.size()) {
+        head = (head + 1) % slots.size();
+        count--;
+        dropped++;
+        ok = false;
+    }
+
+    std::swap(slots[(head + count) % slots.size()], item);
+    count++;
+    cond.notify_one();
+    return ok;
+}
+
+template <typename T>
+inline void BoundedQueue<T>::pop(T &item)
+{
+    tthread::lock_guard<tthread::mutex> guard(lock);
+
+    while (count == 0) {
+        cond.wait(lock);
+    }
+
+    std::swap(item, slots[head]);
+    head = (head + 1) % slots.size();
+    count--;
+}
+
+template <typename T>
+inline unsigned BoundedQueue<T>::takeDropped()
+{
+    tthread::lock_guard<tthread::mutex> guard(lock);
+    unsigned n = dropped;
+    dropped = 0;
+    return n;
+}
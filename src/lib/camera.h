@@ -48,4 +48,29 @@ namespace Camera {
 
     // Start the camera on a new thread
     tthread::thread* start(videoCallback_t callback, void *context = 0);
+
+    /*
+     * Synthetic video, for testing without camera hardware: textured blobs
+     * moving over a textured background, with noise and lighting flicker.
+     * Fields go through the same callback, in chunks like the real camera's.
+     *
+     * The ground truth log has one line per field: timestamp, field count, then
+     * the running totals of the blobs' average X and Y motion and path length, in pixels.
+     */
+    struct SyntheticOptions {
+        float fieldRate;            // Fields per second; zero runs as fast as possible
+        unsigned blobs;             // Number of moving blobs
+        float blobRadius;           // Blob radius, in pixels
+        float blobSpeed;            // Maximum blob speed, in pixels per field
+        float noise;                // Peak luminance noise, in 8-bit units
+        float flicker;              // Lighting flicker depth, as a fraction of brightness
+        float flickerRate;          // Lighting flicker frequency, in Hz
+        unsigned chunkBytes;        // Largest chunk handed to the callback
+        unsigned seed;              // Random seed for the scene
+        const char *groundTruthLog; // Filename for ground truth motion, or null
+    };
+
+    // Start a synthetic camera on a new thread, instead of the real one
+    tthread::thread* startSynthetic(videoCallback_t callback, void *context,
+        const SyntheticOptions &options);
 };
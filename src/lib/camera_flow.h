@@ -45,11 +45,16 @@
 #include <opencv2/opencv.hpp>
 #include <stdio.h>
 #include <string>
+#include <queue>
+#include <sys/time.h>
 #include "effect.h"
 #include "particle.h"
 #include "color.h"
 #include "camera.h"
 #include "prng.h"
+#include "seqlock.h"
+#include "bounded_queue.h"
+#include "tinythread.h"
 
 
 class CameraFlowCapture;
@@ -65,7 +70,7 @@ class CameraFlowAnalyzer {
 public:
     CameraFlowAnalyzer();
 
-    // Process another chunk of video
+    // Process another chunk of video. Flow analysis for each field runs on its own thread.
     void process(const Camera::VideoChunk &chunk);
 
     // Change the transform we use to calculate model coordinates.
@@ -74,6 +79,46 @@ public:
     // Set vision parameters from JSON object
     void setConfig(const rapidjson::Value &config);
 
+    // Motion state, published once per analyzed field
+    struct Snapshot {
+        uint32_t integratorX, integratorY;  // Optical flow integrators, in 16:16 fixed point
+        uint32_t integratorL;               // Total motion length integrator, in 16:16 fixed point
+        float filterSlowL;                  // Length filtered at video rate, approximate noise floor
+        float filterFastL;                  // Length filtered at video rate, motion signal
+        uint32_t sequence;                  // Number of fields analyzed so far
+        unsigned field;                     // Which field was analyzed last
+        double timestamp;                   // When that field finished arriving, in seconds
+
+        // Filtered motion relative to the noise floor
+        float instantaneousMotion() const;
+
+        // Seconds between the field's arrival and now
+        double age() const;
+    };
+
+    // Latest motion state. Lock-free, safe to call from any thread.
+    Snapshot snapshot() const;
+
+    // Dense motion field, optionally published once per analyzed field
+    struct MotionGrid {
+        static const unsigned kWidth = 16;
+        static const unsigned kHeight = 12;
+
+        float x[kHeight][kWidth];           // Filtered motion, in pixels per field
+        float y[kHeight][kWidth];
+        uint32_t sequence;                  // Snapshot::sequence of the latest field; zero if disabled
+        double timestamp;                   // When that field finished arriving, in seconds
+
+        // Bilinear sample, with (u, v) from 0 to 1 across the camera image
+        Vec2 sample(float u, float v) const;
+    };
+
+    // Latest dense motion field. Lock-free, safe to call from any thread.
+    MotionGrid motionGrid() const;
+
+    // Current time, on the same clock as Snapshot::timestamp
+    static double now();
+
     // Random number generator including entropy from video data
     PRNG prng;
 
@@ -87,6 +132,7 @@ private:
     std::string motionLogFile;      // Filename for motion integrator logs
     float debugMotionZoom;          // Scale factor for motion bars in debug video
     unsigned maxPoints;             // Max number of corner points to track at once
+    unsigned maxNewPoints;          // Max number of new points to discover per field
     unsigned decimate;              // Divide horizontal video resolution by skipping samples
     unsigned discoveryGridSpacing;  // Pixels per unit in the low-res point discovery sampling grid
     unsigned pointTrialPeriod;      // Number of frames to keep a point before discarding
@@ -97,6 +143,14 @@ private:
     float motionFilterFast;         // First motion filter, higher frequency
     float motionFilterSlow;         // Second motion filter, low frequency
     float motionLogInterval;        // Seconds between motion integrator log records
+    unsigned motionLogQueueLength;  // Max motion log records waiting to be written
+    unsigned debugFrameQueueLength; // Max debug frames waiting to be written
+    bool denseFlow;                 // Also calculate a low-resolution dense motion field
+    float denseFlowScale;           // Size of the dense flow image, relative to the decimated field
+    unsigned denseFlowLevels;       // Image pyramid levels for dense flow
+    unsigned denseFlowWinSize;      // Averaging window size for dense flow
+    unsigned denseFlowIterations;   // Iterations at each pyramid level for dense flow
+    float denseFlowFilter;          // Filter rate for the published motion grid
 
     struct PointInfo {
         PointInfo();
@@ -108,9 +162,32 @@ private:
     };
 
     struct Field {
+        // Owned by the flow thread: [0] is the previous field, [1] the current one
         cv::Mat frames[2];
         std::vector<cv::Point2f> points;
         std::vector<PointInfo> pointInfo;
+        PRNG prng;
+
+        // Number of points in each discovery grid cell, updated as points come and go
+        std::vector<uint8_t> coverage;
+        int gridWidth, gridHeight;
+
+        // Downsampled frames [0] previous, [1] current, and their dense flow
+        cv::Mat denseFrames[2];
+        cv::Mat denseFlowField;
+
+        // Camera thread fills 'capture', then trades it for 'ready' under 'lock'
+        cv::Mat capture;
+        cv::Mat ready;
+        double readyTimestamp;
+        double timestamp;
+        bool pending;
+        unsigned droppedFields;
+
+        CameraFlowAnalyzer *analyzer;
+        tthread::thread *thread;
+        tthread::mutex lock;
+        tthread::condition_variable cond;
     };
 
     #ifdef USE_OPENCV_VIDEO
@@ -118,30 +195,67 @@ private:
     #endif
     Field fields[Camera::kFields];
 
-    // Optical flow integrators, in 16:16 fixed point
-    uint32_t integratorX, integratorY;
-
-    // Total motion length integrator, in 16:16 fixed point
-    uint32_t integratorL;
-
-    // Length filtered at video rate
+    // Motion state is updated by any field thread holding stateLock,
+    // and published to other threads without locking.
+    tthread::mutex stateLock;
+    Snapshot state;
     uint32_t filterCaptureL;
-    float filterSlowL;
-    float filterFastL;
+    SeqLock<Snapshot> published;
+    MotionGrid grid;
+    SeqLock<MotionGrid> publishedGrid;
 
     // Current transform
     Vec3 basisX, basisY, origin;
 
+    // Debug video and motion logs are drawn and written on background threads,
+    // so disk and encoder stalls never hold up the camera or flow threads.
+    // They have separate queues, so a burst of debug frames can't push out log records.
+    struct MotionLogRecord {
+        double timestamp;
+        Snapshot state;
+    };
+
+    struct DebugFrameRecord {
+        double timestamp;
+        Snapshot state;
+        cv::Mat frame;                      // Copy of the field
+        std::vector<cv::Point2f> points;
+        std::vector<PointInfo> pointInfo;
+        MotionGrid grid;
+    };
+
+    BoundedQueue<MotionLogRecord> motionLogQueue;
+    BoundedQueue<DebugFrameRecord> debugFrameQueue;
+    tthread::thread *motionLogThread;
+    tthread::thread *debugFrameThread;
+
+    tthread::mutex debugLock;
     unsigned debugFrameCounter;
-    uint32_t debugCaptureL;
 
+    // Owned by the writer threads once they start
+    uint32_t debugCaptureL;
     FILE *motionLogStream;
+
+    // Owned by the camera thread
     double motionLogTimestamp;
 
     static uint32_t stringToFourCC(const std::string &f);
+    static void fieldThreadFunc(void *context);
+    static void motionLogThreadFunc(void *context);
+    static void debugFrameThreadFunc(void *context);
+    void fieldWorker(Field &f);
+    void motionLogWorker();
+    void debugFrameWorker();
+    void writeDebugFrame(const DebugFrameRecord &r);
+    void startThreads();
     void calculateFlow(Field &f);
+    void discoverPoints(Field &f);
+    int coverageCell(const Field &f, cv::Point2f p) const;
+    void addPoint(Field &f, cv::Point2f p, const PointInfo &info);
+    void removePoint(Field &f, unsigned i);
+    void calculateDenseFlow(Field &f, const Snapshot &current);
+    Snapshot integrate(const Field &f, int32_t dx, int32_t dy, int32_t dl);
     void clear();
-    float instantaneousMotion() const;
 };
 
 
@@ -155,11 +269,26 @@ public:
     // Set the last captured flow position to be the origin
     void origin();
 
-    // Retrieve instantaneous, not integrated, value of the motion
-    // per video field, filtered on the video thread. Not affected
-    // by capture() / origin()
+    // Instantaneous, not integrated, value of the motion per video field,
+    // filtered on the video thread, as of the last capture(). Not affected
+    // by origin()
     float instantaneousMotion() const;
 
+    // Analyzer state as of the last capture()
+    const CameraFlowAnalyzer::Snapshot& lastCapture() const;
+
+    // How stale the last capture() was, in seconds since its field arrived
+    double age() const;
+
+    // Latest dense motion field, if the analyzer is calculating one
+    CameraFlowAnalyzer::MotionGrid motionGrid() const;
+
+    // Transform a vector in camera pixels to model coordinates
+    Vec3 modelVector(Vec2 pixels) const;
+
+    // Size of one analyzed field, in the same camera pixels
+    Vec2 fieldSize() const;
+
     // Raw x/y in pixels
     Vec2 pixels;
 
@@ -171,6 +300,7 @@ public:
 
 private:
     const CameraFlowAnalyzer &analyzer;
+    CameraFlowAnalyzer::Snapshot current;
     uint32_t captureX, captureY, captureL;
     uint32_t originX, originY, originL;
 };
@@ -188,6 +318,8 @@ private:
     float scale;
     float radius;
     float motionLengthScale;
+    float gridScale;
+    float gridIntensity;
 
     CameraFlowCapture flow;
 };
@@ -199,10 +331,20 @@ private:
 
 
 inline CameraFlowAnalyzer::CameraFlowAnalyzer()
-    : decimate(0), motionLogStream(NULL)
+    : decimate(0), motionLogThread(0), debugFrameThread(0), motionLogStream(NULL)
 {
     prng.seed(29);
 
+    for (unsigned i = 0; i < Camera::kFields; i++) {
+        fields[i].prng.seed(30 + i);
+        fields[i].pending = false;
+        fields[i].droppedFields = 0;
+        fields[i].readyTimestamp = 0;
+        fields[i].timestamp = 0;
+        fields[i].analyzer = this;
+        fields[i].thread = 0;
+    }
+
     // Default transform is identity
     setTransform( Vec3(1, 0, 0), Vec3(0, 1, 0), Vec3(0, 0, 0) );
 }
@@ -224,6 +366,7 @@ inline void CameraFlowAnalyzer::setConfig(const rapidjson::Value &config)
     }
 
     maxPoints = config["maxPoints"].GetUint();
+    maxNewPoints = config["maxNewPoints"].GetUint();
     decimate = config["decimate"].GetUint();
     discoveryGridSpacing = config["discoveryGridSpacing"].GetUint();
     pointTrialPeriod = config["pointTrialPeriod"].GetUint();
@@ -236,6 +379,14 @@ inline void CameraFlowAnalyzer::setConfig(const rapidjson::Value &config)
     debugMotionZoom = config["debugMotionZoom"].GetDouble();
     motionLogFile = config["motionLogFile"].GetString();
     motionLogInterval = config["motionLogInterval"].GetDouble();
+    motionLogQueueLength = config["motionLogQueueLength"].GetUint();
+    debugFrameQueueLength = config["debugFrameQueueLength"].GetUint();
+    denseFlow = config["denseFlow"].GetBool();
+    denseFlowScale = config["denseFlowScale"].GetDouble();
+    denseFlowLevels = config["denseFlowLevels"].GetUint();
+    denseFlowWinSize = config["denseFlowWinSize"].GetUint();
+    denseFlowIterations = config["denseFlowIterations"].GetUint();
+    denseFlowFilter = config["denseFlowFilter"].GetDouble();
 
     const rapidjson::Value& t = config["transform"];
     if (t.IsArray() && t.Size() == 9) {
@@ -246,6 +397,9 @@ inline void CameraFlowAnalyzer::setConfig(const rapidjson::Value &config)
 
     // Resize arrays
     clear();
+
+    // Flow analysis threads start once we're configured
+    startThreads();
 }
 
 inline CameraFlowAnalyzer::PointInfo::PointInfo()
@@ -258,20 +412,35 @@ inline CameraFlowAnalyzer::PointInfo::PointInfo(unsigned maxAge)
 
 inline void CameraFlowAnalyzer::clear()
 {
-    integratorX = integratorY = integratorL = 0;
+    // Called before any video arrives; the field threads aren't touching state yet.
+
+    memset(&state, 0, sizeof state);
+    state.filterSlowL = 1.0f;
+    state.timestamp = now();
+    published.store(state);
+    memset(&grid, 0, sizeof grid);
+    publishedGrid.store(grid);
+    filterCaptureL = 0;
     debugFrameCounter = 0;
     debugCaptureL = 0;
-    filterSlowL = 1.0f;
-    filterFastL = 0;
-    filterCaptureL = 0; 
 
     for (unsigned i = 0; i < Camera::kFields; i++) {
         if (decimate != 0) {
             for (unsigned j = 0; j < 2; j++) {
                 fields[i].frames[j] = cv::Mat::zeros(Camera::kLinesPerField, Camera::kPixelsPerLine / decimate, CV_8UC1);
             }
+            fields[i].capture = cv::Mat::zeros(Camera::kLinesPerField, Camera::kPixelsPerLine / decimate, CV_8UC1);
+            fields[i].ready = cv::Mat::zeros(Camera::kLinesPerField, Camera::kPixelsPerLine / decimate, CV_8UC1);
         }
+        fields[i].denseFrames[0] = cv::Mat();
+        fields[i].denseFrames[1] = cv::Mat();
+        fields[i].denseFlowField = cv::Mat();
         fields[i].points.clear();
+        fields[i].pointInfo.clear();
+        fields[i].gridWidth = fields[i].frames[0].size().width / discoveryGridSpacing;
+        fields[i].gridHeight = fields[i].frames[0].size().height / discoveryGridSpacing;
+        fields[i].coverage.assign(fields[i].gridWidth * fields[i].gridHeight, 0);
+        fields[i].pending = false;
     }
 
     #ifdef USE_OPENCV_VIDEO
@@ -290,6 +459,9 @@ inline void CameraFlowAnalyzer::clear()
     if (!motionLogStream) {
         perror("Error opening motion log file");
     }
+
+    motionLogQueue.setCapacity(motionLogQueueLength);
+    debugFrameQueue.setCapacity(debugFrameQueueLength);
 }
 
 inline void CameraFlowAnalyzer::process(const Camera::VideoChunk &chunk)
@@ -315,7 +487,7 @@ inline void CameraFlowAnalyzer::process(const Camera::VideoChunk &chunk)
     }
 
     Field &f = fields[iter.field];
-    cv::Mat &image = f.frames[1];
+    cv::Mat &image = f.capture;
     uint8_t *dest = image.data +
         iter.line * (Camera::kPixelsPerLine / decimate)
         + iter.byteOffset / bytesPerSample;
@@ -329,21 +501,30 @@ inline void CameraFlowAnalyzer::process(const Camera::VideoChunk &chunk)
 
     if (iter.line == Camera::kLinesPerField - 1 &&
         chunk.byteCount + chunk.byteOffset == Camera::kBytesPerLine) {
-        calculateFlow(f);
 
-        // Check time elapsed for motion logging
-        if (motionLogStream) {
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            double now = tv.tv_sec + tv.tv_usec * 1e-6;
-            if (now >= motionLogTimestamp + motionLogInterval) {
+        // Hand the finished field to its flow thread. If the thread is still busy
+        // with the last one, the older field is replaced rather than queued.
 
-                fprintf(motionLogStream, "%f 0x%x 0x%x 0x%x\n",
-                    now, integratorX, integratorY, integratorL);
-                fflush(motionLogStream);
+        double timestamp = now();
 
-                motionLogTimestamp = now;
-            }
+        f.lock.lock();
+        if (f.pending) {
+            f.droppedFields++;
+        }
+        std::swap(f.capture, f.ready);
+        f.readyTimestamp = timestamp;
+        f.pending = true;
+        f.cond.notify_one();
+        f.lock.unlock();
+
+        // Check time elapsed for motion logging; the log thread does the I/O
+        if (motionLogStream && timestamp >= motionLogTimestamp + motionLogInterval) {
+            MotionLogRecord r;
+            r.timestamp = timestamp;
+            r.state = snapshot();
+            motionLogQueue.push(r);
+
+            motionLogTimestamp = timestamp;
         }
     }
 }
@@ -356,7 +537,172 @@ inline uint32_t CameraFlowAnalyzer::stringToFourCC(const std::string &f)
                      f.size() >= 4 ? f[3] : 0);
 }
 
-inline float CameraFlowAnalyzer::instantaneousMotion() const
+inline void CameraFlowAnalyzer::startThreads()
+{
+    for (unsigned i = 0; i < Camera::kFields; i++) {
+        if (!fields[i].thread) {
+            fields[i].thread = new tthread::thread(fieldThreadFunc, &fields[i]);
+        }
+    }
+
+    if (!motionLogThread) {
+        motionLogThread = new tthread::thread(motionLogThreadFunc, this);
+    }
+    if (!debugFrameThread) {
+        debugFrameThread = new tthread::thread(debugFrameThreadFunc, this);
+    }
+}
+
+inline void CameraFlowAnalyzer::motionLogThreadFunc(void *context)
+{
+    static_cast<CameraFlowAnalyzer*>(context)->motionLogWorker();
+}
+
+inline void CameraFlowAnalyzer::debugFrameThreadFunc(void *context)
+{
+    static_cast<CameraFlowAnalyzer*>(context)->debugFrameWorker();
+}
+
+inline void CameraFlowAnalyzer::motionLogWorker()
+{
+    MotionLogRecord r;
+
+    while (true) {
+        motionLogQueue.pop(r);
+
+        unsigned dropped = motionLogQueue.takeDropped();
+        if (dropped) {
+            fprintf(stderr, "flow: Motion log fell behind, dropped %d records\n", dropped);
+        }
+
+        if (motionLogStream) {
+            fprintf(motionLogStream, "%f 0x%x 0x%x 0x%x\n",
+                r.timestamp, r.state.integratorX, r.state.integratorY, r.state.integratorL);
+            fflush(motionLogStream);
+        }
+    }
+}
+
+inline void CameraFlowAnalyzer::debugFrameWorker()
+{
+    // Records are swapped out of the queue, so their buffers get recycled
+    DebugFrameRecord r;
+
+    while (true) {
+        debugFrameQueue.pop(r);
+
+        unsigned dropped = debugFrameQueue.takeDropped();
+        if (dropped) {
+            fprintf(stderr, "flow: Debug video fell behind, dropped %d frames\n", dropped);
+        }
+
+        writeDebugFrame(r);
+    }
+}
+
+inline void CameraFlowAnalyzer::fieldThreadFunc(void *context)
+{
+    Field *f = static_cast<Field*>(context);
+    f->analyzer->fieldWorker(*f);
+}
+
+inline void CameraFlowAnalyzer::fieldWorker(Field &f)
+{
+    /*
+     * Each NTSC field gets a dedicated thread. The fields are independent until
+     * their results meet in the shared integrators, so both can be in flight at once.
+     */
+
+    while (true) {
+        f.lock.lock();
+        while (!f.pending) {
+            f.cond.wait(f.lock);
+        }
+        std::swap(f.ready, f.frames[1]);
+        f.timestamp = f.readyTimestamp;
+        unsigned dropped = f.droppedFields;
+        f.droppedFields = 0;
+        f.pending = false;
+        f.lock.unlock();
+
+        if (debug && dropped) {
+            fprintf(stderr, "flow[%d]: Flow thread fell behind, dropped %d fields\n",
+                (int)(&f - &fields[0]), dropped);
+        }
+
+        calculateFlow(f);
+    }
+}
+
+inline CameraFlowAnalyzer::Snapshot CameraFlowAnalyzer::integrate(const Field &f, int32_t dx, int32_t dy, int32_t dl)
+{
+    stateLock.lock();
+
+    state.integratorX += dx;
+    state.integratorY += dy;
+    state.integratorL += dl;
+
+    // Update fixed-timestep motion filters on each field
+    uint32_t cL = state.integratorL;
+    float fL = int32_t(cL - filterCaptureL) * (1.0f / 0x10000);
+    filterCaptureL = cL;
+    state.filterSlowL += (fL - state.filterSlowL) * motionFilterSlow;
+    state.filterFastL += (fL - state.filterFastL) * motionFilterFast;
+
+    state.sequence++;
+    state.field = &f - &fields[0];
+    state.timestamp = f.timestamp;
+
+    Snapshot result = state;
+    published.store(result);
+
+    stateLock.unlock();
+    return result;
+}
+
+inline CameraFlowAnalyzer::Snapshot CameraFlowAnalyzer::snapshot() const
+{
+    return published.load();
+}
+
+inline CameraFlowAnalyzer::MotionGrid CameraFlowAnalyzer::motionGrid() const
+{
+    return publishedGrid.load();
+}
+
+inline Vec2 CameraFlowAnalyzer::MotionGrid::sample(float u, float v) const
+{
+    // Cell centers are at half-integer grid coordinates
+    float gx = std::max(0.0f, std::min(float(kWidth - 1), u * kWidth - 0.5f));
+    float gy = std::max(0.0f, std::min(float(kHeight - 1), v * kHeight - 0.5f));
+    unsigned x0 = gx, y0 = gy;
+    unsigned x1 = std::min(x0 + 1, kWidth - 1);
+    unsigned y1 = std::min(y0 + 1, kHeight - 1);
+    float fx = gx - x0, fy = gy - y0;
+
+    float top[2], bottom[2];
+    top[0] = x[y0][x0] + (x[y0][x1] - x[y0][x0]) * fx;
+    top[1] = y[y0][x0] + (y[y0][x1] - y[y0][x0]) * fx;
+    bottom[0] = x[y1][x0] + (x[y1][x1] - x[y1][x0]) * fx;
+    bottom[1] = y[y1][x0] + (y[y1][x1] - y[y1][x0]) * fx;
+
+    return Vec2( top[0] + (bottom[0] - top[0]) * fy,
+                 top[1] + (bottom[1] - top[1]) * fy );
+}
+
+inline double CameraFlowAnalyzer::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+inline double CameraFlowAnalyzer::Snapshot::age() const
+{
+    return now() - timestamp;
+}
+
+inline float CameraFlowAnalyzer::Snapshot::instantaneousMotion() const
 {
     float f = filterFastL;  // Filtered signal
     float s = filterSlowL;  // Approximate noise floor
@@ -373,18 +719,19 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
     /*
      * Each NTSC field has its own independent flow calculator, so that we can react to
      * each field as soon as it arrives without worrying about correlating inter-field motion.
+     * This runs on the field's own thread, and may run concurrently with the other field.
      */
 
     cv::TermCriteria termcrit(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS, 20, 0.03);
-    cv::Size subPixWinSize(6,6), winSize(15,15);
+    cv::Size winSize(15,15);
 
-    int pointsToDelete = (int) prng.uniform(0, 1.0f + deletePointProbability);
+    int pointsToDelete = (int) f.prng.uniform(0, 1.0f + deletePointProbability);
     while (pointsToDelete > 0 && !f.points.empty()) {
 
         // Randomly delete a tracking point, to keep them from getting stuck in unhelpful
         // places and to help ensure there's a steady flow of slots for new points to spawn into.
 
-        int i = std::min<int>(f.points.size()-1, prng.uniform(0, f.points.size()));
+        int i = std::min<int>(f.points.size()-1, f.prng.uniform(0, f.points.size()));
 
         if (debug) {
             fprintf(stderr, "flow[%d]: Random delete of point %d (age = %d, distance = %f)\n",
@@ -392,87 +739,20 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
                 i, f.pointInfo[i].age, f.pointInfo[i].distanceTraveled);
         }
 
-        f.points.erase(f.points.begin() + i, f.points.begin() + i + 1);
-        f.pointInfo.erase(f.pointInfo.begin() + i, f.pointInfo.begin() + i + 1);
+        removePoint(f, i);
         pointsToDelete--;
     }
 
     if (f.points.size() < maxPoints) {
-        /*
-         * Look for more points to track. We specifically want to focus on areas that are moving,
-         * as if we were subtracting the background. (Actual background subtraction isn't
-         * worth the CPU cost, in our case.) We also want to avoid points too near to any existing
-         * ones.
-         *
-         * To quickly find some interesting points, I further decimate the image into a sparse
-         * grid, and look for corners near the grid points that have the most motion.
-         */
-
-        cv::Size frameSize = f.frames[0].size();
-        int gridWidth = frameSize.width / discoveryGridSpacing;
-        int gridHeight = frameSize.height / discoveryGridSpacing;
-
-        std::vector<bool> gridCoverage;
-        gridCoverage.resize(gridWidth * gridHeight);
-        std::fill(gridCoverage.begin(), gridCoverage.end(), false);
-
-        // Calculate coverage of the discovery grid 
-        for (unsigned i = 0; i < f.points.size(); i++) {
-            int x = f.points[i].x / discoveryGridSpacing;
-            int y = f.points[i].y / discoveryGridSpacing;
-            unsigned idx = x + y * gridWidth;
-            if (idx < gridCoverage.size()) {
-                gridCoverage[idx] = true;
-            }
-        }
-
-        // Look for the highest-motion point that isn't already on the grid, ignoring image edges.
-
-        cv::Point2f bestPoint = cv::Point2f(0, 0);
-        int bestDiff = 0;
-
-        for (int y = 1; y < gridHeight - 1; y++) {
-            for (int x = 1; x < gridWidth - 1; x++) {
-                if (!gridCoverage[x + y * gridWidth]) {
-
-                    // Random sampling bias, to avoid creating identical tracking points
-                    const float s = discoveryGridSpacing * 0.4;
-                    int pixX = x * discoveryGridSpacing + prng.uniform(-s, s);
-                    int pixY = y * discoveryGridSpacing + prng.uniform(-s, s);
-
-                    int diff = (int)f.frames[1].at<uint8_t>(pixY, pixX) - (int)f.frames[0].at<uint8_t>(pixY, pixX);
-                    int diff2 = diff * diff;
-
-                    if (diff2 > bestDiff) {
-                        bestDiff = diff2;
-                        bestPoint = cv::Point2f(pixX, pixY);
-                    }
-                }
-            }
-        }
-
-        if (bestDiff > 0) {
-            // Find a good corner near this point
-            std::vector<cv::Point2f> newPoint;
-            newPoint.push_back(bestPoint);
-            cv::cornerSubPix(f.frames[0], newPoint, subPixWinSize, cv::Size(-1,-1), termcrit);
-
-            // New point
-            unsigned maxAge = prng.uniform(0, maxPointAge);
-            f.points.push_back(newPoint[0]);
-            f.pointInfo.push_back(PointInfo(maxAge));
-
-            if (debug) {
-                fprintf(stderr, "flow[%d]: Detecting new point (%f, %f) -> (%f, %f). %d points total\n",
-                    (int)(&f - &fields[0]),
-                    bestPoint.x, bestPoint.y,
-                    newPoint[0].x, newPoint[0].y,
-                    (int)f.points.size());
-            }
-        }
+        discoverPoints(f);
     }
 
-    if (!f.points.empty()) {
+    // This field's contribution to the integrators
+    int32_t deltaX = 0, deltaY = 0, deltaL = 0;
+    bool tracking = !f.points.empty();
+    float denominator = 0;
+
+    if (tracking) {
         // Run Lucas-Kanade tracker
 
         std::vector<cv::Point2f> points;
@@ -480,7 +760,6 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
         std::vector<float> err;
 
         cv::Point2f numerator = cv::Point2f(0, 0);
-        float denominator = 0;
         float numeratorL = 0, denominatorL = 0;
 
         cv::calcOpticalFlowPyrLK(f.frames[0], f.frames[1], f.points,
@@ -495,6 +774,8 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
                 PointInfo info = f.pointInfo[i];
                 cv::Point2f prevLocation = f.points[i];
                 cv::Point2f nextLocation = points[i];
+                int prevCell = coverageCell(f, prevLocation);
+                int nextCell = coverageCell(f, nextLocation);
                 cv::Point2f motion = nextLocation - prevLocation;
                 float distance = sqrtf(motion.x * motion.x + motion.y * motion.y);
 
@@ -513,6 +794,11 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
                     f.points[j] = nextLocation;
                     j++;
 
+                    if (prevCell != nextCell) {
+                        if (prevCell >= 0) f.coverage[prevCell]--;
+                        if (nextCell >= 0) f.coverage[nextCell]++;
+                    }
+
                     // Add to overall flow vector, using the point age and error to weight it
                     if (info.age > pointTrialPeriod) {
                         float weight = (info.age - pointTrialPeriod) / err[i];
@@ -525,94 +811,71 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
                         denominatorL += weight;
                     }
 
-                } else if (debug) {
-                    fprintf(stderr, "flow[%d]: Forgetting point %d with age=%d distance=%f speed=%f\n",
-                        (int)(&f - &fields[0]),
-                        i, info.age,
-                        info.distanceTraveled, info.distanceTraveled / info.age);
+                } else {
+                    if (prevCell >= 0) f.coverage[prevCell]--;
+
+                    if (debug) {
+                        fprintf(stderr, "flow[%d]: Forgetting point %d with age=%d distance=%f speed=%f\n",
+                            (int)(&f - &fields[0]),
+                            i, info.age,
+                            info.distanceTraveled, info.distanceTraveled / info.age);
+                    }
+                }
+            } else {
+                int prevCell = coverageCell(f, f.points[i]);
+                if (prevCell >= 0) f.coverage[prevCell]--;
+
+                if (debug) {
+                    fprintf(stderr, "flow[%d]: Point %d lost tracking\n",
+                        (int)(&f - &fields[0]), i);
                 }
-            } else if (debug) {
-                fprintf(stderr, "flow[%d]: Point %d lost tracking\n",
-                    (int)(&f - &fields[0]), i);
             }
         }
 
         f.points.resize(j);
         f.pointInfo.resize(j);
 
-        // Update integrator using this field's data
+        // Integrator deltas from this field's data
         if (denominator) {
-            integratorX += int32_t(numerator.x * 0x10000 / denominator);
-            integratorY += int32_t(numerator.y * 0x10000 / denominator);
+            deltaX = int32_t(numerator.x * 0x10000 / denominator);
+            deltaY = int32_t(numerator.y * 0x10000 / denominator);
         }
         if (denominatorL) {
-            integratorL += int32_t(numeratorL * 0x10000 / denominatorL);
+            deltaL = int32_t(numeratorL * 0x10000 / denominatorL);
         }
+    }
 
-        if (debug) {
-            fprintf(stderr, "flow[%d]: Tracking %d points, integrator (%08x, %08x) L=%08x denominator=%f\n",
-                (int)(&f - &fields[0]),
-                (int)f.points.size(),
-                integratorX, integratorY, integratorL,
-                denominator);
-        }
+    // Integrators and motion filters update on every field
+    Snapshot current = integrate(f, deltaX, deltaY, deltaL);
+
+    if (debug && tracking) {
+        fprintf(stderr, "flow[%d]: Tracking %d points, integrator (%08x, %08x) L=%08x denominator=%f\n",
+            (int)(&f - &fields[0]),
+            (int)f.points.size(),
+            current.integratorX, current.integratorY, current.integratorL,
+            denominator);
     }
 
-    // Update fixed-timestep motion filters on each field
-    uint32_t cL = integratorL;
-    float fL = int32_t(cL - filterCaptureL) * (1.0f / 0x10000);
-    filterCaptureL = cL;
-    filterSlowL += (fL - filterSlowL) * motionFilterSlow;
-    filterFastL += (fL - filterFastL) * motionFilterFast;
+    if (denseFlow) {
+        calculateDenseFlow(f, current);
+    }
 
-    // Write frames to disk periodically in super-verbose debug mode
+    // Queue frames for the writer periodically in super-verbose debug mode
     #ifdef USE_OPENCV_VIDEO
         if (debug && debugFrameInterval) {
-            debugFrameCounter++;
-            if ((debugFrameCounter % debugFrameInterval) == 0 && debugVideoWriter.isOpened()) {
-
-                cv::Mat frame;
-                cv::cvtColor(f.frames[1], frame, cv::COLOR_GRAY2BGR);
-
-                // Draw circles over each point; shade = age
-                for (unsigned i = 0; i < f.points.size(); ++i) {
-                    int l = std::min<int>(255, f.pointInfo[i].age);
-                    cv::circle(frame, f.points[i], 2,
-                            f.pointInfo[i].age < pointTrialPeriod
-                                ? cv::Scalar(0, 0, 0)
-                                : cv::Scalar(l, 64 + l/2, 255 - l),
-                            1, CV_AA);
-                }
-
-                // Motion length since the last debug frame, scaled to units of pixels per field
-                uint32_t prevL = debugCaptureL;
-                uint32_t nextL = integratorL;
-                float zoom = debugMotionZoom;
-                debugCaptureL = nextL;
-                float debugL = int32_t(nextL - prevL) * (zoom / 0x10000 / debugFrameInterval);
-                cv::rectangle(frame,
-                    cv::Point2f(1, 1),
-                    cv::Point2f(3 + debugL, 4),
-                    cv::Scalar(250, 176, 0), -1, CV_AA);
-
-                // Filtered motion length dots
-                cv::rectangle(frame,
-                    cv::Point2f(1 + filterFastL * zoom, 6),
-                    cv::Point2f(3 + filterFastL * zoom, 8),
-                    cv::Scalar(255, 255, 190), -1, CV_AA);
-                cv::rectangle(frame,
-                    cv::Point2f(1 + filterSlowL * zoom, 10),
-                    cv::Point2f(3 + filterSlowL * zoom, 12),
-                    cv::Scalar(255, 190, 255), -1, CV_AA);
-
-                // Computed instantaneoud motion
-                float iM = instantaneousMotion();
-                cv::rectangle(frame,
-                    cv::Point2f(1, 14),
-                    cv::Point2f(3 + iM * zoom, 16),
-                    cv::Scalar(64, 64, 255), -1, CV_AA);
-
-                debugVideoWriter.write(frame);
+            debugLock.lock();
+            bool due = (++debugFrameCounter % debugFrameInterval) == 0;
+            debugLock.unlock();
+
+            if (due) {
+                DebugFrameRecord r;
+                r.timestamp = f.timestamp;
+                r.state = current;
+                r.frame = f.frames[1].clone();
+                r.points = f.points;
+                r.pointInfo = f.pointInfo;
+                r.grid = motionGrid();
+                debugFrameQueue.push(r);
             }
         }
     #endif
@@ -620,12 +883,269 @@ inline void CameraFlowAnalyzer::calculateFlow(Field &f)
     std::swap(f.frames[0], f.frames[1]);
 }
 
+inline void CameraFlowAnalyzer::writeDebugFrame(const DebugFrameRecord &r)
+{
+    #ifdef USE_OPENCV_VIDEO
+        if (!debugVideoWriter.isOpened()) {
+            return;
+        }
+
+        cv::Mat frame;
+        cv::cvtColor(r.frame, frame, cv::COLOR_GRAY2BGR);
+
+        // Draw circles over each point; shade = age
+        for (unsigned i = 0; i < r.points.size(); ++i) {
+            int l = std::min<int>(255, r.pointInfo[i].age);
+            cv::circle(frame, r.points[i], 2,
+                    r.pointInfo[i].age < pointTrialPeriod
+                        ? cv::Scalar(0, 0, 0)
+                        : cv::Scalar(l, 64 + l/2, 255 - l),
+                    1, CV_AA);
+        }
+
+        // Dense motion grid, as vectors from each cell center
+        if (denseFlow) {
+            const MotionGrid &g = r.grid;
+            float cellW = frame.cols / float(MotionGrid::kWidth);
+            float cellH = frame.rows / float(MotionGrid::kHeight);
+            for (unsigned y = 0; y < MotionGrid::kHeight; y++) {
+                for (unsigned x = 0; x < MotionGrid::kWidth; x++) {
+                    cv::Point2f c((x + 0.5f) * cellW, (y + 0.5f) * cellH);
+                    cv::Point2f m(g.x[y][x] * debugMotionZoom, g.y[y][x] * debugMotionZoom);
+                    cv::line(frame, c, cv::Point2f(c.x + m.x, c.y + m.y),
+                        cv::Scalar(64, 255, 64), 1, CV_AA);
+                }
+            }
+        }
+
+        // Motion length since the last debug frame, scaled to units of pixels per field
+        uint32_t prevL = debugCaptureL;
+        uint32_t nextL = r.state.integratorL;
+        float zoom = debugMotionZoom;
+        debugCaptureL = nextL;
+        float debugL = int32_t(nextL - prevL) * (zoom / 0x10000 / debugFrameInterval);
+        cv::rectangle(frame,
+            cv::Point2f(1, 1),
+            cv::Point2f(3 + debugL, 4),
+            cv::Scalar(250, 176, 0), -1, CV_AA);
+
+        // Filtered motion length dots
+        cv::rectangle(frame,
+            cv::Point2f(1 + r.state.filterFastL * zoom, 6),
+            cv::Point2f(3 + r.state.filterFastL * zoom, 8),
+            cv::Scalar(255, 255, 190), -1, CV_AA);
+        cv::rectangle(frame,
+            cv::Point2f(1 + r.state.filterSlowL * zoom, 10),
+            cv::Point2f(3 + r.state.filterSlowL * zoom, 12),
+            cv::Scalar(255, 190, 255), -1, CV_AA);
+
+        // Computed instantaneoud motion
+        float iM = r.state.instantaneousMotion();
+        cv::rectangle(frame,
+            cv::Point2f(1, 14),
+            cv::Point2f(3 + iM * zoom, 16),
+            cv::Scalar(64, 64, 255), -1, CV_AA);
+
+        debugVideoWriter.write(frame);
+    #endif
+}
+
+inline int CameraFlowAnalyzer::coverageCell(const Field &f, cv::Point2f p) const
+{
+    // Discovery grid cell containing a point, or -1 if it's outside the frame
+
+    if (!(p.x >= 0 && p.y >= 0)) {
+        return -1;
+    }
+    int x = p.x / discoveryGridSpacing;
+    int y = p.y / discoveryGridSpacing;
+    if (x >= f.gridWidth || y >= f.gridHeight) {
+        return -1;
+    }
+    return x + y * f.gridWidth;
+}
+
+inline void CameraFlowAnalyzer::addPoint(Field &f, cv::Point2f p, const PointInfo &info)
+{
+    int cell = coverageCell(f, p);
+    if (cell >= 0) {
+        f.coverage[cell]++;
+    }
+    f.points.push_back(p);
+    f.pointInfo.push_back(info);
+}
+
+inline void CameraFlowAnalyzer::removePoint(Field &f, unsigned i)
+{
+    // Point order doesn't matter, so fill the hole with the last point
+
+    int cell = coverageCell(f, f.points[i]);
+    if (cell >= 0) {
+        f.coverage[cell]--;
+    }
+    f.points[i] = f.points.back();
+    f.pointInfo[i] = f.pointInfo.back();
+    f.points.pop_back();
+    f.pointInfo.pop_back();
+}
+
+inline void CameraFlowAnalyzer::discoverPoints(Field &f)
+{
+    /*
+     * Look for more points to track. We specifically want to focus on areas that are moving,
+     * as if we were subtracting the background. (Actual background subtraction isn't
+     * worth the CPU cost, in our case.) We also want to avoid points too near to any existing
+     * ones.
+     *
+     * To quickly find some interesting points, I further decimate the image into a sparse
+     * grid, and look for corners near the grid points that have the most motion. The grid
+     * coverage is kept up to date as points move, so this is a single pass over the grid.
+     * We keep the best few candidates in a small heap, so that after a scene change we can
+     * pick up several points per field instead of just one.
+     */
+
+    unsigned count = std::min<unsigned>(maxNewPoints, maxPoints - f.points.size());
+    if (count == 0) {
+        return;
+    }
+
+    // Min-heap on motion, holding the best 'count' candidates seen so far
+    typedef std::pair<int, cv::Point2f> Candidate;
+    struct CandidateOrder {
+        bool operator() (const Candidate &a, const Candidate &b) const {
+            return a.first > b.first;
+        }
+    };
+    std::priority_queue<Candidate, std::vector<Candidate>, CandidateOrder> best;
+
+    // Ignoring image edges
+    for (int y = 1; y < f.gridHeight - 1; y++) {
+        for (int x = 1; x < f.gridWidth - 1; x++) {
+            if (!f.coverage[x + y * f.gridWidth]) {
+
+                // Random sampling bias, to avoid creating identical tracking points
+                const float s = discoveryGridSpacing * 0.4;
+                int pixX = x * discoveryGridSpacing + f.prng.uniform(-s, s);
+                int pixY = y * discoveryGridSpacing + f.prng.uniform(-s, s);
+
+                int diff = (int)f.frames[1].at<uint8_t>(pixY, pixX) - (int)f.frames[0].at<uint8_t>(pixY, pixX);
+                int diff2 = diff * diff;
+
+                if (diff2 > 0 && (best.size() < count || diff2 > best.top().first)) {
+                    if (best.size() == count) {
+                        best.pop();
+                    }
+                    best.push(Candidate(diff2, cv::Point2f(pixX, pixY)));
+                }
+            }
+        }
+    }
+
+    if (best.empty()) {
+        return;
+    }
+
+    // Find good corners near all of these points at once
+    std::vector<cv::Point2f> newPoints;
+    newPoints.reserve(best.size());
+    while (!best.empty()) {
+        newPoints.push_back(best.top().second);
+        best.pop();
+    }
+
+    cv::TermCriteria termcrit(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS, 20, 0.03);
+    cv::Size subPixWinSize(6,6);
+    cv::cornerSubPix(f.frames[0], newPoints, subPixWinSize, cv::Size(-1,-1), termcrit);
+
+    for (unsigned i = 0; i < newPoints.size(); i++) {
+        unsigned maxAge = f.prng.uniform(0, maxPointAge);
+        addPoint(f, newPoints[i], PointInfo(maxAge));
+    }
+
+    if (debug) {
+        fprintf(stderr, "flow[%d]: Detected %d new points. %d points total\n",
+            (int)(&f - &fields[0]),
+            (int)newPoints.size(),
+            (int)f.points.size());
+    }
+}
+
+inline void CameraFlowAnalyzer::calculateDenseFlow(Field &f, const Snapshot &current)
+{
+    /*
+     * Farneback dense flow on a further downsampled copy of the field. This is much
+     * blurrier than the sparse tracker, but it tells us where in the image motion is
+     * happening. The flow field is averaged down to a small fixed grid and filtered
+     * together with the other field's results.
+     */
+
+    double startTime = debug ? now() : 0;
+
+    cv::Size frameSize = f.frames[1].size();
+    cv::Size denseSize(std::max(1, int(frameSize.width * denseFlowScale + 0.5f)),
+                       std::max(1, int(frameSize.height * denseFlowScale + 0.5f)));
+    cv::resize(f.frames[1], f.denseFrames[1], denseSize, 0, 0, cv::INTER_AREA);
+
+    if (!f.denseFrames[0].empty()) {
+        // Start from the last result when we have one; it lets us get away with fewer iterations
+        int flags = f.denseFlowField.empty() ? 0 : cv::OPTFLOW_USE_INITIAL_FLOW;
+        cv::calcOpticalFlowFarneback(f.denseFrames[0], f.denseFrames[1], f.denseFlowField,
+            0.5, denseFlowLevels, denseFlowWinSize, denseFlowIterations, 5, 1.1, flags);
+
+        // Box filter down to the grid size
+        float sumX[MotionGrid::kHeight][MotionGrid::kWidth];
+        float sumY[MotionGrid::kHeight][MotionGrid::kWidth];
+        unsigned count[MotionGrid::kHeight][MotionGrid::kWidth];
+        memset(sumX, 0, sizeof sumX);
+        memset(sumY, 0, sizeof sumY);
+        memset(count, 0, sizeof count);
+
+        int rows = f.denseFlowField.rows;
+        int cols = f.denseFlowField.cols;
+        for (int r = 0; r < rows; r++) {
+            const float *flow = f.denseFlowField.ptr<float>(r);
+            unsigned gy = r * MotionGrid::kHeight / rows;
+            for (int c = 0; c < cols; c++, flow += 2) {
+                unsigned gx = c * MotionGrid::kWidth / cols;
+                sumX[gy][gx] += flow[0];
+                sumY[gy][gx] += flow[1];
+                count[gy][gx]++;
+            }
+        }
+
+        // Back to units of decimated pixels per field, like the sparse integrators
+        float unitScale = 1.0f / denseFlowScale;
+
+        stateLock.lock();
+        for (unsigned y = 0; y < MotionGrid::kHeight; y++) {
+            for (unsigned x = 0; x < MotionGrid::kWidth; x++) {
+                float k = count[y][x] ? unitScale / count[y][x] : 0;
+                grid.x[y][x] += (sumX[y][x] * k - grid.x[y][x]) * denseFlowFilter;
+                grid.y[y][x] += (sumY[y][x] * k - grid.y[y][x]) * denseFlowFilter;
+            }
+        }
+        grid.sequence = current.sequence;
+        grid.timestamp = current.timestamp;
+        publishedGrid.store(grid);
+        stateLock.unlock();
+    }
+
+    std::swap(f.denseFrames[0], f.denseFrames[1]);
+
+    if (debug) {
+        fprintf(stderr, "flow[%d]: Dense flow %dx%d took %.2f ms\n",
+            (int)(&f - &fields[0]), denseSize.width, denseSize.height,
+            (now() - startTime) * 1e3);
+    }
+}
+
 inline CameraFlowCapture::CameraFlowCapture(const CameraFlowAnalyzer &analyzer)
     : analyzer(analyzer)
 {
-    originX = analyzer.integratorX;
-    originY = analyzer.integratorY;
-    originL = analyzer.integratorL;
+    CameraFlowAnalyzer::Snapshot s = analyzer.snapshot();
+    originX = s.integratorX;
+    originY = s.integratorY;
+    originL = s.integratorL;
     capture();
 }       
 
@@ -638,14 +1158,41 @@ inline void CameraFlowCapture::origin()
 
 inline float CameraFlowCapture::instantaneousMotion() const
 {
-    return analyzer.instantaneousMotion();
+    return current.instantaneousMotion();
+}
+
+inline const CameraFlowAnalyzer::Snapshot& CameraFlowCapture::lastCapture() const
+{
+    return current;
+}
+
+inline double CameraFlowCapture::age() const
+{
+    return current.age();
+}
+
+inline CameraFlowAnalyzer::MotionGrid CameraFlowCapture::motionGrid() const
+{
+    return analyzer.motionGrid();
+}
+
+inline Vec3 CameraFlowCapture::modelVector(Vec2 pixels) const
+{
+    return analyzer.basisX * pixels[0] + analyzer.basisY * pixels[1];
+}
+
+inline Vec2 CameraFlowCapture::fieldSize() const
+{
+    return Vec2(Camera::kPixelsPerLine / std::max(1u, analyzer.decimate), Camera::kLinesPerField);
 }
 
 inline void CameraFlowCapture::capture(float filterRate)
 {
-    captureX = analyzer.integratorX;
-    captureY = analyzer.integratorY;
-    captureL = analyzer.integratorL;
+    // One consistent snapshot of all integrators, without blocking the flow threads
+    current = analyzer.snapshot();
+    captureX = current.integratorX;
+    captureY = current.integratorY;
+    captureL = current.integratorL;
 
     // Fixed point to floating point
     float targetX = (int32_t)(captureX - originX) / float(0x10000);
@@ -665,6 +1212,8 @@ inline CameraFlowDebugEffect::CameraFlowDebugEffect(CameraFlowAnalyzer& flow, co
     : scale(config["scale"].GetDouble()),
       radius(config["radius"].GetDouble()),
       motionLengthScale(config["motionLengthScale"].GetDouble()),
+      gridScale(config["gridScale"].GetDouble()),
+      gridIntensity(config["gridIntensity"].GetDouble()),
       flow(flow)
 {}
 
@@ -672,19 +1221,39 @@ inline void CameraFlowDebugEffect::beginFrame(const FrameInfo &f)
 {
     flow.capture();
 
-    appearance.resize(1);
+    particles.resize(1);
 
-    appearance[0].point = flow.model * scale;
-    appearance[0].intensity = 1.0f;
-    appearance[0].radius = radius + sqrtf(flow.instantaneousMotion()) * motionLengthScale;
-    appearance[0].color = Vec3(1,1,1);
+    particles.point[0] = flow.model * scale;
+    particles.intensity[0] = 1.0f;
+    particles.radius[0] = radius + sqrtf(flow.instantaneousMotion()) * motionLengthScale;
+    particles.color[0] = Vec3(1,1,1);
 
     for (unsigned i = 0; i < 3; i++) {
-        if (appearance[0].point[i] < f.modelMin[i] || appearance[0].point[i] > f.modelMax[i]) {
+        if (particles.point[0][i] < f.modelMin[i] || particles.point[0][i] > f.modelMax[i]) {
             flow.origin();
         }
     }
 
+    // Dim particles for each cell of the dense motion grid, if we have one
+    CameraFlowAnalyzer::MotionGrid grid = flow.motionGrid();
+    if (grid.sequence) {
+        // Cell centers in camera pixels from the middle of the field, like the flow itself
+        Vec2 size = flow.fieldSize();
+        for (unsigned y = 0; y < CameraFlowAnalyzer::MotionGrid::kHeight; y++) {
+            for (unsigned x = 0; x < CameraFlowAnalyzer::MotionGrid::kWidth; x++) {
+                Vec2 cell( ((x + 0.5f) / CameraFlowAnalyzer::MotionGrid::kWidth - 0.5f) * size[0],
+                           ((y + 0.5f) / CameraFlowAnalyzer::MotionGrid::kHeight - 0.5f) * size[1] );
+                Vec2 motion(grid.x[y][x], grid.y[y][x]);
+
+                unsigned i = particles.add();
+                particles.point[i] = flow.modelVector(cell) * gridScale;
+                particles.intensity[i] = std::min(1.0f, len(motion) * gridIntensity);
+                particles.radius[i] = radius * 0.5f;
+                particles.color[i] = Vec3(0.2, 1, 0.2);
+            }
+        }
+    }
+
     ParticleEffect::beginFrame(f);
 }
 
@@ -693,6 +1262,7 @@ inline void CameraFlowDebugEffect::debug(const DebugInfo &di)
     fprintf(stderr, "\t[flow] model = %f, %f, %f\n", flow.model[0], flow.model[1], flow.model[2]);
     fprintf(stderr, "\t[flow] motionLength = %f\n", flow.motionLength);
     fprintf(stderr, "\t[flow] instantaneousMotion = %f\n", flow.instantaneousMotion());
+    fprintf(stderr, "\t[flow] field %d, age = %.1f ms\n", flow.lastCapture().sequence, flow.age() * 1e3);
 }
 
 
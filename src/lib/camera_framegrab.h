@@ -7,6 +7,11 @@
  * see the camera's stream sometimes! This class assembles single
  * frames of video, saving them as JPEG files.
  *
+ * The camera thread only copies video into a frame buffer. Finished
+ * frames are copied once more, into a spare buffer for a pool of encoder
+ * threads, which do the color conversion, optional downscaling, and JPEG
+ * compression.
+ *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
  * Permission is hereby granted, free of charge, to any person
@@ -34,17 +39,64 @@
 #pragma once
 
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
+#include <vector>
 #include "jpge.h"
 #include "camera.h"
+#include "bounded_queue.h"
+#include "tinythread.h"
+
+
+class CameraFramegrabEncoder {
+public:
+    CameraFramegrabEncoder(unsigned numThreads = 2, unsigned numBuffers = 4);
+
+    // Finishes queued jobs, then stops the threads
+    ~CameraFramegrabEncoder();
+
+    // Borrow a spare UYVY frame buffer, or NULL if they're all waiting to be encoded
+    uint8_t *acquire();
+
+    // Queue a full UYVY frame for encoding. The buffer returns to the pool when done.
+    // Each output pixel averages a downscale x downscale block of the input.
+    void submit(uint8_t *frame, const std::string &filename, unsigned downscale);
+
+    static const unsigned kFrameBytes = Camera::kPixels * Camera::kBytesPerPixel;
+
+    // Convert UYVY to RGB, averaging a 'downscale' sized box for each output pixel.
+    // Output is (kPixelsPerLine / downscale) x (kLinesPerFrame / downscale).
+    static void convert(const uint8_t *uyvy, uint8_t *rgb, unsigned downscale);
+
+private:
+    struct Job {
+        uint8_t *frame;             // NULL asks one worker to exit
+        std::string filename;
+        unsigned downscale;
+    };
+
+    BoundedQueue<Job> jobs;
+    std::vector<tthread::thread*> threads;
+    std::vector<uint8_t*> freeBuffers;
+    tthread::mutex bufferLock;
+
+    void release(uint8_t *frame);
+    static void threadFunc(void *context);
+    void worker();
+};
 
 
 class CameraFramegrab {
 public:
-    CameraFramegrab();
+    // Grabs are encoded by 'encoder' if given. Otherwise the first begin() starts
+    // an encoder of our own, which lasts as long as we do.
+    CameraFramegrab(CameraFramegrabEncoder *encoder = 0);
+    ~CameraFramegrab();
 
-    // Start saving the next complete frame to the indicated file, as a JPEG
-    void begin(const char *filename);
+    // Start saving the next complete frame to the indicated file, as a JPEG.
+    // Use 'downscale' of 2 for a half-size image.
+    void begin(const char *filename, unsigned downscale = 1);
 
     // Cancel a pending grab.
     void cancel();
@@ -56,14 +108,19 @@ public:
     // framegrab is in progress (it wants more data).
     bool process(const Camera::VideoChunk &chunk);
 
-    // Returns raw capture-buffer in UYVY format.
+    // Returns raw capture-buffer in UYVY format
     const uint8_t *getUYVY() const;
 
 private:
-    uint8_t frame[Camera::kPixels * 2];
-    uint8_t rgb[Camera::kPixels * 3];
+    CameraFramegrab(const CameraFramegrab&) = delete;
+    CameraFramegrab& operator=(const CameraFramegrab&) = delete;
+
+    CameraFramegrabEncoder *encoder;
+    CameraFramegrabEncoder *ownEncoder;
+    uint8_t *frame;
 
     std::string grabFile;
+    unsigned grabDownscale;
     unsigned grabLine;
     unsigned grabVBL;
 
@@ -73,7 +130,8 @@ private:
 
 class CameraPeriodicFramegrab {
 public:
-    CameraPeriodicFramegrab(const char *name = "frame", float interval = 1.0f, int firstIndex = 1);
+    CameraPeriodicFramegrab(const char *name = "frame", float interval = 1.0f,
+        int firstIndex = 1, unsigned downscale = 1);
 
     CameraFramegrab grab;
 
@@ -83,6 +141,7 @@ public:
 private:
     float timer, interval;
     int index;
+    unsigned downscale;
     const char *name;
 };
 
@@ -92,14 +151,195 @@ private:
  *****************************************************************************************/
 
 
-inline CameraFramegrab::CameraFramegrab()
-    : grabLine(0), grabVBL(0)
-{}
+inline CameraFramegrabEncoder::CameraFramegrabEncoder(unsigned numThreads, unsigned numBuffers)
+    : jobs(numBuffers + numThreads)
+{
+    // Every queued job holds a buffer, plus room for one exit job per thread,
+    // so the queue never has to drop one
+
+    for (unsigned i = 0; i < numBuffers; i++) {
+        freeBuffers.push_back(new uint8_t[kFrameBytes]);
+    }
+    for (unsigned i = 0; i < numThreads; i++) {
+        threads.push_back(new tthread::thread(threadFunc, this));
+    }
+}
+
+inline CameraFramegrabEncoder::~CameraFramegrabEncoder()
+{
+    Job exit;
+    exit.frame = 0;
+    exit.downscale = 1;
+    for (unsigned i = 0; i < threads.size(); i++) {
+        jobs.push(exit);
+    }
+    for (unsigned i = 0; i < threads.size(); i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    threads.clear();
+
+    // Every job has finished, so all buffers are back
+    tthread::lock_guard<tthread::mutex> guard(bufferLock);
+    for (unsigned i = 0; i < freeBuffers.size(); i++) {
+        delete[] freeBuffers[i];
+    }
+    freeBuffers.clear();
+}
+
+inline uint8_t *CameraFramegrabEncoder::acquire()
+{
+    tthread::lock_guard<tthread::mutex> guard(bufferLock);
+    if (freeBuffers.empty()) {
+        return 0;
+    }
+    uint8_t *frame = freeBuffers.back();
+    freeBuffers.pop_back();
+    return frame;
+}
+
+inline void CameraFramegrabEncoder::release(uint8_t *frame)
+{
+    tthread::lock_guard<tthread::mutex> guard(bufferLock);
+    freeBuffers.push_back(frame);
+}
+
+inline void CameraFramegrabEncoder::submit(uint8_t *frame, const std::string &filename, unsigned downscale)
+{
+    Job j;
+    j.frame = frame;
+    j.filename = filename;
+    j.downscale = downscale;
+    jobs.push(j);
+}
+
+inline void CameraFramegrabEncoder::threadFunc(void *context)
+{
+    static_cast<CameraFramegrabEncoder*>(context)->worker();
+}
+
+inline void CameraFramegrabEncoder::worker()
+{
+    Job j;
+    std::vector<uint8_t> rgb(Camera::kPixels * 3);
+
+    while (true) {
+        jobs.pop(j);
+        if (!j.frame) {
+            return;
+        }
+
+        unsigned downscale = std::max(1u, j.downscale);
+        unsigned width = Camera::kPixelsPerLine / downscale;
+        unsigned height = Camera::kLinesPerFrame / downscale;
+
+        convert(j.frame, &rgb[0], downscale);
+        release(j.frame);
+
+        // Compress the JPEG
+        if (!jpge::compress_image_to_jpeg_file(j.filename.c_str(), width, height, 3, &rgb[0])) {
+            fprintf(stderr, "camera: Failed to capture frame to %s\n", j.filename.c_str());
+        } else {
+            fprintf(stderr, "camera: captured %s\n", j.filename.c_str());
+        }
+    }
+}
 
-inline void CameraFramegrab::begin(const char *filename)
+inline void CameraFramegrabEncoder::convert(const uint8_t *uyvy, uint8_t *rgb, unsigned downscale)
+{
+    /*
+     * One output line at a time: unpack and sum each input line into flat Y/U/V arrays,
+     * box-average them horizontally, then run the color matrix. Each step is a simple
+     * loop over flat arrays, so the compiler can vectorize them.
+     */
+
+    const unsigned kPairs = Camera::kPixelsPerLine / 2;
+    const unsigned width = Camera::kPixelsPerLine / downscale;
+    const unsigned height = Camera::kLinesPerFrame / downscale;
+    const int area = downscale * downscale;
+
+    int sumY[Camera::kPixelsPerLine], sumU[kPairs], sumV[kPairs];
+    int boxY[Camera::kPixelsPerLine], boxU[Camera::kPixelsPerLine], boxV[Camera::kPixelsPerLine];
+
+    for (unsigned y = 0; y < height; y++) {
+        memset(sumY, 0, sizeof sumY);
+        memset(sumU, 0, sizeof sumU);
+        memset(sumV, 0, sizeof sumV);
+
+        for (unsigned dy = 0; dy < downscale; dy++) {
+            const uint8_t *line = uyvy + (y * downscale + dy) * Camera::kBytesPerLine;
+
+            for (unsigned p = 0; p < kPairs; p++) {
+                sumU[p] += line[p*4 + 0];
+                sumY[p*2] += line[p*4 + 1];
+                sumV[p] += line[p*4 + 2];
+                sumY[p*2 + 1] += line[p*4 + 3];
+            }
+        }
+
+        if (downscale == 1) {
+            for (unsigned x = 0; x < width; x++) {
+                boxY[x] = sumY[x];
+                boxU[x] = sumU[x >> 1];
+                boxV[x] = sumV[x >> 1];
+            }
+        } else {
+            for (unsigned x = 0; x < width; x++) {
+                int yy = 0, u = 0, v = 0;
+                for (unsigned dx = 0; dx < downscale; dx++) {
+                    unsigned i = x * downscale + dx;
+                    yy += sumY[i];
+                    u += sumU[i >> 1];
+                    v += sumV[i >> 1];
+                }
+                boxY[x] = yy / area;
+                boxU[x] = u / area;
+                boxV[x] = v / area;
+            }
+        }
+
+        uint8_t *dest = rgb + y * width * 3;
+
+        for (unsigned x = 0; x < width; x++) {
+            int yy = boxY[x] - 16;
+            int u = boxU[x] - 128;
+            int v = boxV[x] - 128;
+
+            int r = yy + ((v * 91947) >> 16);
+            int g = yy + ((u * -22544 + v * -46793) >> 16);
+            int b = yy + ((u * 115999) >> 16);
+
+            dest[x*3 + 0] = r < 0 ? 0 : r > 255 ? 255 : r;
+            dest[x*3 + 1] = g < 0 ? 0 : g > 255 ? 255 : g;
+            dest[x*3 + 2] = b < 0 ? 0 : b > 255 ? 255 : b;
+        }
+    }
+}
+
+inline CameraFramegrab::CameraFramegrab(CameraFramegrabEncoder *encoder)
+    : encoder(encoder),
+      ownEncoder(0),
+      frame(new uint8_t[CameraFramegrabEncoder::kFrameBytes]),
+      grabDownscale(1), grabLine(0), grabVBL(0)
+{
+    memset(frame, 0, CameraFramegrabEncoder::kFrameBytes);
+}
+
+inline CameraFramegrab::~CameraFramegrab()
+{
+    // Finish our own encoding jobs first
+    delete ownEncoder;
+    delete[] frame;
+}
+
+inline void CameraFramegrab::begin(const char *filename, unsigned downscale)
 {
     cancel();
+    if (!encoder) {
+        encoder = ownEncoder = new CameraFramegrabEncoder(1, 2);
+    }
     grabFile.assign(filename);
+    grabDownscale = downscale;
 }
 
 inline void CameraFramegrab::cancel()
@@ -164,63 +404,41 @@ inline bool CameraFramegrab::process(const Camera::VideoChunk &chunk)
 
 inline void CameraFramegrab::finishGrab()
 {
-    // Convert UYVY to RGB
-
-    const uint8_t *src = frame;
-    uint8_t *dest = rgb;
-
-    for (unsigned i = Camera::kPixels / 2; i; --i) {
-
-        int u  = *(src++) - 128;
-        int y1 = *(src++) - 16;
-        int v  = *(src++) - 128;
-        int y2 = *(src++) - 16;
-
-        int r = (v * 91947) >> 16;
-        int g = (u * -22544 + v * -46793) >> 16;
-        int b = (u * 115999) >> 16;
-
-        *(dest++) = std::max(0, std::min(255, r + y1));
-        *(dest++) = std::max(0, std::min(255, g + y1));
-        *(dest++) = std::max(0, std::min(255, b + y1));
-
-        *(dest++) = std::max(0, std::min(255, r + y2));
-        *(dest++) = std::max(0, std::min(255, g + y2));
-        *(dest++) = std::max(0, std::min(255, b + y2));
-    }
-
-    // Compress the JPEG
-    if (!jpge::compress_image_to_jpeg_file(
-            grabFile.c_str(), Camera::kPixelsPerLine, Camera::kLinesPerField * Camera::kFields,
-            3, rgb)) {
-        fprintf(stderr, "camera: Failed to capture frame to %s\n", grabFile.c_str());
+    // Copy the frame for the encoder threads, keeping ours for getUYVY().
+    // This copy is the only framegrab work that happens on the camera thread.
+
+    uint8_t *copy = encoder->acquire();
+    if (copy) {
+        memcpy(copy, frame, CameraFramegrabEncoder::kFrameBytes);
+        encoder->submit(copy, grabFile, grabDownscale);
+    } else {
+        fprintf(stderr, "camera: Encoder busy, skipped %s\n", grabFile.c_str());
     }
 
-    fprintf(stderr, "camera: captured %s\n", grabFile.c_str());
-
     // Done
     cancel();
 }
 
-inline CameraPeriodicFramegrab::CameraPeriodicFramegrab(const char *name, float interval, int firstIndex)
-    : timer(interval), interval(interval), index(firstIndex), name(name)
+inline CameraPeriodicFramegrab::CameraPeriodicFramegrab(const char *name, float interval,
+    int firstIndex, unsigned downscale)
+    : timer(interval), interval(interval), index(firstIndex), downscale(downscale), name(name)
 {}
 
-void CameraPeriodicFramegrab::timeStep(float ts)
+inline void CameraPeriodicFramegrab::timeStep(float ts)
 {
     timer += ts;
     if (timer > interval) {
 
         char buffer[1024];
         snprintf(buffer, sizeof buffer, "%s-%04d.jpeg", name, index);
-        grab.begin(buffer);
+        grab.begin(buffer, downscale);
 
         timer = fmodf(timer, interval);
         index++;
     }
 }
 
-void CameraPeriodicFramegrab::process(const Camera::VideoChunk &chunk)
+inline void CameraPeriodicFramegrab::process(const Camera::VideoChunk &chunk)
 {
     if (grab.isGrabbing()) {
         grab.process(chunk);
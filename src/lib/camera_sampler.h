@@ -37,9 +37,10 @@
  * solution to the 8 queens problem, in order to use 1/8 the pixels
  * without losing any entire rows or columns.
  *
- * This class acts as a VideoChunk processor that emits callbacks
- * for each new sample it encounters. Video is arriving nearly in
- * real-time, each sample is processed as soon as its Isoc buffer
+ * Every sample on a line sits at the same offset within its block,
+ * so a chunk's samples are a single run of indices, 16 bytes apart
+ * in the UYVY data. Video is arriving nearly in real-time; each chunk's
+ * samples are gathered in one strided pass as soon as its Isoc buffer
  * is available.
  */
 class CameraSampler8Q
@@ -51,14 +52,18 @@ public:
     static const int kBlocks = kBlocksWide * kBlocksHigh;
     static const int kSamples = kBlocks * kSamplesPerBlock;
 
-    CameraSampler8Q(const Camera::VideoChunk &chunk);
+    /*
+     * Find the samples in a chunk. Returns the number of samples, and sets
+     * 'first' to the index of the first one. The rest follow consecutively.
+     */
+    static unsigned locate(const Camera::VideoChunk &chunk, unsigned &first);
 
     /*
-     * Look for a sample in the current chunk. Returns 'true' if the sample
-     * was found, and sets 'index' and 'luminance'. Returns 'false' if no more
-     * samples are in this chunk.
+     * Gather the luminance of every sample in a chunk, writing each one to
+     * samples[index]. 'samples' has room for kSamples values. Returns the
+     * number of samples written.
      */
-    bool next(unsigned &index, uint8_t &luminance);
+    static unsigned gather(const Camera::VideoChunk &chunk, uint8_t *samples);
 
     // Calculate the position of a particular sample
     static int sampleX(unsigned index);
@@ -72,9 +77,8 @@ public:
     static unsigned x8q(unsigned y);
 
 private:
-    Camera::VideoChunk iter;
-    unsigned y;
-    unsigned yIndex;
+    // Byte offset of the first sample's luminance within a line
+    static unsigned lineByteOffset(unsigned y);
 };
 
 
@@ -91,9 +95,10 @@ public:
 
 
 /*
- * Sample every luminance pixel, and use them to update a Sobel edge detection filter.
- * The sobel filter is at full resolution, but the magnitude results are indexed
- * using the CameraSampler8Q grid.
+ * Sample every luminance pixel, and use them to calculate Sobel edge magnitudes
+ * at the CameraSampler8Q grid positions. Each field keeps a rolling window of
+ * its three most recent lines, so the filter uses vertical neighbors from the
+ * same field. A line's samples are calculated as soon as the line below it arrives.
  */
 class CameraSamplerSobel
 {
@@ -101,9 +106,6 @@ public:
     CameraSamplerSobel();
     void process(const Camera::VideoChunk &chunk);
 
-    // Diff buffer for raw video
-    uint8_t luminance[Camera::kPixels];
-
     // Diff buffer for sobel magnitude (XY)
     float sobelXY[CameraSampler8Q::kSamples];
 
@@ -113,13 +115,15 @@ public:
 private:
     static const float kMotionFilterGain = 1e-2;
 
-    struct {
-        // Layout of buffers such that we don't need to bounds-check while updating sobel filter
-        int padding1[Camera::kPixelsPerLine * 2];
-        int sobelX[Camera::kPixels];
-        int sobelY[Camera::kPixels];
-        int padding2[Camera::kPixelsPerLine * 2];
-    };
+    // Lines are padded by one pixel on each side, so the filter needn't bounds-check
+    static const unsigned kLineStride = Camera::kPixelsPerLine + 2;
+
+    uint8_t window[Camera::kFields][3][kLineStride];
+
+    uint8_t *windowLine(unsigned field, unsigned line);
+    void finishLine(unsigned field, unsigned line);
+    void filterLine(unsigned field, unsigned line, const uint8_t *above,
+        const uint8_t *center, const uint8_t *below);
 };
 
 
@@ -128,12 +132,6 @@ private:
  *****************************************************************************************/
 
 
-inline CameraSampler8Q::CameraSampler8Q(const Camera::VideoChunk &chunk)
-    : iter(chunk),
-      y(iter.line * Camera::kFields + iter.field),
-      yIndex(y * kBlocksWide)
-{}
-
 inline unsigned CameraSampler8Q::x8q(unsigned y)
 {
     // Tiny lookup table for the X offset of the Eight Queens
@@ -166,105 +164,144 @@ inline int CameraSampler8Q::blockY(unsigned index)
     return sampleY(index) / kSamplesPerBlock;
 }
 
-inline bool CameraSampler8Q::next(unsigned &index, uint8_t &luminance)
+inline unsigned CameraSampler8Q::lineByteOffset(unsigned y)
 {
-    // Low four bits of the byteOffset we want (X coord + luminance byte)
-    unsigned mask = x8q(y) * 2 + 1;
+    // Two bytes per pixel, luminance in the odd bytes
+    return x8q(y) * 2 + 1;
+}
 
-    while (iter.byteCount) {
+inline unsigned CameraSampler8Q::locate(const Camera::VideoChunk &chunk, unsigned &first)
+{
+    // Samples are at byte offsets (block * 16 + base). Find the blocks in this chunk's byte range.
 
-        if ((iter.byteOffset & 0xF) == mask) {
-            index = yIndex + (iter.byteOffset >> 4);
-            luminance = *iter.data;
+    const unsigned stride = kSamplesPerBlock * 2;
+    unsigned y = chunk.line * Camera::kFields + chunk.field;
+    unsigned base = lineByteOffset(y);
+    unsigned begin = chunk.byteOffset;
+    unsigned end = chunk.byteOffset + chunk.byteCount;
 
-            iter.byteOffset++;
-            iter.byteCount--;
-            iter.data++;
+    unsigned firstBlock = begin <= base ? 0 : (begin - base + stride - 1) / stride;
+    unsigned endBlock = end <= base ? 0 : (end - base + stride - 1) / stride;
 
-            // Ready for more
-            return true;
-        }
+    first = y * kBlocksWide + firstBlock;
+    return endBlock > firstBlock ? endBlock - firstBlock : 0;
+}
 
-        iter.byteOffset++;
-        iter.byteCount--;
-        iter.data++;
-    }
+inline unsigned CameraSampler8Q::gather(const Camera::VideoChunk &chunk, uint8_t *samples)
+{
+    const unsigned stride = kSamplesPerBlock * 2;
+    unsigned first;
+    unsigned count = locate(chunk, first);
 
-    // Out of data
-    return false;
+    unsigned block = first % kBlocksWide;
+    unsigned y = first / kBlocksWide;
+    const uint8_t *src = chunk.data + (block * stride + lineByteOffset(y) - chunk.byteOffset);
+    uint8_t *dest = samples + first;
+
+    for (unsigned i = 0; i < count; i++) {
+        dest[i] = src[i * stride];
+    }
+    return count;
 }
 
 
 inline CameraSamplerSobel::CameraSamplerSobel()
 {
-    memset(sobelX, 0, sizeof sobelX);
-    memset(sobelY, 0, sizeof sobelY);
-    memset(luminance, 0, sizeof luminance);
+    memset(window, 0, sizeof window);
     memset(sobelXY, 0, sizeof sobelXY);
     memset(motion, 0, sizeof motion);
 }
 
+inline uint8_t *CameraSamplerSobel::windowLine(unsigned field, unsigned line)
+{
+    // Pointer to the first real pixel of a line in the rolling window
+    return &window[field][line % 3][1];
+}
+
 inline void CameraSamplerSobel::process(const Camera::VideoChunk &chunk)
 {
     Camera::VideoChunk iter = chunk;
-    int y = iter.line * Camera::kFields + iter.field;
-    int yIndex = y * Camera::kPixelsPerLine;
-    int yIndex8q = y * CameraSampler8Q::kBlocksWide;
-    unsigned mask = CameraSampler8Q::x8q(y) * 2 + 1;
-
-    while (iter.byteCount) {
-        if (iter.byteOffset & 1) {
-            // Luminance
-
-            // Delta detect
-            int index = yIndex + (iter.byteOffset >> 1);
-            int prevL = luminance[index];
-            int nextL = *iter.data;
-            luminance[index] = nextL;
-            int delta = nextL - prevL;
-            int delta2 = delta * 2;
-
-            // Sobel operators. No bounds-checking; instead we just pad the buffers
-
-            *(sobelX + index -1 - Camera::kPixelsPerLine) -= delta;
-            *(sobelX + index +1 - Camera::kPixelsPerLine) += delta;
-            *(sobelX + index -1                         ) -= delta2;
-            *(sobelX + index +1                         ) += delta2;
-            *(sobelX + index -1 + Camera::kPixelsPerLine) -= delta;
-            *(sobelX + index +1 + Camera::kPixelsPerLine) += delta;
-            *(sobelY + index -1 - Camera::kPixelsPerLine) += delta;
-            *(sobelY + index    - Camera::kPixelsPerLine) += delta2;
-            *(sobelY + index +1 - Camera::kPixelsPerLine) += delta;
-            *(sobelY + index -1 + Camera::kPixelsPerLine) -= delta;
-            *(sobelY + index    + Camera::kPixelsPerLine) -= delta2;
-            *(sobelY + index +1 + Camera::kPixelsPerLine) -= delta;       
-
-            // Is this on our 8Q grid?
-            if ((iter.byteOffset & 0xF) == mask) {
-                unsigned i8q = yIndex8q + (iter.byteOffset >> 4);
-
-                int sx = sobelX[index];
-                int sy = sobelY[index];
-                float sxy = sobelXY[i8q];
-                int target = sx*sx + sy*sy;
-
-                float motionSample = target - sxy;
-                sxy = std::max<float>(1e-10, sxy + motionSample * kMotionFilterGain);
-                sobelXY[i8q] = sxy;
-
-                // Motion, adjusted for the novelty factor and brightness
-
-                motionSample /= sxy;
-                motionSample *= motionSample;
-                motionSample *= nextL;
-                motion[i8q] = motionSample;
-            }
-        }
+    uint8_t *dest = windowLine(iter.field, iter.line);
 
+    // Align to the next luminance byte
+    if (!(iter.byteOffset & 1) && iter.byteCount) {
         iter.byteOffset++;
         iter.byteCount--;
         iter.data++;
     }
+
+    // Copy every luminance value into the window
+    for (unsigned i = 0; i < iter.byteCount; i += 2) {
+        dest[(iter.byteOffset + i) >> 1] = iter.data[i];
+    }
+
+    if (chunk.byteOffset + chunk.byteCount == Camera::kBytesPerLine) {
+        finishLine(chunk.field, chunk.line);
+    }
+}
+
+inline void CameraSamplerSobel::finishLine(unsigned field, unsigned line)
+{
+    // Replicate edge pixels into the padding
+    uint8_t *row = windowLine(field, line);
+    row[-1] = row[0];
+    row[Camera::kPixelsPerLine] = row[Camera::kPixelsPerLine - 1];
+
+    // Now the line above has both of its neighbors. The first and
+    // last lines in the field use themselves as their missing neighbor.
+
+    if (line >= 1) {
+        unsigned center = line - 1;
+        filterLine(field, center,
+            windowLine(field, center ? center - 1 : center),
+            windowLine(field, center),
+            row);
+    }
+
+    if (line == Camera::kLinesPerField - 1) {
+        filterLine(field, line, windowLine(field, line - 1), row, row);
+    }
+}
+
+inline void CameraSamplerSobel::filterLine(unsigned field, unsigned line,
+    const uint8_t *above, const uint8_t *center, const uint8_t *below)
+{
+    const unsigned n = CameraSampler8Q::kBlocksWide;
+    unsigned y = line * Camera::kFields + field;
+    unsigned x8q = CameraSampler8Q::x8q(y);
+
+    // Gather the 3x3 neighborhoods of this line's samples, then run the
+    // filter over flat arrays where the compiler can vectorize it.
+
+    float gx[n], gy[n], lum[n];
+
+    for (unsigned b = 0; b < n; b++) {
+        int x = b * CameraSampler8Q::kSamplesPerBlock + x8q;
+
+        int tl = above[x-1], t = above[x], tr = above[x+1];
+        int l  = center[x-1],              r  = center[x+1];
+        int bl = below[x-1], bm = below[x], br = below[x+1];
+
+        gx[b] = (tr + 2*r + br) - (tl + 2*l + bl);
+        gy[b] = (bl + 2*bm + br) - (tl + 2*t + tr);
+        lum[b] = center[x];
+    }
+
+    float * __restrict sxy = sobelXY + y * n;
+    float * __restrict m = motion + y * n;
+
+    for (unsigned b = 0; b < n; b++) {
+        float target = gx[b] * gx[b] + gy[b] * gy[b];
+        float motionSample = target - sxy[b];
+        float filtered = sxy[b] + motionSample * kMotionFilterGain;
+        filtered = filtered > 1e-10f ? filtered : 1e-10f;
+        sxy[b] = filtered;
+
+        // Motion, adjusted for the novelty factor and brightness
+
+        motionSample /= filtered;
+        m[b] = motionSample * motionSample * lum[b];
+    }
 }
 
 
@@ -275,12 +312,5 @@ inline CameraLuminanceBuffer::CameraLuminanceBuffer()
 
 inline void CameraLuminanceBuffer::process(const Camera::VideoChunk &chunk)
 {
-    unsigned sampleIndex;
-    uint8_t luminance;
- 
-    CameraSampler8Q s8q(chunk);
- 
-    while (s8q.next(sampleIndex, luminance)) {
-        buffer[sampleIndex] = luminance;
-    }
+    CameraSampler8Q::gather(chunk, buffer);
 }
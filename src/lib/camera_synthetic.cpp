@@ -0,0 +1,268 @@
+/*
+ * Synthetic camera, for load testing the vision stack without hardware.
+ *
+ * Implements Camera::startSynthetic() from camera.h. Renders NTSC UYVY
+ * fields on a separate thread, and feeds them to the usual video callback.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "camera.h"
+#include "tinythread.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace Camera;
+
+
+struct SyntheticBlob {
+    float x, y;             // Center, in frame pixels
+    float vx, vy;           // Velocity, in frame pixels per field
+    uint32_t texture;       // Texture seed
+};
+
+struct SyntheticState {
+    SyntheticOptions options;
+    videoCallback_t callback;
+    void *context;
+
+    std::vector<SyntheticBlob> blobs;
+    std::vector<uint8_t> background;        // One full frame of luminance
+    uint32_t rng;
+    FILE *groundTruth;
+};
+
+static tthread::thread *syntheticThread = 0;
+
+
+static uint32_t xorshift(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static float uniform(uint32_t &state)
+{
+    return (xorshift(state) >> 8) * (1.0f / 16777216.0f);
+}
+
+static uint8_t texel(int u, int v, uint32_t seed)
+{
+    // Random brightness for each 8x8 cell, so there are plenty of corners to track
+
+    uint32_t h = seed ^ (uint32_t(u >> 3) * 0x9E3779B1u) ^ (uint32_t(v >> 3) * 0x85EBCA77u);
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    return 48 + (h & 0x7F);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static void setupScene(SyntheticState &s)
+{
+    const SyntheticOptions &o = s.options;
+
+    s.rng = o.seed ? o.seed : 1;
+    s.background.resize(kPixelsPerLine * kLinesPerFrame);
+    for (unsigned y = 0; y < kLinesPerFrame; y++) {
+        for (unsigned x = 0; x < kPixelsPerLine; x++) {
+            s.background[y * kPixelsPerLine + x] = texel(x, y, s.rng) / 2;
+        }
+    }
+
+    s.blobs.resize(o.blobs);
+    for (unsigned i = 0; i < s.blobs.size(); i++) {
+        SyntheticBlob &b = s.blobs[i];
+        float angle = uniform(s.rng) * float(2 * M_PI);
+        float speed = uniform(s.rng) * o.blobSpeed;
+        b.x = uniform(s.rng) * kPixelsPerLine;
+        b.y = uniform(s.rng) * kLinesPerFrame;
+        b.vx = cosf(angle) * speed;
+        b.vy = sinf(angle) * speed;
+        b.texture = xorshift(s.rng);
+    }
+}
+
+static void moveBlobs(SyntheticState &s, double &totalX, double &totalY, double &totalL)
+{
+    // Bounce off the edges of the frame, and track the average motion as ground truth
+
+    float sumX = 0, sumY = 0, sumL = 0;
+
+    for (unsigned i = 0; i < s.blobs.size(); i++) {
+        SyntheticBlob &b = s.blobs[i];
+        float x = b.x + b.vx;
+        float y = b.y + b.vy;
+
+        if (x < 0 || x > kPixelsPerLine) {
+            b.vx = -b.vx;
+            x = b.x + b.vx;
+        }
+        if (y < 0 || y > kLinesPerFrame) {
+            b.vy = -b.vy;
+            y = b.y + b.vy;
+        }
+
+        sumX += x - b.x;
+        sumY += y - b.y;
+        sumL += hypotf(x - b.x, y - b.y);
+        b.x = x;
+        b.y = y;
+    }
+
+    if (!s.blobs.empty()) {
+        totalX += sumX / s.blobs.size();
+        totalY += sumY / s.blobs.size();
+        totalL += sumL / s.blobs.size();
+    }
+}
+
+static void renderLine(SyntheticState &s, unsigned y, float gain, uint8_t *uyvy)
+{
+    const SyntheticOptions &o = s.options;
+    uint8_t luma[kPixelsPerLine];
+
+    memcpy(luma, &s.background[y * kPixelsPerLine], kPixelsPerLine);
+
+    // Brighter textured discs, with the texture moving along with each blob
+
+    for (unsigned i = 0; i < s.blobs.size(); i++) {
+        const SyntheticBlob &b = s.blobs[i];
+        float dy = y - b.y;
+        float halfWidth2 = o.blobRadius * o.blobRadius - dy * dy;
+        if (halfWidth2 <= 0) {
+            continue;
+        }
+
+        float halfWidth = sqrtf(halfWidth2);
+        int x0 = std::max(0, int(b.x - halfWidth));
+        int x1 = std::min(int(kPixelsPerLine), int(b.x + halfWidth) + 1);
+        int u0 = int(floorf(b.x));
+        int v = int(floorf(y - b.y));
+
+        for (int x = x0; x < x1; x++) {
+            luma[x] = 64 + texel(x - u0, v, b.texture);
+        }
+    }
+
+    // Lighting, noise, and packing to UYVY
+
+    int noise = int(o.noise);
+    for (unsigned x = 0; x < kPixelsPerLine; x++) {
+        int l = int(luma[x] * gain);
+        if (noise) {
+            l += int(xorshift(s.rng) % (2 * noise + 1)) - noise;
+        }
+        uyvy[x * 2] = 128;
+        uyvy[x * 2 + 1] = std::max(0, std::min(255, l));
+    }
+}
+
+static void syntheticThreadFunc(void *context)
+{
+    SyntheticState &s = *static_cast<SyntheticState*>(context);
+    const SyntheticOptions &o = s.options;
+    unsigned chunkBytes = std::max(2u, std::min(kBytesPerLine, o.chunkBytes)) & ~1u;
+    uint8_t line[kBytesPerLine];
+
+    double totalX = 0, totalY = 0, totalL = 0;
+    double startTime = now();
+
+    for (uint32_t fieldCount = 0;; fieldCount++) {
+        unsigned field = fieldCount & 1;
+        double fieldTime = o.fieldRate > 0 ? startTime + fieldCount / o.fieldRate : now();
+
+        if (o.fieldRate > 0) {
+            double wait = fieldTime - now();
+            if (wait > 0) {
+                usleep(wait * 1e6);
+            }
+        }
+
+        moveBlobs(s, totalX, totalY, totalL);
+        float gain = 1.0f + o.flicker * sinf(float(2 * M_PI) * o.flickerRate * (fieldTime - startTime));
+
+        for (unsigned l = 0; l < kLinesPerField; l++) {
+            renderLine(s, l * kFields + field, gain, line);
+
+            for (unsigned offset = 0; offset < kBytesPerLine; offset += chunkBytes) {
+                VideoChunk chunk;
+                chunk.data = line + offset;
+                chunk.byteOffset = offset;
+                chunk.byteCount = std::min(chunkBytes, kBytesPerLine - offset);
+                chunk.line = l;
+                chunk.field = field;
+                s.callback(chunk, s.context);
+            }
+        }
+
+        if (s.groundTruth) {
+            fprintf(s.groundTruth, "%f %u %f %f %f\n", now(), fieldCount, totalX, totalY, totalL);
+            fflush(s.groundTruth);
+        }
+    }
+}
+
+namespace Camera {
+    tthread::thread* startSynthetic(videoCallback_t callback, void *context,
+        const SyntheticOptions &options)
+    {
+        if (syntheticThread) {
+            // Only one instance supported
+            return 0;
+        }
+
+        SyntheticState *s = new SyntheticState;
+        s->options = options;
+        s->callback = callback;
+        s->context = context;
+        s->groundTruth = 0;
+
+        if (options.groundTruthLog && *options.groundTruthLog) {
+            s->groundTruth = fopen(options.groundTruthLog, "a");
+            if (!s->groundTruth) {
+                perror("Error opening synthetic camera ground truth log");
+            }
+        }
+
+        setupScene(*s);
+        syntheticThread = new tthread::thread(syntheticThreadFunc, s);
+
+        return syntheticThread;
+    }
+}
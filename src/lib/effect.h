@@ -33,7 +33,8 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "nanoflann.h"  // Tiny KD-tree library
+#include <algorithm>
+#include "spatial_grid.h"
 #include "svl/SVL.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/document.h"
@@ -47,6 +48,7 @@ public:
     class PixelInfo;
     class FrameInfo;
     class DebugInfo;
+    class TaskPool;
 
     /*
      * Calculate a pixel value, using floating point RGB in the nominal range [0, 1].
@@ -77,6 +79,15 @@ public:
     // This can print parameters out to the console.
     virtual void debug(const DebugInfo& d);
 
+    // Loop body for FrameInfo::parallelFor(), covering indices [begin, end)
+    typedef void (*RangeFunc)(void *context, unsigned begin, unsigned end);
+
+    // Anything that can run parallelFor() loops on other threads. EffectMixer is one.
+    class TaskPool {
+    public:
+        virtual void parallelFor(unsigned count, unsigned chunkSize, RangeFunc func, void *context) = 0;
+    };
+
 
     // Information about one LED pixel
     class PixelInfo {
@@ -129,44 +140,85 @@ public:
         Vec3 modelSize() const;
         Real distanceOutsideBoundingBox(Vec3 p) const;
 
-        // K-D Tree, for fast spatial lookups
-
-        typedef nanoflann::KDTreeSingleIndexAdaptor<
-            nanoflann::L2_Simple_Adaptor< Real, FrameInfo >,
-            FrameInfo, 3> IndexTree;
+        /*
+         * Split [0, count) into chunks of 'chunkSize' and run func(context, begin, end)
+         * on each, in parallel if we have a TaskPool. Chunk boundaries don't depend on
+         * the number of threads, so an effect that combines per-chunk results in chunk
+         * order gets the same answer every time. Returns once all chunks are done.
+         *
+         * Only call this from beginFrame(). Chunks must not call parallelFor() again.
+         */
+        void parallelFor(unsigned count, unsigned chunkSize, RangeFunc func, void *context) const;
+
+        // Same thing, with any object that has operator() (unsigned begin, unsigned end)
+        template <typename T>
+        void parallelFor(unsigned count, unsigned chunkSize, T &body) const;
+
+        // Pool for parallelFor(); set by EffectMixer while its effects run beginFrame()
+        mutable TaskPool *pool;
+
+        /*
+         * Spatial lookups on the static LED layout. The uniform grid is built once in
+         * init(). visitRadius() calls visit(index, dist2) for every pixel within
+         * 'radius' of 'point', in no particular order, without allocating anything.
+         */
 
         typedef std::vector<std::pair<size_t, Real> > ResultSet_t;
 
-        void radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const;
-
-        IndexTree tree;
+        template <typename Visitor>
+        void visitRadius(Vec3 point, float radius, Visitor &visit) const;
 
-        // Adapter functions for the K-D tree implementation
-
-        inline size_t kdtree_get_point_count() const {
-            return pixels.size();
-        }
-
-        inline Real kdtree_distance(const Real *p1, const size_t idx_p2, size_t size) const {
-            Real d0 = p1[0] - pixels[idx_p2].point[0];
-            Real d1 = p1[1] - pixels[idx_p2].point[1];
-            Real d2 = p1[2] - pixels[idx_p2].point[2];
-            return d0*d0 + d1*d1 + d2*d2;
-        }
-
-        Real kdtree_get_pt(const size_t idx, int dim) const {
-            return pixels[idx].point[dim];
-        }
+        // Same search, collecting results into a list
+        void radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const;
 
-        template <class BBOX> bool kdtree_get_bbox(BBOX &bb) const {
-            bb[0].low  = modelMin[0];
-            bb[1].low  = modelMin[1];
-            bb[2].low  = modelMin[2];
-            bb[0].high = modelMax[0];
-            bb[1].high = modelMax[1];
-            bb[2].high = modelMax[2];
-            return true;
-        }
+        SpatialGrid grid;
+
+        /*
+         * Optional table of each pixel's k nearest other pixels, closest first, in
+         * flat arrays. Effects that want it call requireNearest() from beginFrame();
+         * it's built the first time anyone asks for at least that many neighbors.
+         * nearest() and nearestDist2() return null until then.
+         *
+         * requireNearest() is const only so beginFrame() can reach it; it rebuilds the
+         * table in place. Never call it once shading has started, since shaders on
+         * other threads may be reading the table.
+         */
+        void requireNearest(unsigned k) const;
+        unsigned nearestCount() const;
+        const unsigned *nearest(unsigned pixel) const;
+        const Real *nearestDist2(unsigned pixel) const;
+
+    private:
+        mutable unsigned nearestK;
+        mutable std::vector<unsigned> nearestIndex;
+        mutable std::vector<Real> nearestDist;
+
+        struct PixelAccessor {
+            const PixelInfoVec &pixels;
+            Vec3 operator() (unsigned i) const { return pixels[i].point; }
+        };
+
+        template <typename Visitor>
+        struct RadiusFilter {
+            const PixelInfoVec &pixels;
+            Vec3 point;
+            Real radius2;
+            Visitor &visit;
+
+            void operator() (unsigned i) {
+                Real dist2 = sqrlen(pixels[i].point - point);
+                if (dist2 < radius2) {
+                    visit(i, dist2);
+                }
+            }
+        };
+
+        struct HitCollector {
+            ResultSet_t &hits;
+            void operator() (unsigned i, Real dist2) {
+                hits.push_back(std::make_pair(size_t(i), dist2));
+            }
+        };
     };
 
     // Information passed to debug() callbacks
@@ -232,7 +284,7 @@ inline Vec3 Effect::PixelInfo::getVec3(const char *attribute) const
 }
 
 inline Effect::FrameInfo::FrameInfo()
-    : timeDelta(0), tree(3, *this)
+    : timeDelta(0), pool(0), nearestK(0)
 {}
 
 inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
@@ -264,9 +316,14 @@ inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
         modelRadius = std::max(modelRadius, len(pixels[i].point - modelCenter()));
     }
 
-    // Build K-D Tree index, for fast spatial lookups later
+    // Uniform grid index, for fast spatial lookups later. Cells are sized for
+    // LEDs spread over a surface, about one LED apart.
 
-    tree.buildIndex();
+    PixelAccessor accessor = { pixels };
+    grid.build(pixels.size(), 2 * modelRadius / sqrt(pixels.size()), accessor);
+    nearestK = 0;
+    nearestIndex.clear();
+    nearestDist.clear();
 }
 
 inline Vec3 Effect::FrameInfo::modelCenter() const
@@ -291,11 +348,110 @@ inline Real Effect::FrameInfo::distanceOutsideBoundingBox(Vec3 p) const
     return d;
 }
 
+template <typename Visitor>
+inline void Effect::FrameInfo::visitRadius(Vec3 point, float radius, Visitor &visit) const
+{
+    RadiusFilter<Visitor> filter = { pixels, point, radius * radius, visit };
+    grid.visitCandidates(point, radius, filter);
+}
+
 inline void Effect::FrameInfo::radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const
 {
-    nanoflann::SearchParams params;
-    params.sorted = false;
-    tree.radiusSearch(&point[0], radius * radius, hits, params);
+    hits.clear();
+    HitCollector collector = { hits };
+    visitRadius(point, radius, collector);
+}
+
+inline void Effect::FrameInfo::requireNearest(unsigned k) const
+{
+    if (pixels.empty()) {
+        return;
+    }
+    k = std::min<unsigned>(k, pixels.size() - 1);
+    if (k <= nearestK) {
+        return;
+    }
+
+    nearestK = k;
+    nearestIndex.resize(pixels.size() * k);
+    nearestDist.resize(pixels.size() * k);
+
+    // Search a growing radius until we have enough candidates, then keep the closest k
+
+    ResultSet_t hits;
+    std::vector<std::pair<Real, unsigned> > sorted;
+    Real radius = 2 * modelRadius / sqrt(pixels.size()) * sqrt(k + 1.0);
+
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        Real r = radius;
+        do {
+            radiusSearch(hits, pixels[i].point, r);
+            r *= 2;
+        } while (hits.size() <= k && r < 8 * modelRadius);
+
+        sorted.clear();
+        if (hits.size() > k) {
+            for (unsigned h = 0; h < hits.size(); h++) {
+                if (hits[h].first != i) {
+                    sorted.push_back(std::make_pair(hits[h].second, unsigned(hits[h].first)));
+                }
+            }
+        } else {
+            // Degenerate layout, with pixels piled on top of each other
+            for (unsigned j = 0; j < pixels.size(); j++) {
+                if (j != i) {
+                    sorted.push_back(std::make_pair(sqrlen(pixels[j].point - pixels[i].point), j));
+                }
+            }
+        }
+        std::partial_sort(sorted.begin(), sorted.begin() + k, sorted.end());
+
+        for (unsigned j = 0; j < k; j++) {
+            nearestIndex[i * k + j] = sorted[j].second;
+            nearestDist[i * k + j] = sorted[j].first;
+        }
+    }
+}
+
+inline unsigned Effect::FrameInfo::nearestCount() const
+{
+    return nearestK;
+}
+
+inline const unsigned *Effect::FrameInfo::nearest(unsigned pixel) const
+{
+    return nearestK ? &nearestIndex[pixel * nearestK] : 0;
+}
+
+inline const Real *Effect::FrameInfo::nearestDist2(unsigned pixel) const
+{
+    return nearestK ? &nearestDist[pixel * nearestK] : 0;
+}
+
+inline void Effect::FrameInfo::parallelFor(unsigned count, unsigned chunkSize, RangeFunc func, void *context) const
+{
+    chunkSize = std::max(1u, chunkSize);
+
+    if (pool && count > chunkSize) {
+        pool->parallelFor(count, chunkSize, func, context);
+    } else {
+        // Same chunks, in order, on this thread
+        for (unsigned begin = 0; begin < count; begin += chunkSize) {
+            func(context, begin, std::min(count, begin + chunkSize));
+        }
+    }
+}
+
+template <typename T>
+static void effectRangeThunk(void *context, unsigned begin, unsigned end)
+{
+    (*static_cast<T*>(context))(begin, end);
+}
+
+template <typename T>
+inline void Effect::FrameInfo::parallelFor(unsigned count, unsigned chunkSize, T &body) const
+{
+    parallelFor(count, chunkSize, effectRangeThunk<T>, &body);
 }
 
 inline Effect::DebugInfo::DebugInfo(EffectRunner &runner)
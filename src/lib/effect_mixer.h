@@ -41,7 +41,7 @@
 #include "tinythread.h"
 
 
-class EffectMixer : public Effect {
+class EffectMixer : public Effect, private Effect::TaskPool {
 public:
     EffectMixer();
     ~EffectMixer();
@@ -73,9 +73,12 @@ private:
         std::vector<Vec3> colors;
     };
 
+    // Either a block of pixels to shade, or a chunk of a parallelFor() loop
     struct Task {
         Channel *channel;
         const Effect::PixelInfo *pixelInfo;
+        RangeFunc func;
+        void *context;
         unsigned begin;
         unsigned end;
     };
@@ -108,6 +111,9 @@ private:
     void changeNumberOfThreads(unsigned count);
     static void threadFunc(void *context);
     void worker(ThreadContext &context);
+
+    // TaskPool, offered to our effects through FrameInfo during beginFrame()
+    virtual void parallelFor(unsigned count, unsigned chunkSize, RangeFunc func, void *context);
 };
 
 
@@ -282,6 +288,10 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
     unsigned totalPixels = 0;
     unsigned modelPixels = f.pixels.size();
 
+    // Effects can use our threads for their own work, during beginFrame()
+    Effect::TaskPool *outerPool = f.pool;
+    f.pool = this;
+
     for (unsigned i = 0; i < channels.size(); ++i) {
         Channel &c = channels[i];
 
@@ -292,6 +302,8 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
         }
     }
 
+    f.pool = outerPool;
+
     // Try to size the batches so we give each CPU a few tasks, so that if our
     // workload is asymmetric we'll end up with room to rebalance.
 
@@ -309,6 +321,8 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
             Task t;
             t.channel = &c;
             t.pixelInfo = &f.pixels[0];
+            t.func = 0;
+            t.context = 0;
             t.begin = 0;
 
             while (t.begin < modelPixels) {
@@ -332,6 +346,38 @@ inline void EffectMixer::beginFrame(const FrameInfo& f)
     completeLock.unlock();
 }
 
+inline void EffectMixer::parallelFor(unsigned count, unsigned chunkSize, RangeFunc func, void *context)
+{
+    // Same queue and completion count as pixel tasks. Only used from beginFrame(),
+    // before any pixel tasks are queued, so we're waiting on just these chunks.
+
+    taskLock.lock();
+    unsigned numTasks = 0;
+
+    Task t;
+    t.channel = 0;
+    t.pixelInfo = 0;
+    t.func = func;
+    t.context = context;
+
+    for (t.begin = 0; t.begin < count; t.begin = t.end) {
+        t.end = std::min(count, t.begin + chunkSize);
+        tasks.push(t);
+        numTasks++;
+    }
+
+    completeLock.lock();
+    pendingTasks = numTasks;
+    taskCond.notify_all();
+    taskLock.unlock();
+
+    while (pendingTasks) {
+        completeCond.wait(completeLock);
+    }
+
+    completeLock.unlock();
+}
+
 inline void EffectMixer::threadFunc(void *context)
 {
     ThreadContext* c = (ThreadContext*) context;
@@ -356,17 +402,23 @@ inline void EffectMixer::worker(ThreadContext &context)
         tasks.pop();
         taskLock.unlock();
 
-        // Process a block of pixels
+        if (currentTask.func) {
+            // Chunk of an effect's parallelFor()
+            currentTask.func(currentTask.context, currentTask.begin, currentTask.end);
+
+        } else {
+            // Process a block of pixels
 
-        Channel &c = *currentTask.channel;
-        Effect *effect = c.effect;
+            Channel &c = *currentTask.channel;
+            Effect *effect = c.effect;
 
-        for (unsigned i = currentTask.begin; i != currentTask.end; ++i) {
-            const Effect::PixelInfo &p = currentTask.pixelInfo[i];
-            if (p.isMapped()) {
-                Vec3 color(0, 0, 0);
-                effect->shader(color, p);
-                c.colors[i] = color;
+            for (unsigned i = currentTask.begin; i != currentTask.end; ++i) {
+                const Effect::PixelInfo &p = currentTask.pixelInfo[i];
+                if (p.isMapped()) {
+                    Vec3 color(0, 0, 0);
+                    effect->shader(color, p);
+                    c.colors[i] = color;
+                }
             }
         }
 
@@ -0,0 +1,329 @@
+/*
+ * Always-on latency calibration.
+ * A faint random flicker rides along with the running effects,
+ * and we look for its echo in the camera's overall brightness.
+ * The lag with the strongest echo is our LED to camera latency.
+ *
+ * The Narrator runs one around its whole mix, right outside its EffectTap,
+ * and feeds it from the VideoBus. Anything that looks up what the LEDs were
+ * showing when the camera saw them should use delayedFrame().
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include "camera.h"
+#include "effect.h"
+#include "effect_tap.h"
+#include "prng.h"
+#include "seqlock.h"
+#include "tinythread.h"
+
+
+/*
+ * Wraps another effect, usually the whole mix, scaling its output by a
+ * random telegraph signal of +/- 'amplitude'. Put this outside any EffectTap,
+ * so the tap records what the LEDs actually showed.
+ *
+ * Each camera field's average luminance, minus its slowly varying average,
+ * is correlated against the probe signal at a range of lags. The correlation
+ * is a leaky integrator, so the estimate keeps tracking as conditions change.
+ */
+class LatencyCalibrator : public Effect
+{
+public:
+    LatencyCalibrator();
+    void setEffect(Effect *next);
+
+    // Latency to assume until we have an estimate. This turns out to be one NTSC video frame.
+    static constexpr float kExpectedDelay = 1.0 / 29.97;
+
+    // Probe strength, as a fraction of LED brightness
+    float amplitude;
+
+    // Chance that the probe flips on each frame
+    float flipProbability;
+
+    // Handle incoming video, on the camera thread
+    void process(const Camera::VideoChunk &chunk);
+
+    struct Estimate {
+        float latency;          // Seconds from frame start to the camera field that saw it
+        float confidence;       // Correlation peak relative to the average bin
+        uint32_t fields;        // Number of camera fields analyzed
+        uint32_t stableWindows; // Consecutive windows with a confident peak that held still
+    };
+
+    // Latest estimate. Lock-free, safe to call from any thread.
+    Estimate estimate() const;
+
+    // Best latency to use right now. Until the peak has been confident and steady
+    // for several windows in a row, this is kExpectedDelay.
+    float latency() const;
+
+    // Look up what the LEDs were doing when the camera's latest field was captured
+    const EffectTap::Frame* delayedFrame(const EffectTap &tap) const;
+
+    virtual void shader(Vec3& rgb, const PixelInfo& p) const;
+    virtual void postProcess(const Vec3& rgb, const PixelInfo& p);
+    virtual void beginFrame(const FrameInfo& f);
+    virtual void endFrame(const FrameInfo& f);
+    virtual void debug(const DebugInfo& d);
+
+private:
+    static const unsigned kNumBins = 64;
+    static constexpr float kBinSeconds = 0.004;
+    static const unsigned kHistorySize = 512;
+    static constexpr float kLumaFilterGain = 0.05;
+    static constexpr float kCorrelationGain = 2e-3;
+    static constexpr float kMinConfidence = 3.0;
+    static const unsigned kWindowFields = 60;
+    static const unsigned kMinStableWindows = 5;
+
+    Effect *next;
+    PRNG prng;
+    float probe;
+
+    // Probe history, written on the render thread and read on the camera thread
+    struct ProbeRecord {
+        double timestamp;
+        float value;
+    };
+    ProbeRecord history[kHistorySize];
+    unsigned historyHead;
+    tthread::mutex historyLock;
+
+    // Camera thread state
+    uint64_t fieldTotal;
+    unsigned fieldSamples;
+    float lumaAverage;
+    float correlation[kNumBins];
+    unsigned windowPeak;
+    Estimate current;
+    SeqLock<Estimate> published;
+
+    static double now();
+    void finishField(double timestamp);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline LatencyCalibrator::LatencyCalibrator()
+    : amplitude(0.03), flipProbability(0.25), next(0), probe(1), historyHead(0),
+      fieldTotal(0), fieldSamples(0), lumaAverage(0), windowPeak(0)
+{
+    prng.seed(33);
+    memset(history, 0, sizeof history);
+    memset(correlation, 0, sizeof correlation);
+
+    current.latency = kExpectedDelay;
+    current.confidence = 0;
+    current.fields = 0;
+    current.stableWindows = 0;
+    published.store(current);
+}
+
+inline void LatencyCalibrator::setEffect(Effect *next)
+{
+    this->next = next;
+}
+
+inline double LatencyCalibrator::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+inline LatencyCalibrator::Estimate LatencyCalibrator::estimate() const
+{
+    return published.load();
+}
+
+inline float LatencyCalibrator::latency() const
+{
+    // Copy the constant first; as a ?: operand it would need an out-of-class definition
+    Estimate e = estimate();
+    float fallback = kExpectedDelay;
+    return e.stableWindows >= kMinStableWindows ? e.latency : fallback;
+}
+
+inline const EffectTap::Frame* LatencyCalibrator::delayedFrame(const EffectTap &tap) const
+{
+    return tap.get(latency());
+}
+
+inline void LatencyCalibrator::shader(Vec3& rgb, const PixelInfo& p) const
+{
+    next->shader(rgb, p);
+    rgb *= 1.0f + amplitude * probe;
+}
+
+inline void LatencyCalibrator::postProcess(const Vec3& rgb, const PixelInfo& p)
+{
+    next->postProcess(rgb, p);
+}
+
+inline void LatencyCalibrator::beginFrame(const FrameInfo& f)
+{
+    if (prng.uniform() < flipProbability) {
+        probe = -probe;
+    }
+
+    historyLock.lock();
+    historyHead = (historyHead + 1) % kHistorySize;
+    history[historyHead].timestamp = now();
+    history[historyHead].value = probe;
+    historyLock.unlock();
+
+    next->beginFrame(f);
+}
+
+inline void LatencyCalibrator::endFrame(const FrameInfo& f)
+{
+    next->endFrame(f);
+}
+
+inline void LatencyCalibrator::debug(const DebugInfo& d)
+{
+    Estimate e = estimate();
+    fprintf(stderr, "\t[latency] %.1f ms, confidence %.1f, stable for %d windows, %d fields\n",
+        e.latency * 1e3, e.confidence, e.stableWindows, e.fields);
+    next->debug(d);
+}
+
+inline void LatencyCalibrator::process(const Camera::VideoChunk &chunk)
+{
+    // Sum every eighth luminance sample; plenty for an overall brightness
+
+    unsigned offset = chunk.byteOffset;
+    const uint8_t *data = chunk.data;
+    const uint8_t *limit = chunk.data + chunk.byteCount;
+
+    while ((offset & 0xF) != 1 && data < limit) {
+        offset++;
+        data++;
+    }
+
+    uint32_t total = 0;
+    unsigned samples = 0;
+    for (; data < limit; data += 16) {
+        total += *data;
+        samples++;
+    }
+    fieldTotal += total;
+    fieldSamples += samples;
+
+    if (chunk.line == Camera::kLinesPerField - 1 &&
+        chunk.byteCount + chunk.byteOffset == Camera::kBytesPerLine) {
+        finishField(now());
+    }
+}
+
+inline void LatencyCalibrator::finishField(double timestamp)
+{
+    float luma = fieldSamples ? fieldTotal / float(fieldSamples * 255) : 0;
+    fieldTotal = 0;
+    fieldSamples = 0;
+
+    // High-pass filter, so scene changes don't look like probe echoes
+    if (current.fields == 0) {
+        lumaAverage = luma;
+    }
+    float signal = luma - lumaAverage;
+    lumaAverage += (luma - lumaAverage) * kLumaFilterGain;
+
+    /*
+     * Correlate with the probe value at each lag. Lags increase as we walk
+     * backward through the history, so this is a single pass.
+     */
+
+    historyLock.lock();
+    unsigned index = historyHead;
+    unsigned remaining = kHistorySize;
+    for (unsigned bin = 0; bin < kNumBins; bin++) {
+        double t = timestamp - bin * kBinSeconds;
+
+        while (remaining && history[index].timestamp > t) {
+            index = (index ? index : kHistorySize) - 1;
+            remaining--;
+        }
+        if (!remaining || history[index].timestamp == 0) {
+            break;
+        }
+
+        float c = correlation[bin];
+        correlation[bin] = c + (history[index].value * signal - c) * kCorrelationGain;
+    }
+    historyLock.unlock();
+
+    // Find the peak, with sub-bin interpolation using its neighbors
+
+    unsigned peak = 0;
+    float total = 0;
+    for (unsigned bin = 0; bin < kNumBins; bin++) {
+        total += fabsf(correlation[bin]);
+        if (correlation[bin] > correlation[peak]) {
+            peak = bin;
+        }
+    }
+
+    float offsetBins = 0;
+    if (peak > 0 && peak < kNumBins - 1) {
+        float a = correlation[peak - 1];
+        float b = correlation[peak];
+        float c = correlation[peak + 1];
+        float d = a - 2*b + c;
+        if (d < 0) {
+            offsetBins = 0.5f * (a - c) / d;
+        }
+    }
+
+    float mean = total / kNumBins;
+    current.latency = (peak + offsetBins) * kBinSeconds;
+    current.confidence = mean > 0 ? correlation[peak] / mean : 0;
+    current.fields++;
+
+    /*
+     * A single noise spike can make any bin stand out for a moment. Only trust
+     * a peak once it has been confident, and in the same place give or take a
+     * bin, at the end of several consecutive windows.
+     */
+    if (current.fields % kWindowFields == 0) {
+        bool steady = current.confidence >= kMinConfidence &&
+            peak + 1 >= windowPeak && peak <= windowPeak + 1;
+        current.stableWindows = steady ? current.stableWindows + 1 : 0;
+        windowPeak = peak;
+    }
+
+    published.store(current);
+}
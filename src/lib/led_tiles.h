@@ -0,0 +1,368 @@
+/*
+ * LED tiles, for accumulating large numbers of particles.
+ *
+ * Mapped LEDs are grouped into small tiles by location, once per layout.
+ * Each frame, every particle is binned into the tiles its radius overlaps.
+ * A tile's LEDs then only need to look at that tile's bin. Tiles share no
+ * output, so they can be accumulated on separate threads, and each bin is in
+ * particle order, so the sums come out the same regardless of threading.
+ * Binning is split into fixed chunks of particles, which also run on
+ * FrameInfo::parallelFor(), and which are merged in chunk order.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "effect.h"
+
+
+class LedTiles
+{
+public:
+    LedTiles();
+
+    // Group the frame's mapped LEDs into tiles, if we haven't already for this layout
+    void init(const Effect::FrameInfo &f);
+
+    /*
+     * Bin each particle into every tile that its sphere overlaps. point(i) and
+     * radius(i) return each particle's location and radius; particles with zero
+     * radius are skipped. They're called from f.parallelFor(), so they must be
+     * safe to call from several threads. Only call this from beginFrame().
+     */
+    template <typename PointAccessor, typename RadiusAccessor>
+    void bin(const Effect::FrameInfo &f, unsigned count, PointAccessor point, RadiusAccessor radius);
+
+    unsigned numTiles() const;
+    float tileSize() const;
+
+    // LED indices in one tile
+    const unsigned *ledsBegin(unsigned tile) const;
+    const unsigned *ledsEnd(unsigned tile) const;
+
+    // Particles binned into one tile, in order
+    const unsigned *binBegin(unsigned tile) const;
+    const unsigned *binEnd(unsigned tile) const;
+
+    size_t numBinned() const;
+    size_t usedMemory() const;
+
+private:
+    // Tiles get smaller until they average no more than this many LEDs
+    static const unsigned kLedsPerTile = 16;
+    static const unsigned kMaxCellsPerLed = 4;
+
+    // Particles per parallelFor() chunk while binning
+    static const unsigned kParticlesPerBinChunk = 1024;
+
+    const Effect::PixelInfo *layout;
+    unsigned layoutSize;
+
+    Vec3 origin;
+    float invTileSize;
+    int dims[3];
+
+    std::vector<int> cellTile;          // Tile for each grid cell, or -1 if no LEDs there
+    std::vector<Vec3> tileMin;          // Tight bounding box of each tile's LEDs
+    std::vector<Vec3> tileMax;
+    std::vector<unsigned> ledStart;     // First LED in each tile, plus an end marker
+    std::vector<unsigned> leds;         // LED indices, grouped by tile
+
+    typedef std::vector<std::pair<unsigned, unsigned> > PairList;
+    std::vector<PairList> chunkPairs;   // Scratch: (tile, particle) for each chunk of particles
+    std::vector<unsigned> chunkFill;    // Scratch: per chunk and tile, count then next slot in 'bins'
+    std::vector<unsigned> binStart;     // First particle in each bin, plus an end marker
+    std::vector<unsigned> bins;         // Particle indices, grouped by tile
+
+    void layoutGrid(const Effect::FrameInfo &f, float tileSize);
+    int cellCoord(float v, int axis) const;
+
+    template <typename PointAccessor, typename RadiusAccessor>
+    struct FindPairs {
+        LedTiles &tiles;
+        PointAccessor point;
+        RadiusAccessor radius;
+        void operator() (unsigned begin, unsigned end);
+    };
+
+    struct ScatterPairs {
+        LedTiles &tiles;
+        void operator() (unsigned begin, unsigned end);
+    };
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline LedTiles::LedTiles()
+    : layout(0), layoutSize(0), origin(0, 0, 0), invTileSize(0)
+{
+    dims[0] = dims[1] = dims[2] = 0;
+}
+
+inline unsigned LedTiles::numTiles() const
+{
+    return tileMin.size();
+}
+
+inline float LedTiles::tileSize() const
+{
+    return invTileSize ? 1.0f / invTileSize : 0.0f;
+}
+
+inline const unsigned *LedTiles::ledsBegin(unsigned tile) const
+{
+    return &leds[0] + ledStart[tile];
+}
+
+inline const unsigned *LedTiles::ledsEnd(unsigned tile) const
+{
+    return &leds[0] + ledStart[tile + 1];
+}
+
+inline const unsigned *LedTiles::binBegin(unsigned tile) const
+{
+    return bins.empty() ? 0 : &bins[0] + binStart[tile];
+}
+
+inline const unsigned *LedTiles::binEnd(unsigned tile) const
+{
+    return bins.empty() ? 0 : &bins[0] + binStart[tile + 1];
+}
+
+inline size_t LedTiles::numBinned() const
+{
+    return bins.size();
+}
+
+inline size_t LedTiles::usedMemory() const
+{
+    size_t total = cellTile.capacity() * sizeof(int)
+        + (tileMin.capacity() + tileMax.capacity()) * sizeof(Vec3)
+        + (ledStart.capacity() + leds.capacity() + binStart.capacity() + bins.capacity()) * sizeof(unsigned)
+        + chunkFill.capacity() * sizeof(unsigned);
+
+    for (unsigned c = 0; c < chunkPairs.size(); c++) {
+        total += chunkPairs[c].capacity() * sizeof(PairList::value_type);
+    }
+    return total;
+}
+
+inline int LedTiles::cellCoord(float v, int axis) const
+{
+    // Clamped; this also catches NaN, which fails both comparisons
+    float c = (v - origin[axis]) * invTileSize;
+    return c >= 0 ? (c < dims[axis] ? int(c) : dims[axis] - 1) : 0;
+}
+
+inline void LedTiles::init(const Effect::FrameInfo &f)
+{
+    if (f.pixels.empty() || (layout == &f.pixels[0] && layoutSize == f.pixels.size())) {
+        return;
+    }
+    layout = &f.pixels[0];
+    layoutSize = f.pixels.size();
+
+    // Start with one tile, and halve the tile size until tiles are small enough
+
+    Vec3 extent = f.modelSize();
+    float tileSize = std::max(extent[0], std::max(extent[1], extent[2])) * 1.001f;
+    if (!(tileSize > 0)) {
+        tileSize = 1.0f;
+    }
+
+    while (true) {
+        layoutGrid(f, tileSize);
+        if (leds.size() <= numTiles() * kLedsPerTile || cellTile.size() > layoutSize * kMaxCellsPerLed) {
+            // Small enough, or LEDs are so bunched up that smaller tiles won't help
+            break;
+        }
+        tileSize *= 0.5f;
+    }
+}
+
+inline void LedTiles::layoutGrid(const Effect::FrameInfo &f, float tileSize)
+{
+    origin = f.modelMin;
+    invTileSize = 1.0f / tileSize;
+    for (int a = 0; a < 3; a++) {
+        dims[a] = int((f.modelMax[a] - f.modelMin[a]) * invTileSize) + 1;
+    }
+    unsigned numCells = dims[0] * dims[1] * dims[2];
+
+    // Counting sort of mapped LEDs by cell, numbering only the cells that have LEDs
+
+    std::vector<unsigned> pixelCell(f.pixels.size());
+    std::vector<unsigned> cellCount(numCells, 0);
+
+    for (unsigned i = 0; i < f.pixels.size(); i++) {
+        const Effect::PixelInfo &p = f.pixels[i];
+        if (p.isMapped()) {
+            unsigned c = cellCoord(p.point[0], 0) + dims[0] *
+                (cellCoord(p.point[1], 1) + dims[1] * cellCoord(p.point[2], 2));
+            pixelCell[i] = c;
+            cellCount[c]++;
+        }
+    }
+
+    cellTile.assign(numCells, -1);
+    ledStart.clear();
+    unsigned total = 0;
+
+    for (unsigned c = 0; c < numCells; c++) {
+        if (cellCount[c]) {
+            cellTile[c] = ledStart.size();
+            ledStart.push_back(total);
+            total += cellCount[c];
+        }
+    }
+
+    unsigned tiles = ledStart.size();
+    ledStart.push_back(total);
+    leds.resize(total);
+    tileMin.assign(tiles, Vec3(0, 0, 0));
+    tileMax.assign(tiles, Vec3(0, 0, 0));
+
+    std::vector<unsigned> fill(ledStart.begin(), ledStart.end() - 1);
+
+    for (unsigned i = 0; i < f.pixels.size(); i++) {
+        const Effect::PixelInfo &p = f.pixels[i];
+        if (p.isMapped()) {
+            unsigned t = cellTile[pixelCell[i]];
+            bool first = fill[t] == ledStart[t];
+            leds[fill[t]++] = i;
+
+            for (int a = 0; a < 3; a++) {
+                tileMin[t][a] = first ? p.point[a] : std::min(tileMin[t][a], p.point[a]);
+                tileMax[t][a] = first ? p.point[a] : std::max(tileMax[t][a], p.point[a]);
+            }
+        }
+    }
+}
+
+template <typename PointAccessor, typename RadiusAccessor>
+inline void LedTiles::bin(const Effect::FrameInfo &f, unsigned count, PointAccessor point, RadiusAccessor radius)
+{
+    unsigned tiles = numTiles();
+    unsigned chunks = (count + kParticlesPerBinChunk - 1) / kParticlesPerBinChunk;
+
+    // Each chunk finds its own (tile, particle) pairs, and counts them per tile
+
+    chunkPairs.resize(chunks);
+    chunkFill.assign(size_t(chunks) * tiles, 0);
+    FindPairs<PointAccessor, RadiusAccessor> find = { *this, point, radius };
+    f.parallelFor(count, kParticlesPerBinChunk, find);
+
+    /*
+     * Prefix sum over tiles, then chunks within each tile. Every chunk gets its
+     * own slice of each bin, in chunk order, so bins stay in particle order.
+     */
+
+    binStart.resize(tiles + 1);
+    unsigned total = 0;
+    for (unsigned t = 0; t < tiles; t++) {
+        binStart[t] = total;
+        for (unsigned c = 0; c < chunks; c++) {
+            unsigned n = chunkFill[size_t(c) * tiles + t];
+            chunkFill[size_t(c) * tiles + t] = total;
+            total += n;
+        }
+    }
+    binStart[tiles] = total;
+
+    bins.resize(total);
+    ScatterPairs scatter = { *this };
+    f.parallelFor(chunks, 1, scatter);
+}
+
+template <typename PointAccessor, typename RadiusAccessor>
+inline void LedTiles::FindPairs<PointAccessor, RadiusAccessor>::operator() (unsigned begin, unsigned end)
+{
+    unsigned numTiles = tiles.numTiles();
+    unsigned chunk = begin / kParticlesPerBinChunk;
+    PairList &pairs = tiles.chunkPairs[chunk];
+    unsigned *counts = numTiles ? &tiles.chunkFill[size_t(chunk) * numTiles] : 0;
+    const std::vector<int> &cellTile = tiles.cellTile;
+    const std::vector<Vec3> &tileMin = tiles.tileMin;
+    const std::vector<Vec3> &tileMax = tiles.tileMax;
+    const int *dims = tiles.dims;
+
+    pairs.clear();
+
+    for (unsigned i = begin; i < end; i++) {
+        Vec3 p = point(i);
+        float r = radius(i);
+        if (!(r > 0)) {
+            continue;
+        }
+
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = tiles.cellCoord(p[a] - r, a);
+            hi[a] = tiles.cellCoord(p[a] + r, a);
+        }
+
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    int t = cellTile[x + dims[0] * (y + dims[1] * z)];
+                    if (t < 0) {
+                        continue;
+                    }
+
+                    // Distance from the particle to the tile's LEDs' bounding box
+                    Vec3 d(0, 0, 0);
+                    for (int a = 0; a < 3; a++) {
+                        d[a] = std::max(0.0f, std::max(tileMin[t][a] - p[a], p[a] - tileMax[t][a]));
+                    }
+                    if (sqrlen(d) < r * r) {
+                        pairs.push_back(std::make_pair(unsigned(t), i));
+                        counts[t]++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+inline void LedTiles::ScatterPairs::operator() (unsigned begin, unsigned end)
+{
+    unsigned numTiles = tiles.numTiles();
+
+    for (unsigned c = begin; c < end; c++) {
+        const PairList &pairs = tiles.chunkPairs[c];
+        unsigned *fill = numTiles ? &tiles.chunkFill[size_t(c) * numTiles] : 0;
+        unsigned *bins = tiles.bins.empty() ? 0 : &tiles.bins[0];
+
+        for (unsigned i = 0; i < pairs.size(); i++) {
+            bins[fill[pairs[i].first]++] = pairs[i].second;
+        }
+    }
+}
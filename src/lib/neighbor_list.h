@@ -0,0 +1,243 @@
+/*
+ * Verlet neighbor list, for fixed-radius particle interactions over many steps.
+ *
+ * One build finds every pair of points within (radius + skin), using a
+ * SpatialGrid. The same lists stay correct for interactions within 'radius'
+ * until some point moves more than skin/2 from where it was during the build.
+ * Simulations with several small steps per frame can then skip most index
+ * rebuilds and radius searches. They call update() before each step, and
+ * test actual distances against the neighbors it visits.
+ *
+ * Points that move further, like particles respawning somewhere else, are
+ * "escaped". Rather than rebuilding for each one, escaped points are checked
+ * against everyone until there are enough of them to justify a rebuild.
+ *
+ * Simulations that move points in between queries of the same step, like
+ * Gauss-Seidel style updates, must report those moves with moved() or
+ * markEscaped(). Otherwise a point could get further than skin/2 from its
+ * reference before the next update(), and its interactions would be missed.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "svl/SVL.h"
+#include "spatial_grid.h"
+
+
+class NeighborList
+{
+public:
+    NeighborList();
+
+    /*
+     * Call before each step, with the current points; point(i) returns a Vec3.
+     * Rebuilds if the count, radius, or skin changed, or too many points have
+     * moved more than skin/2 since the last build. Returns true if rebuilt.
+     */
+    template <typename Accessor>
+    bool update(unsigned count, float radius, float skin, Accessor point);
+
+    // Same thing, for points stored in a vector
+    bool update(const std::vector<Vec3> &points, float radius, float skin);
+
+    // Unconditional rebuild
+    template <typename Accessor>
+    void build(unsigned count, float radius, float skin, Accessor point);
+
+    // Force a rebuild on the next update()
+    void invalidate();
+
+    // Point i moved since update(); marks it escaped if it went too far
+    void moved(unsigned i, Vec3 point);
+
+    // Point i may be anywhere now, like after a respawn
+    void markEscaped(unsigned i);
+
+    /*
+     * Call visit(j) for every other point j that may be within 'radius' of
+     * point i. This is a superset; the visitor checks actual distances.
+     */
+    template <typename Visitor>
+    void visitNeighbors(unsigned i, Visitor &visit) const;
+
+    // Statistics, for debug output
+    unsigned numBuilds;
+    unsigned numUpdates;
+    size_t numPairs() const;
+
+private:
+    // Rebuild once more than this fraction of the points have escaped
+    static const unsigned kEscapedFractionForRebuild = 8;
+
+    float builtRadius;
+    float builtSkin;
+    bool valid;
+
+    std::vector<Vec3> reference;        // Positions at the last build
+    std::vector<unsigned> start;        // First neighbor for each point, plus an end marker
+    std::vector<unsigned> neighbors;    // Neighbor indices, grouped by point
+    std::vector<unsigned> escaped;      // Points that moved too far since the build
+    std::vector<uint8_t> isEscaped;     // Flag for each point
+    SpatialGrid grid;
+
+    struct Collector {
+        std::vector<unsigned> &neighbors;
+        const std::vector<Vec3> &reference;
+        unsigned self;
+        Real radius2;
+
+        void operator() (unsigned i) {
+            if (i != self && sqrlen(reference[i] - reference[self]) < radius2) {
+                neighbors.push_back(i);
+            }
+        }
+    };
+
+    struct VectorAccessor {
+        const std::vector<Vec3> &points;
+        Vec3 operator() (unsigned i) const { return points[i]; }
+    };
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline NeighborList::NeighborList()
+    : numBuilds(0), numUpdates(0), builtRadius(0), builtSkin(0), valid(false)
+{}
+
+inline void NeighborList::invalidate()
+{
+    valid = false;
+}
+
+template <typename Visitor>
+inline void NeighborList::visitNeighbors(unsigned i, Visitor &visit) const
+{
+    if (isEscaped[i]) {
+        // Our list is stale, try everyone
+        for (unsigned j = 0, count = reference.size(); j < count; j++) {
+            if (j != i) {
+                visit(j);
+            }
+        }
+        return;
+    }
+
+    // Escaped points may have left our list, or arrived from elsewhere
+    for (unsigned s = start[i], e = start[i + 1]; s < e; s++) {
+        unsigned j = neighbors[s];
+        if (!isEscaped[j]) {
+            visit(j);
+        }
+    }
+    for (unsigned s = 0; s < escaped.size(); s++) {
+        visit(escaped[s]);
+    }
+}
+
+inline void NeighborList::moved(unsigned i, Vec3 point)
+{
+    if (valid && i < reference.size() && !(sqrlen(point - reference[i]) <= builtSkin * builtSkin * 0.25f)) {
+        markEscaped(i);
+    }
+}
+
+inline void NeighborList::markEscaped(unsigned i)
+{
+    // Before the first build, there's nothing to escape from
+    if (valid && i < isEscaped.size() && !isEscaped[i]) {
+        isEscaped[i] = 1;
+        escaped.push_back(i);
+    }
+}
+
+inline size_t NeighborList::numPairs() const
+{
+    return neighbors.size() / 2;
+}
+
+template <typename Accessor>
+inline bool NeighborList::update(unsigned count, float radius, float skin, Accessor point)
+{
+    numUpdates++;
+
+    if (valid && count == reference.size() && radius == builtRadius && skin == builtSkin) {
+        float limit2 = skin * skin * 0.25f;
+        for (unsigned i = 0; i < count; i++) {
+            if (!isEscaped[i] && !(sqrlen(point(i) - reference[i]) <= limit2)) {
+                markEscaped(i);
+            }
+        }
+        if (escaped.size() * kEscapedFractionForRebuild <= count) {
+            return false;
+        }
+    }
+
+    build(count, radius, skin, point);
+    return true;
+}
+
+inline bool NeighborList::update(const std::vector<Vec3> &points, float radius, float skin)
+{
+    VectorAccessor accessor = { points };
+    return update(points.size(), radius, skin, accessor);
+}
+
+template <typename Accessor>
+inline void NeighborList::build(unsigned count, float radius, float skin, Accessor point)
+{
+    numBuilds++;
+    valid = true;
+    builtRadius = radius;
+    builtSkin = skin;
+
+    reference.resize(count);
+    for (unsigned i = 0; i < count; i++) {
+        reference[i] = point(i);
+    }
+
+    float listRadius = radius + skin;
+    VectorAccessor accessor = { reference };
+    grid.build(count, listRadius, accessor);
+
+    start.resize(count + 1);
+    neighbors.clear();
+    escaped.clear();
+    isEscaped.assign(count, 0);
+
+    for (unsigned i = 0; i < count; i++) {
+        start[i] = neighbors.size();
+        Collector collector = { neighbors, reference, i, listRadius * listRadius };
+        grid.visitCandidates(reference[i], listRadius, collector);
+    }
+    start[count] = neighbors.size();
+}
@@ -28,23 +28,21 @@
 #pragma once
 
 #include "effect.h"
-#include "nanoflann.h"  // Tiny KD-tree library
+#include "particle_vector.h"
+#include "spatial_grid.h"
+#include "led_tiles.h"
+#include "particle_kernels.h"
 
 
-class ParticleEffect : public Effect {
+/*
+ * The Kernel policy sets particle shape, and it's inlined into every sampling
+ * loop; see particle_kernels.h. Most effects use ParticleEffect, with Poly6.
+ * For a different look, derive from ParticleEffectT<CubicSplineKernel> or the like.
+ */
+template <typename Kernel>
+class ParticleEffectT : public Effect {
 public:
-    /*
-     * Information for drawing particles. If your effect needs to keep additional
-     * data about particles, use a parallel array or other separate data structure.
-     */
-    struct ParticleAppearance {
-        Vec3 point;
-        Vec3 color;
-        float radius;
-        float intensity;
-    };
-
-    ParticleEffect();
+    ParticleEffectT();
 
     virtual void beginFrame(const FrameInfo& f);
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
@@ -52,39 +50,83 @@ public:
 
     // Sample the particle space in various ways
     Vec3 sampleColor(Vec3 location) const;
+    Vec3 sampleColor(const PixelInfo &p) const;
     float sampleIntensity(Vec3 location) const;
-    Vec3 sampleIntensityGradient(Vec3 location, float epsilon = 1e-3) const;
+    Vec3 sampleIntensityGradient(Vec3 location) const;
+
+    // Intensity and its gradient together, in one pass
+    float sampleIntensityAndGradient(Vec3 location, Vec3 &gradient) const;
+
+    /*
+     * Rendering works in one of two directions. Gathering searches the index for
+     * particles near each LED, from shader() on every rendering thread. Splatting
+     * bins particles into tiles of nearby LEDs during beginFrame(), then each tile
+     * adds up colors for its LEDs from just its own bin, in parallel on the mixer's
+     * threads, and shader() just looks up the result. Splatting is the mode for
+     * massive numbers of large particles. Binning runs on the mixer's threads too.
+     *
+     * Automatic mode decides each frame: splat when particles are few compared to
+     * LEDs, or large compared to LED tiles, and otherwise gather.
+     */
+    enum RenderMode {
+        kRenderAuto,
+        kRenderGather,
+        kRenderSplat,
+    };
+    RenderMode renderMode;
 
 protected:
     /*
-     * List of appearances for particles we're drawing. Calculate this in beginFrame(),
-     * or keep it persistent across frames and update the parts you're changing.
+     * Particles we're drawing, one array per attribute. Calculate these in beginFrame(),
+     * or keep them persistent across frames and update the parts you're changing.
+     * Drawing uses point, color, radius, and intensity. Velocity and age are there for
+     * simulations; if your effect needs to keep additional data about particles, use a
+     * parallel array and ParticleVector::compactArray().
      */
-    typedef std::vector<ParticleAppearance> AppearanceVector;
-    AppearanceVector appearance;
+    ParticleVector particles;
 
     typedef std::vector<std::pair<size_t, Real> > ResultSet_t;
 
     void buildIndex();
 
+    /*
+     * Reusable hit list for radius searches during beginFrame(). Using this instead
+     * of a local ResultSet_t avoids a heap allocation per search. It's shared, so
+     * don't touch it from shader(), which runs on many threads at once.
+     */
+    ResultSet_t scratchHits;
+
+    /*
+     * Splatting state. Either way, beginFrame() is where particles are captured
+     * for drawing, so finish moving them before calling it. Before the first
+     * beginFrame(), shader() gathers from the index.
+     */
+    static const unsigned kTilesPerSplatChunk = 4;
+    static constexpr float kSplatRadiusInTiles = 2.0;
+    std::vector<Vec3> splatColors;
+    bool splatValid;
+    LedTiles tiles;
+
+    bool shouldSplat(const FrameInfo &f);
+    void splat(const FrameInfo &f);
+
     // Low-level sampling utilities, for use on an index search result set
     Vec3 sampleColor(ResultSet_t &hits) const;
     float sampleIntensity(ResultSet_t &hits) const;
     float sampleIntensity(ResultSet_t &hits, Vec3 point) const;
 
     /*
-     * KD-tree as a spatial index for finding particles quickly by location.
-     * This index is rebuilt each frame during ParticleEffect::buildFrame().
-     * The ParticleEffect itself uses this index for calculating pixel values,
+     * Uniform grid as a spatial index for finding particles quickly by location.
+     * This index is rebuilt each frame during ParticleEffectT::buildFrame().
+     * The ParticleEffectT itself uses this index for calculating pixel values,
      * but subclasses may also want to use it for phyiscs or interaction.
+     *
+     * Cells are sized for radiusMax. Distances are measured to the particles'
+     * current positions, so small moves since the last rebuild are tolerated.
      */
 
-    typedef nanoflann::KDTreeSingleIndexAdaptor<
-        nanoflann::L2_Simple_Adaptor< Real, ParticleEffect >,
-        ParticleEffect, 3> IndexTree;
-
     struct Index {
-        Index(ParticleEffect &e);
+        Index(const ParticleEffectT &e);
 
         void radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const;
         void radiusSearch(ResultSet_t& hits, Vec3 point) const;
@@ -92,13 +134,119 @@ protected:
         Vec3 aabbMin;
         Vec3 aabbMax;
         float radiusMax;
-        IndexTree tree;
-        bool treeIsValid;
+        SpatialGrid grid;
+        const ParticleEffectT &effect;
     } index;
 
+private:
+    // Glue between the particle vector, SpatialGrid, and LedTiles
+
+    struct PointAccessor {
+        const Vec3 *point;
+        PointAccessor(const ParticleVector &p) : point(p.empty() ? 0 : &p.point[0]) {}
+        Vec3 operator() (unsigned i) const { return point[i]; }
+    };
+
+    struct SplatRadiusAccessor {
+        const ParticleVector &particles;
+
+        // Particles that can't contribute don't need to be binned
+        float operator() (unsigned i) const {
+            return particles.intensity[i] ? particles.radius[i] : 0.0f;
+        }
+    };
+
+    // Just what splatting needs from one particle, packed together for each tile
+    struct SplatParticle {
+        Vec3 point;
+        float invRadius2;
+        Vec3 color;     // Premultiplied by intensity
+    };
+
+    // Packed bins, one scratch array per parallelFor() chunk
+    std::vector<std::vector<SplatParticle> > splatScratch;
+
+    // Accumulate colors for a range of tiles, after binning
+    struct SplatTiles {
+        ParticleEffectT &effect;
+        const FrameInfo &f;
+        Vec3 *colors;
+
+        void operator() (unsigned begin, unsigned end);
+    };
+
+    struct HitCollector {
+        ResultSet_t &hits;
+        const ParticleVector &particles;
+        Vec3 point;
+        Real radius2;
+
+        void operator() (unsigned i) {
+            Real dist2 = sqrlen(particles.point[i] - point);
+            if (dist2 < radius2) {
+                hits.push_back(std::make_pair(size_t(i), dist2));
+            }
+        }
+    };
+
+    /*
+     * Visitors for sampling straight from the index, without building a hit list.
+     * These run once per pixel on every rendering thread, so no allocation.
+     */
+
+    struct ColorSampler {
+        const ParticleVector &particles;
+        Vec3 point;
+        Vec3 total;
+
+        void operator() (unsigned i) {
+            float q2 = sqrlen(particles.point[i] - point) / sq(particles.radius[i]);
+            if (q2 < 1.0f) {
+                total += particles.color[i] * (particles.intensity[i] * Kernel::kernel2(q2));
+            }
+        }
+    };
+
+    struct IntensitySampler {
+        const ParticleVector &particles;
+        Vec3 point;
+        float total;
+
+        void operator() (unsigned i) {
+            float q2 = sqrlen(particles.point[i] - point) / sq(particles.radius[i]);
+            if (q2 < 1.0f) {
+                total += particles.intensity[i] * Kernel::kernel2(q2);
+            }
+        }
+    };
+
+    /*
+     * Intensity plus its analytic gradient. In terms of q2 = |d|^2 / r^2,
+     * the gradient of the kernel is 2 K'(q2) d / r^2.
+     */
+    struct IntensityGradientSampler {
+        const ParticleVector &particles;
+        Vec3 point;
+        float total;
+        Vec3 gradient;
+
+        void operator() (unsigned i) {
+            Vec3 d = point - particles.point[i];
+            float invR2 = 1.0f / sq(particles.radius[i]);
+            float q2 = sqrlen(d) * invR2;
+            if (q2 < 1.0f) {
+                float intensity = particles.intensity[i];
+                total += intensity * Kernel::kernel2(q2);
+                gradient += d * (2.0f * intensity * Kernel::derivative2(q2) * invR2);
+            }
+        }
+    };
+
+protected:
     /*
-     * Kernel function; determines particle shape
-     * Poly6 kernel, Müller, Charypar, & Gross (2003)
+     * Poly6 kernel, Müller, Charypar, & Gross (2003), for physics.
+     * These don't follow the Kernel policy, so simulations act the same
+     * regardless of how particles are drawn.
      * q normalized in range [0, 1].
      * Has compact support; kernel forced to zero outside this range.
      */
@@ -109,40 +257,6 @@ protected:
 
     // First derivative of kernel()
     static float kernelDerivative(float q);
-
-public:
-    // Implementation glue for our KD-tree index
-
-    inline size_t kdtree_get_point_count() const
-    {
-        return appearance.size();
-    }
-
-    inline Real kdtree_distance(const Real *p1, const size_t idx_p2, size_t size) const
-    {
-        const ParticleAppearance &a = appearance[idx_p2];
-        Real d0 = p1[0] - a.point[0];
-        Real d1 = p1[1] - a.point[1];
-        Real d2 = p1[2] - a.point[2];
-        return sq(d0) + sq(d1) + sq(d2);
-    }
-
-    Real kdtree_get_pt(const size_t idx, int dim) const
-    {
-        return appearance[idx].point[dim];
-    }
-
-    template <class BBOX>
-    bool kdtree_get_bbox(BBOX &bb) const
-    {
-        bb[0].low  = index.aabbMin[0];
-        bb[1].low  = index.aabbMin[1];
-        bb[2].low  = index.aabbMin[2];
-        bb[0].high = index.aabbMax[0];
-        bb[1].high = index.aabbMax[1];
-        bb[2].high = index.aabbMax[2];
-        return true;
-    }
 };
 
 
@@ -151,188 +265,289 @@ public:
  *****************************************************************************************/
 
 
-inline ParticleEffect::ParticleEffect()
-    : index(*this)
+template <typename Kernel>
+inline ParticleEffectT<Kernel>::ParticleEffectT()
+    : renderMode(kRenderAuto), splatValid(false), index(*this)
 {}
 
-inline ParticleEffect::Index::Index(ParticleEffect& e)
+template <typename Kernel>
+inline ParticleEffectT<Kernel>::Index::Index(const ParticleEffectT& e)
     : aabbMin(0, 0, 0),
       aabbMax(0, 0, 0),
       radiusMax(0),
-      tree(3, e),
-      treeIsValid(false)
+      effect(e)
 {}
 
-inline void ParticleEffect::Index::radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::Index::radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const
 {
-    if (treeIsValid) {
-        nanoflann::SearchParams params;
-        params.sorted = false;
-        tree.radiusSearch(&point[0], radius * radius, hits, params);
-    } else {
-        hits.clear();
-    }
+    hits.clear();
+    HitCollector collector = { hits, effect.particles, point, radius * radius };
+    grid.visitCandidates(point, radius, collector);
 }
 
-inline void ParticleEffect::Index::radiusSearch(ResultSet_t& hits, Vec3 point) const
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::Index::radiusSearch(ResultSet_t& hits, Vec3 point) const
 {
     radiusSearch(hits, point, radiusMax);
 }
 
-inline float ParticleEffect::kernel(float q)
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::kernel(float q)
 {
     float a = 1 - q * q;
     return a * a * a;
 }
 
-inline float ParticleEffect::kernel2(float q2)
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::kernel2(float q2)
 {
-    float a = 1 - q2;
-    return a * a * a;
+    return Poly6Kernel::kernel2(q2);
 }
 
-inline float ParticleEffect::kernelDerivative(float q)
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::kernelDerivative(float q)
 {
     float a = 1 - q * q;
     return -6.0f * q * a * a;
 }
 
-inline void ParticleEffect::beginFrame(const FrameInfo& f)
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::beginFrame(const FrameInfo& f)
 {
     buildIndex();
+    splatValid = shouldSplat(f);
+    if (splatValid) {
+        splat(f);
+    }
+}
+
+template <typename Kernel>
+inline bool ParticleEffectT<Kernel>::shouldSplat(const FrameInfo& f)
+{
+    switch (renderMode) {
+        case kRenderGather: return false;
+        case kRenderSplat: return true;
+        default: break;
+    }
+
+    /*
+     * Gathering searches cells about as big as the largest particle, and splatting
+     * searches whole tiles, so small particles favor gathering once they're
+     * numerous. Few particles are always cheaper to splat.
+     */
+    tiles.init(f);
+    return particles.size() <= f.pixels.size() ||
+        index.radiusMax >= tiles.tileSize() * kSplatRadiusInTiles;
 }
 
-inline void ParticleEffect::buildIndex()
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::splat(const FrameInfo& f)
 {
-    if (appearance.empty()) {
+    // Clear without reallocating; unmapped pixels stay black
+    splatColors.assign(f.pixels.size(), Vec3(0, 0, 0));
+
+    tiles.init(f);
+    SplatRadiusAccessor radius = { particles };
+    tiles.bin(f, particles.size(), PointAccessor(particles), radius);
+
+    if (!splatColors.empty()) {
+        splatScratch.resize((tiles.numTiles() + kTilesPerSplatChunk - 1) / kTilesPerSplatChunk);
+        SplatTiles body = { *this, f, &splatColors[0] };
+        f.parallelFor(tiles.numTiles(), kTilesPerSplatChunk, body);
+    }
+}
+
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::SplatTiles::operator() (unsigned begin, unsigned end)
+{
+    const ParticleVector &particles = effect.particles;
+    std::vector<SplatParticle> &packed = effect.splatScratch[begin / kTilesPerSplatChunk];
+
+    for (unsigned t = begin; t < end; t++) {
+
+        // Copy this tile's particles out once, instead of chasing indices for every LED
+        packed.clear();
+        for (const unsigned *i = effect.tiles.binBegin(t); i != effect.tiles.binEnd(t); ++i) {
+            SplatParticle sp;
+            sp.point = particles.point[*i];
+            sp.invRadius2 = 1.0f / sq(particles.radius[*i]);
+            sp.color = particles.color[*i] * particles.intensity[*i];
+            packed.push_back(sp);
+        }
+
+        const SplatParticle *binBegin = packed.empty() ? 0 : &packed[0];
+        const SplatParticle *binEnd = binBegin + packed.size();
+
+        for (const unsigned *led = effect.tiles.ledsBegin(t); led != effect.tiles.ledsEnd(t); ++led) {
+            Vec3 point = f.pixels[*led].point;
+            Vec3 total(0, 0, 0);
+
+            for (const SplatParticle *sp = binBegin; sp != binEnd; ++sp) {
+                float q2 = sqrlen(sp->point - point) * sp->invRadius2;
+                if (q2 < 1.0f) {
+                    total += sp->color * Kernel::kernel2(q2);
+                }
+            }
+
+            colors[*led] = total;
+        }
+    }
+}
+
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::buildIndex()
+{
+    if (particles.empty()) {
         // No particles
         index.aabbMin = Vec3(0, 0, 0);
         index.aabbMax = Vec3(0, 0, 0);
         index.radiusMax = 0;
-        index.treeIsValid = false;
+        index.grid.clear();
 
     } else {
         // Measure bounding box and largest radius in 'particles'
-        index.aabbMin = appearance[0].point;
-        index.aabbMax = appearance[0].point;
-        index.radiusMax = appearance[0].radius;
-        for (unsigned i = 1; i < appearance.size(); ++i) {
-            const ParticleAppearance& particle = appearance[i];
-            
-            index.aabbMin[0] = std::min(index.aabbMin[0], particle.point[0]);
-            index.aabbMin[1] = std::min(index.aabbMin[1], particle.point[1]);
-            index.aabbMin[2] = std::min(index.aabbMin[2], particle.point[2]);
+        index.aabbMin = particles.point[0];
+        index.aabbMax = particles.point[0];
+        for (unsigned i = 1; i < particles.size(); ++i) {
+            const Vec3& point = particles.point[i];
             
-            index.aabbMax[0] = std::max(index.aabbMax[0], particle.point[0]);
-            index.aabbMax[1] = std::max(index.aabbMax[1], particle.point[1]);
-            index.aabbMax[2] = std::max(index.aabbMax[2], particle.point[2]);
+            index.aabbMin[0] = std::min(index.aabbMin[0], point[0]);
+            index.aabbMin[1] = std::min(index.aabbMin[1], point[1]);
+            index.aabbMin[2] = std::min(index.aabbMin[2], point[2]);
             
-            index.radiusMax = std::max(index.radiusMax, particle.radius);
+            index.aabbMax[0] = std::max(index.aabbMax[0], point[0]);
+            index.aabbMax[1] = std::max(index.aabbMax[1], point[1]);
+            index.aabbMax[2] = std::max(index.aabbMax[2], point[2]);
         }
 
-        // Rebuild KD-tree. Fails if we have zero particles.
-        index.tree.buildIndex();
-        index.treeIsValid = true;
+        // Separate pass over just the radii; this one vectorizes
+        float radiusMax = particles.radius[0];
+        for (unsigned i = 1; i < particles.size(); ++i) {
+            radiusMax = std::max(radiusMax, particles.radius[i]);
+        }
+        index.radiusMax = radiusMax;
+
+        index.grid.build(particles.size(), index.radiusMax, PointAccessor(particles));
     }
 }
 
-inline void ParticleEffect::shader(Vec3& rgb, const PixelInfo& p) const
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::shader(Vec3& rgb, const PixelInfo& p) const
 {
-    rgb = sampleColor(p.point);
+    rgb = sampleColor(p);
 }
 
-inline Vec3 ParticleEffect::sampleColor(Vec3 location) const
+template <typename Kernel>
+inline Vec3 ParticleEffectT<Kernel>::sampleColor(const PixelInfo& p) const
 {
-    ResultSet_t hits;
-    index.radiusSearch(hits, location);
-    return sampleColor(hits);
+    // Same as sampleColor(p.point), but uses this frame's splat if we have one
+    return splatValid ? splatColors[p.index] : sampleColor(p.point);
 }
 
-inline Vec3 ParticleEffect::sampleColor(ResultSet_t &hits) const
+template <typename Kernel>
+inline Vec3 ParticleEffectT<Kernel>::sampleColor(Vec3 location) const
+{
+    ColorSampler sampler = { particles, location, Vec3(0, 0, 0) };
+    index.grid.visitCandidates(location, index.radiusMax, sampler);
+    return sampler.total;
+}
+
+template <typename Kernel>
+inline Vec3 ParticleEffectT<Kernel>::sampleColor(ResultSet_t &hits) const
 {
     Vec3 accumulator(0, 0, 0);
 
     for (unsigned i = 0; i < hits.size(); i++) {
-        const ParticleAppearance &particle = appearance[hits[i].first];
+        unsigned p = hits[i].first;
         float dist2 = hits[i].second;
 
         // Normalized distance
-        float q2 = dist2 / sq(particle.radius);
+        float q2 = dist2 / sq(particles.radius[p]);
         if (q2 < 1.0f) {
-            accumulator += particle.color * (particle.intensity * kernel2(q2));
+            accumulator += particles.color[p] * (particles.intensity[p] * Kernel::kernel2(q2));
         }
     }
 
     return accumulator;
 }
 
-inline float ParticleEffect::sampleIntensity(Vec3 location) const
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::sampleIntensity(Vec3 location) const
 {
-    ResultSet_t hits;
-    index.radiusSearch(hits, location);
-    return sampleIntensity(hits);
+    IntensitySampler sampler = { particles, location, 0 };
+    index.grid.visitCandidates(location, index.radiusMax, sampler);
+    return sampler.total;
 }
 
-inline float ParticleEffect::sampleIntensity(ResultSet_t &hits) const
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::sampleIntensity(ResultSet_t &hits) const
 {
     float accumulator = 0;
 
     for (unsigned i = 0; i < hits.size(); i++) {
-        const ParticleAppearance &particle = appearance[hits[i].first];
+        unsigned p = hits[i].first;
         float dist2 = hits[i].second;
 
         // Normalized distance
-        float q2 = dist2 / sq(particle.radius);
+        float q2 = dist2 / sq(particles.radius[p]);
         if (q2 < 1.0f) {
-            accumulator += particle.intensity * kernel2(q2);
+            accumulator += particles.intensity[p] * Kernel::kernel2(q2);
         }
     }
 
     return accumulator;
 }
 
-inline float ParticleEffect::sampleIntensity(ResultSet_t &hits, Vec3 point) const
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::sampleIntensity(ResultSet_t &hits, Vec3 point) const
 {
     // Instead of using the distance computed during the search, use the
-    // distance computed to a specific test point. This is used during the
-    // gradient calculation.
+    // distance computed to a specific test point. One wide search can then
+    // serve several nearby test points.
 
     float accumulator = 0;
 
     for (unsigned i = 0; i < hits.size(); i++) {
-        const ParticleAppearance &particle = appearance[hits[i].first];
-        float dist2 = sqrlen(point - particle.point);
+        unsigned p = hits[i].first;
+        float dist2 = sqrlen(point - particles.point[p]);
 
         // Normalized distance
-        float q2 = dist2 / sq(particle.radius);
+        float q2 = dist2 / sq(particles.radius[p]);
         if (q2 < 1.0f) {
-            accumulator += particle.intensity * kernel2(q2);
+            accumulator += particles.intensity[p] * Kernel::kernel2(q2);
         }
     }
 
     return accumulator;
 }
 
-inline Vec3 ParticleEffect::sampleIntensityGradient(Vec3 location, float epsilon) const
+template <typename Kernel>
+inline float ParticleEffectT<Kernel>::sampleIntensityAndGradient(Vec3 location, Vec3 &gradient) const
+{
+    IntensityGradientSampler sampler = { particles, location, 0, Vec3(0, 0, 0) };
+    index.grid.visitCandidates(location, index.radiusMax, sampler);
+    gradient = sampler.gradient;
+    return sampler.total;
+}
+
+template <typename Kernel>
+inline Vec3 ParticleEffectT<Kernel>::sampleIntensityGradient(Vec3 location) const
 {
-    ResultSet_t hits;
-    index.radiusSearch(hits, location, index.radiusMax + epsilon);
-
-    Vec3 ex(epsilon, 0, 0);
-    Vec3 ey(0, epsilon, 0);
-    Vec3 ez(0, 0, epsilon);
-    float d = 0.5f / epsilon;
-
-    // Finite difference approximation
-    return d * Vec3(
-        sampleIntensity(hits, location + ex) - sampleIntensity(hits, location - ex),
-        sampleIntensity(hits, location + ey) - sampleIntensity(hits, location - ey),
-        sampleIntensity(hits, location + ez) - sampleIntensity(hits, location - ez));
+    Vec3 gradient;
+    sampleIntensityAndGradient(location, gradient);
+    return gradient;
 }
 
-inline void ParticleEffect::debug(const DebugInfo& d)
+template <typename Kernel>
+inline void ParticleEffectT<Kernel>::debug(const DebugInfo& d)
 {
     fprintf(stderr, "\t[particle] %.1f kB, radiusMax = %.1f\n",
-        index.tree.usedMemory() / 1024.0f,
+        index.grid.usedMemory() / 1024.0f,
         index.radiusMax);
+    fprintf(stderr, "\t[particle] %s, %d tiles, %.1f kB, %d particles binned\n",
+        splatValid ? "splatting" : "gathering",
+        tiles.numTiles(), tiles.usedMemory() / 1024.0f, (int)tiles.numBinned());
 }
+
+typedef ParticleEffectT<Poly6Kernel> ParticleEffect;
@@ -0,0 +1,178 @@
+/*
+ * Kernel policies for ParticleEffectT, which determine particle shape.
+ *
+ * Each kernel is a class with static functions of q2 = |d|^2 / r^2, the squared
+ * distance from the particle normalized to its radius. They're called straight
+ * from the sampling loops, so they get inlined with no dispatch per particle.
+ * All kernels have compact support: callers only evaluate them for q2 < 1, and
+ * everything outside is zero. Each kernel is 1 at the particle's center.
+ *
+ *   static float kernel2(float q2);        Kernel value
+ *   static float derivative2(float q2);    Derivative of kernel2() with respect to q2
+ *
+ * The gradient with respect to position is 2 * derivative2(q2) * d / r^2.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <math.h>
+
+
+/*
+ * Poly6 kernel, Müller, Charypar, & Gross (2003). Smooth, and cheap since it
+ * needs no square root. This is the default.
+ */
+struct Poly6Kernel
+{
+    static float kernel2(float q2);
+    static float derivative2(float q2);
+};
+
+/*
+ * Cubic B-spline kernel (Monaghan 1992), scaled to a radius of 1. A flatter
+ * top and longer tail than Poly6.
+ */
+struct CubicSplineKernel
+{
+    static float kernel2(float q2);
+    static float derivative2(float q2);
+};
+
+/*
+ * Gaussian, truncated and offset to reach zero at the radius. Evaluated with
+ * a lookup table and linear interpolation, so there's no exp() per particle.
+ */
+struct GaussianKernel
+{
+    static float kernel2(float q2);
+    static float derivative2(float q2);
+
+private:
+    static const unsigned kTableSize = 256;
+    static const int kSharpness = 4;
+
+    struct Table {
+        Table();
+        float value[kTableSize];
+    };
+
+    // Static data, built once at startup, so lookups don't pay for a guarded local
+    // static. It's a template only so this header can define it.
+    template <typename T> struct Storage {
+        static const Table table;
+    };
+
+    static float offset();
+};
+
+// Hard-edged disc of constant intensity
+struct BoxKernel
+{
+    static float kernel2(float q2);
+    static float derivative2(float q2);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline float Poly6Kernel::kernel2(float q2)
+{
+    float a = 1 - q2;
+    return a * a * a;
+}
+
+inline float Poly6Kernel::derivative2(float q2)
+{
+    float a = 1 - q2;
+    return -3.0f * a * a;
+}
+
+inline float CubicSplineKernel::kernel2(float q2)
+{
+    float q = sqrtf(q2);
+    if (q < 0.5f) {
+        return 1.0f - 6.0f * q2 + 6.0f * q2 * q;
+    }
+    float a = 1.0f - q;
+    return 2.0f * a * a * a;
+}
+
+inline float CubicSplineKernel::derivative2(float q2)
+{
+    // Chain rule, d/dq2 = d/dq / 2q
+    float q = sqrtf(q2);
+    if (q < 0.5f) {
+        return -6.0f + 9.0f * q;
+    }
+    float a = 1.0f - q;
+    return -3.0f * a * a / q;
+}
+
+inline GaussianKernel::Table::Table()
+{
+    float scale = 1.0f / (1.0f - expf(-kSharpness));
+    for (unsigned i = 0; i < kTableSize; i++) {
+        float q2 = i / float(kTableSize - 1);
+        value[i] = (expf(-kSharpness * q2) - expf(-kSharpness)) * scale;
+    }
+}
+
+template <typename T>
+const GaussianKernel::Table GaussianKernel::Storage<T>::table;
+
+inline float GaussianKernel::offset()
+{
+    // Value of the un-offset, normalized Gaussian at the radius
+    return expf(-kSharpness) / (1.0f - expf(-kSharpness));
+}
+
+inline float GaussianKernel::kernel2(float q2)
+{
+    const float *value = Storage<void>::table.value;
+    float x = q2 * (kTableSize - 1);
+    int i = x < kTableSize - 2 ? int(x) : kTableSize - 2;
+    float f = x - i;
+    return value[i] + (value[i + 1] - value[i]) * f;
+}
+
+inline float GaussianKernel::derivative2(float q2)
+{
+    // The exponential is its own derivative, up to the offset that brings it to zero at the radius
+    return -kSharpness * (kernel2(q2) + offset());
+}
+
+inline float BoxKernel::kernel2(float q2)
+{
+    return 1.0f;
+}
+
+inline float BoxKernel::derivative2(float q2)
+{
+    return 0.0f;
+}
@@ -0,0 +1,138 @@
+/*
+ * Particle storage, as a structure of arrays.
+ *
+ * Each attribute lives in its own contiguous array, so a loop that only
+ * touches positions and velocities streams through just those, and simple
+ * per-attribute loops can be vectorized by the compiler. All arrays always
+ * have the same length.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "svl/SVL.h"
+
+
+class ParticleVector
+{
+public:
+    // Drawing attributes, used by ParticleEffect
+    std::vector<Vec3> point;
+    std::vector<Vec3> color;
+    std::vector<float> radius;
+    std::vector<float> intensity;
+
+    // Simulation attributes, for effects that want them
+    std::vector<Vec3> velocity;
+    std::vector<float> age;
+
+    unsigned size() const;
+    bool empty() const;
+    void clear();
+
+    // Change the particle count; new particles are all zeroes
+    void resize(unsigned count);
+
+    // Append one zeroed particle, and return its index
+    unsigned add();
+
+    /*
+     * Stable compaction. Keeps each particle whose flag in 'keep' is nonzero,
+     * in the same order, and returns the new size. Effects with their own
+     * parallel arrays can compact those with compactArray() and the same flags.
+     */
+    unsigned compact(const std::vector<uint8_t> &keep);
+
+    template <typename T>
+    static void compactArray(std::vector<T> &array, const std::vector<uint8_t> &keep);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline unsigned ParticleVector::size() const
+{
+    return point.size();
+}
+
+inline bool ParticleVector::empty() const
+{
+    return point.empty();
+}
+
+inline void ParticleVector::clear()
+{
+    resize(0);
+}
+
+inline void ParticleVector::resize(unsigned count)
+{
+    const Vec3 zero(0, 0, 0);
+
+    point.resize(count, zero);
+    color.resize(count, zero);
+    radius.resize(count, 0.0f);
+    intensity.resize(count, 0.0f);
+    velocity.resize(count, zero);
+    age.resize(count, 0.0f);
+}
+
+inline unsigned ParticleVector::add()
+{
+    unsigned index = size();
+    resize(index + 1);
+    return index;
+}
+
+template <typename T>
+inline void ParticleVector::compactArray(std::vector<T> &array, const std::vector<uint8_t> &keep)
+{
+    unsigned j = 0;
+    for (unsigned i = 0; i < array.size(); i++) {
+        if (keep[i]) {
+            if (j != i) {
+                array[j] = array[i];
+            }
+            j++;
+        }
+    }
+    array.resize(j);
+}
+
+inline unsigned ParticleVector::compact(const std::vector<uint8_t> &keep)
+{
+    compactArray(point, keep);
+    compactArray(color, keep);
+    compactArray(radius, keep);
+    compactArray(intensity, keep);
+    compactArray(velocity, keep);
+    compactArray(age, keep);
+    return size();
+}
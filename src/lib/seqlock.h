@@ -0,0 +1,108 @@
+/*
+ * Sequence lock, for publishing a small value from one writer thread
+ * to any number of reader threads. Readers never block the writer and
+ * never take a lock; they simply retry if they raced with an update.
+ *
+ * The value must be trivially copyable. Writers must be serialized by
+ * the caller, but in exchange a reader (like a render thread) always
+ * sees a consistent copy of the whole value, never a mix of two updates.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+
+template <typename T>
+class SeqLock {
+public:
+    SeqLock();
+
+    // Publish a new value. Only one thread may call this at a time.
+    void store(const T &value);
+
+    // Read a consistent copy of the latest value. Safe from any thread.
+    T load() const;
+
+    // Number of store() calls so far
+    uint32_t version() const;
+
+private:
+    std::atomic<uint32_t> sequence;
+    T value;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+template <typename T>
+inline SeqLock<T>::SeqLock()
+    : sequence(0)
+{
+    memset(&value, 0, sizeof value);
+}
+
+template <typename T>
+inline void SeqLock<T>::store(const T &v)
+{
+    // Odd sequence numbers mark an update in progress
+
+    uint32_t s = sequence.load(std::memory_order_relaxed);
+    sequence.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(&value, &v, sizeof value);
+
+    sequence.store(s + 2, std::memory_order_release);
+}
+
+template <typename T>
+inline T SeqLock<T>::load() const
+{
+    T result;
+
+    while (true) {
+        uint32_t s1 = sequence.load(std::memory_order_acquire);
+        memcpy(&result, &value, sizeof result);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint32_t s2 = sequence.load(std::memory_order_relaxed);
+
+        if (s1 == s2 && !(s1 & 1)) {
+            return result;
+        }
+    }
+}
+
+template <typename T>
+inline uint32_t SeqLock<T>::version() const
+{
+    return sequence.load(std::memory_order_acquire) >> 1;
+}
@@ -0,0 +1,234 @@
+/*
+ * Uniform grid spatial index, for fixed-radius neighbor queries.
+ *
+ * Points are bucketed into cubic cells with a counting sort, so a build is
+ * two linear passes with no per-point allocation. Each cell's points end up
+ * contiguous, and so do whole rows of cells along X. A query visits the rows
+ * that overlap its bounding cube, touching only a few short runs of memory.
+ *
+ * The grid stores point indices, not points. Callers test distances against
+ * their own point data; this lets the index stay valid as points drift
+ * slightly between rebuilds.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "svl/SVL.h"
+
+
+class SpatialGrid
+{
+public:
+    SpatialGrid();
+
+    /*
+     * Rebuild from 'count' points, where point(i) returns a Vec3. The cell size
+     * should be the usual query radius. It grows if needed to keep the number
+     * of cells proportional to the number of points.
+     */
+    template <typename Accessor>
+    void build(unsigned count, float cellSize, Accessor point);
+
+    void clear();
+    bool empty() const;
+
+    /*
+     * Call visit(index) for every point in a cell that overlaps the cube
+     * around 'point' with half-width 'radius'. This is a superset of the
+     * points within 'radius'; the visitor checks actual distances.
+     */
+    template <typename Visitor>
+    void visitCandidates(Vec3 point, float radius, Visitor &visit) const;
+
+    size_t usedMemory() const;
+
+private:
+    static const unsigned kMaxCellsPerPoint = 4;
+    static const unsigned kMinCells = 64;
+
+    Vec3 origin;
+    float invCellSize;
+    int dims[3];
+
+    std::vector<unsigned> cellStart;    // First sorted point in each cell, plus an end marker
+    std::vector<unsigned> sorted;       // Point indices, ordered by cell
+    std::vector<unsigned> pointCell;    // Scratch: cell for each point, during build
+
+    int cellCoord(float v, int axis) const;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline SpatialGrid::SpatialGrid()
+    : origin(0, 0, 0), invCellSize(0)
+{
+    dims[0] = dims[1] = dims[2] = 0;
+}
+
+inline void SpatialGrid::clear()
+{
+    dims[0] = dims[1] = dims[2] = 0;
+    cellStart.clear();
+    sorted.clear();
+}
+
+inline bool SpatialGrid::empty() const
+{
+    return sorted.empty();
+}
+
+inline int SpatialGrid::cellCoord(float v, int axis) const
+{
+    // Clamped; this also catches NaN, which fails both comparisons
+    float c = (v - origin[axis]) * invCellSize;
+    return c >= 0 ? (c < dims[axis] ? int(c) : dims[axis] - 1) : 0;
+}
+
+template <typename Accessor>
+inline void SpatialGrid::build(unsigned count, float cellSize, Accessor point)
+{
+    if (!count) {
+        clear();
+        return;
+    }
+
+    // Bounding box
+
+    Vec3 aabbMin = point(0);
+    Vec3 aabbMax = aabbMin;
+    for (unsigned i = 1; i < count; i++) {
+        Vec3 p = point(i);
+        for (int a = 0; a < 3; a++) {
+            aabbMin[a] = std::min(aabbMin[a], p[a]);
+            aabbMax[a] = std::max(aabbMax[a], p[a]);
+        }
+    }
+
+    // Cell size, grown if the grid would be too large for the number of points
+
+    Vec3 extent = aabbMax - aabbMin;
+    for (int a = 0; a < 3; a++) {
+        if (!(extent[a] < 1e30f)) {
+            // Infinite or NaN; collapse this axis rather than allocating without bound
+            extent[a] = 0;
+        }
+    }
+    float largest = std::max(extent[0], std::max(extent[1], extent[2]));
+    if (!(cellSize > 0)) {
+        cellSize = largest > 0 ? largest : 1.0f;
+    }
+
+    double maxCells = std::max(kMinCells, count * kMaxCellsPerPoint);
+    while (true) {
+        double cells = 1;
+        for (int a = 0; a < 3; a++) {
+            cells *= floor(extent[a] / cellSize) + 1;
+        }
+        if (cells <= maxCells) {
+            break;
+        }
+        cellSize *= std::max(1.1, cbrt(cells / maxCells));
+    }
+
+    origin = aabbMin;
+    invCellSize = 1.0f / cellSize;
+    for (int a = 0; a < 3; a++) {
+        dims[a] = int(extent[a] * invCellSize) + 1;
+    }
+    unsigned numCells = dims[0] * dims[1] * dims[2];
+
+    // Counting sort: count per cell, prefix sum, then scatter
+
+    pointCell.resize(count);
+    cellStart.assign(numCells + 1, 0);
+
+    for (unsigned i = 0; i < count; i++) {
+        Vec3 p = point(i);
+        unsigned c = cellCoord(p[0], 0) + dims[0] * (cellCoord(p[1], 1) + dims[1] * cellCoord(p[2], 2));
+        pointCell[i] = c;
+        cellStart[c + 1]++;
+    }
+
+    for (unsigned c = 0; c < numCells; c++) {
+        cellStart[c + 1] += cellStart[c];
+    }
+
+    sorted.resize(count);
+    for (unsigned i = 0; i < count; i++) {
+        sorted[cellStart[pointCell[i]]++] = i;
+    }
+
+    // The scatter advanced each start to the next cell's start; shift back
+    for (unsigned c = numCells; c > 0; c--) {
+        cellStart[c] = cellStart[c - 1];
+    }
+    cellStart[0] = 0;
+}
+
+template <typename Visitor>
+inline void SpatialGrid::visitCandidates(Vec3 point, float radius, Visitor &visit) const
+{
+    if (sorted.empty()) {
+        return;
+    }
+
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        float l = (point[a] - radius - origin[a]) * invCellSize;
+        float h = (point[a] + radius - origin[a]) * invCellSize;
+        if (!(h >= 0 && l < dims[a])) {
+            // Entirely outside the grid, or NaN
+            return;
+        }
+        lo[a] = l > 0 ? int(l) : 0;
+        hi[a] = h < dims[a] - 1 ? int(h) : dims[a] - 1;
+    }
+
+    // Cells along X are adjacent, so each row is one run of sorted points
+
+    for (int z = lo[2]; z <= hi[2]; z++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            unsigned row = dims[0] * (y + dims[1] * z);
+            unsigned begin = cellStart[row + lo[0]];
+            unsigned end = cellStart[row + hi[0] + 1];
+            for (unsigned s = begin; s < end; s++) {
+                visit(sorted[s]);
+            }
+        }
+    }
+}
+
+inline size_t SpatialGrid::usedMemory() const
+{
+    return (cellStart.capacity() + sorted.capacity() + pointCell.capacity()) * sizeof(unsigned);
+}
@@ -0,0 +1,213 @@
+/*
+ * Video bus: fan out camera video to any number of consumers.
+ *
+ * Each consumer registers with a priority and a threading policy. Inline
+ * consumers run right on the camera thread, highest priority first, and
+ * should be quick. Threaded consumers get their own thread, fed with whole
+ * fields through a short queue. When a threaded consumer falls behind it
+ * drops its own oldest fields, without ever holding up the camera thread or
+ * anyone else on the bus.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <vector>
+#include "camera.h"
+#include "bounded_queue.h"
+#include "tinythread.h"
+
+
+class VideoBus
+{
+public:
+    enum Policy {
+        kInline,        // Run on the camera thread, as each chunk arrives
+        kThreaded,      // Run on a separate thread, a whole field at a time
+    };
+
+    /*
+     * Register any object with a process(const Camera::VideoChunk&) method.
+     * Higher priorities see video first. Threaded consumers buffer up to
+     * 'queueLength' fields. Register everything before the camera starts.
+     */
+    template <typename T>
+    void add(T *consumer, const char *name, int priority,
+        Policy policy = kInline, unsigned queueLength = 2);
+
+    // Register a plain callback, with the same options as add()
+    void addCallback(Camera::videoCallback_t callback, void *context, const char *name,
+        int priority, Policy policy = kInline, unsigned queueLength = 2);
+
+    // Hand incoming video to every consumer
+    void process(const Camera::VideoChunk &chunk);
+
+    // Camera callback. Use with Camera::start(VideoBus::videoCallback, &bus)
+    static void videoCallback(const Camera::VideoChunk &video, void *context);
+
+private:
+    struct Field {
+        unsigned field;
+        std::vector<uint8_t> data;
+    };
+
+    struct Consumer {
+        Camera::videoCallback_t callback;
+        void *context;
+        const char *name;
+        int priority;
+        Policy policy;
+
+        // Threaded consumers only
+        Field assembly;                 // Field being filled in on the camera thread
+        BoundedQueue<Field> queue;
+        tthread::thread *thread;
+    };
+
+    std::vector<Consumer*> consumers;
+
+    template <typename T>
+    static void processThunk(const Camera::VideoChunk &video, void *context);
+
+    static void threadFunc(void *context);
+    static void collect(Consumer &c, const Camera::VideoChunk &chunk);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+template <typename T>
+inline void VideoBus::processThunk(const Camera::VideoChunk &video, void *context)
+{
+    static_cast<T*>(context)->process(video);
+}
+
+template <typename T>
+inline void VideoBus::add(T *consumer, const char *name, int priority,
+    Policy policy, unsigned queueLength)
+{
+    addCallback(processThunk<T>, consumer, name, priority, policy, queueLength);
+}
+
+inline void VideoBus::addCallback(Camera::videoCallback_t callback, void *context, const char *name,
+    int priority, Policy policy, unsigned queueLength)
+{
+    Consumer *c = new Consumer;
+    c->callback = callback;
+    c->context = context;
+    c->name = name;
+    c->priority = priority;
+    c->policy = policy;
+    c->thread = 0;
+
+    // Keep the list sorted by descending priority, in order of registration within a priority
+    std::vector<Consumer*>::iterator i = consumers.begin();
+    while (i != consumers.end() && (*i)->priority >= priority) {
+        ++i;
+    }
+    consumers.insert(i, c);
+
+    if (policy == kThreaded) {
+        c->queue.setCapacity(queueLength);
+        c->thread = new tthread::thread(threadFunc, c);
+    }
+}
+
+inline void VideoBus::videoCallback(const Camera::VideoChunk &video, void *context)
+{
+    static_cast<VideoBus*>(context)->process(video);
+}
+
+inline void VideoBus::process(const Camera::VideoChunk &chunk)
+{
+    for (unsigned i = 0, n = consumers.size(); i < n; i++) {
+        Consumer &c = *consumers[i];
+        if (c.policy == kInline) {
+            c.callback(chunk, c.context);
+        } else {
+            collect(c, chunk);
+        }
+    }
+}
+
+inline void VideoBus::collect(Consumer &c, const Camera::VideoChunk &chunk)
+{
+    // Copy into this consumer's field buffer, and queue it once the field is complete
+
+    Field &f = c.assembly;
+    if (f.data.size() != Camera::kBytesPerLine * Camera::kLinesPerField) {
+        f.data.resize(Camera::kBytesPerLine * Camera::kLinesPerField);
+    }
+
+    f.field = chunk.field;
+    memcpy(&f.data[chunk.line * Camera::kBytesPerLine + chunk.byteOffset], chunk.data, chunk.byteCount);
+
+    if (chunk.line == Camera::kLinesPerField - 1 &&
+        chunk.byteOffset + chunk.byteCount == Camera::kBytesPerLine) {
+        c.queue.pushSwap(f);
+    }
+}
+
+inline void VideoBus::threadFunc(void *context)
+{
+    Consumer &c = *static_cast<Consumer*>(context);
+    Field f;
+
+    unsigned dropped = 0;
+    struct timeval timeA, timeB;
+    gettimeofday(&timeA, 0);
+
+    while (true) {
+        c.queue.pop(f);
+
+        // Replay the field one line at a time
+        for (unsigned line = 0; line < Camera::kLinesPerField; line++) {
+            Camera::VideoChunk chunk;
+            chunk.data = &f.data[line * Camera::kBytesPerLine];
+            chunk.byteCount = Camera::kBytesPerLine;
+            chunk.byteOffset = 0;
+            chunk.line = line;
+            chunk.field = f.field;
+            c.callback(chunk, c.context);
+        }
+
+        // Periodic drop stats
+        dropped += c.queue.takeDropped();
+        gettimeofday(&timeB, 0);
+        if (timeB.tv_sec - timeA.tv_sec >= 2) {
+            if (dropped) {
+                fprintf(stderr, "videobus: %s dropped %d fields\n", c.name, dropped);
+                dropped = 0;
+            }
+            timeA = timeB;
+        }
+    }
+}
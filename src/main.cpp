@@ -12,14 +12,11 @@
  */
 
 #include "lib/camera.h"
+#include "lib/video_bus.h"
 #include "narrator.h"
 
 static Narrator narrator;
-
-static void videoCallback(const Camera::VideoChunk &video, void *)
-{
-    narrator.flow.process(video);
-}
+static VideoBus videoBus;
 
 int main(int argc, char **argv)
 {
@@ -29,7 +26,14 @@ int main(int argc, char **argv)
     }
 
     narrator.setup();
-    Camera::start(videoCallback);
+
+    // The flow analyzer only queues work on the camera thread; nothing runs ahead of it
+    videoBus.add(&narrator.flow, "flow", 100);
+
+    // Latency calibration sums a sparse sample of each chunk; cheap enough to run inline too
+    videoBus.add(&narrator.calibrator, "latency", 90);
+
+    narrator.startCamera(VideoBus::videoCallback, &videoBus);
     narrator.run();
 
     return 0;
@@ -12,7 +12,10 @@
 Narrator::Narrator()
     : brightness(mixer)
 {
-    runner.setEffect(&brightness);
+    // The calibrator's probe goes outside the tap, so the tap records it too
+    runner.setEffect(&calibrator);
+    calibrator.setEffect(&tap);
+    tap.setEffect(&brightness);
 }
 
 void Narrator::setup()
@@ -21,6 +24,12 @@ void Narrator::setup()
     brightness.set(0.0f, runner.config["brightnessLimit"].GetDouble());
     mixer.setConcurrency(runner.config["concurrency"].GetUint());
     runner.setMaxFrameRate(runner.config["fps"].GetDouble());
+
+    const rapidjson::Value& latency = runner.config["latencyCalibrator"];
+    calibrator.amplitude = latency["amplitude"].GetDouble();
+    calibrator.flipProbability = latency["flipProbability"].GetDouble();
+    tap.resizeBuffer(latency["tapFrames"].GetUint());
+
     currentState = runner.initialState;
 
     logFile = fopen(runner.config["narrator"]["logFile"].GetString(), "a");
@@ -29,6 +38,31 @@ void Narrator::setup()
     }
 }    
 
+void Narrator::startCamera(Camera::videoCallback_t callback, void *context)
+{
+    const rapidjson::Value& config = runner.config["syntheticCamera"];
+
+    if (!runner.syntheticCamera && !config["enabled"].GetBool()) {
+        Camera::start(callback, context);
+        return;
+    }
+
+    Camera::SyntheticOptions options;
+    options.fieldRate = config["fieldRate"].GetDouble();
+    options.blobs = config["blobs"].GetUint();
+    options.blobRadius = config["blobRadius"].GetDouble();
+    options.blobSpeed = config["blobSpeed"].GetDouble();
+    options.noise = config["noise"].GetDouble();
+    options.flicker = config["flicker"].GetDouble();
+    options.flickerRate = config["flickerRate"].GetDouble();
+    options.chunkBytes = config["chunkBytes"].GetUint();
+    options.seed = config["seed"].GetUint();
+    options.groundTruthLog = config["groundTruthLog"].GetString();
+
+    fprintf(stderr, "Using synthetic camera, %.2f fields per second\n", options.fieldRate);
+    Camera::startSynthetic(callback, context, options);
+}
+
 void Narrator::run()
 {
     PRNG prng;
@@ -166,7 +200,7 @@ double Narrator::secondsAfterDate(const rapidjson::Value& target)
 }
 
 Narrator::NEffectRunner::NEffectRunner()
-    : initialState(0)
+    : initialState(0), syntheticCamera(false)
 {
     if (!setConfig("data/config.json")) {
         fprintf(stderr, "Can't load default configuration file\n");
@@ -180,6 +214,11 @@ bool Narrator::NEffectRunner::parseArgument(int &i, int &argc, char **argv)
         return true;
     }
 
+    if (!strcmp(argv[i], "-synthetic")) {
+        syntheticCamera = true;
+        return true;
+    }
+
     if (!strcmp(argv[i], "-config") && (i+1 < argc)) {
         if (!setConfig(argv[++i])) {
             fprintf(stderr, "Can't load config from %s\n", argv[i]);
@@ -194,7 +233,7 @@ bool Narrator::NEffectRunner::parseArgument(int &i, int &argc, char **argv)
 void Narrator::NEffectRunner::argumentUsage()
 {
     EffectRunner::argumentUsage();
-    fprintf(stderr, " [-state ST] [-config FILE.json]");
+    fprintf(stderr, " [-state ST] [-config FILE.json] [-synthetic]");
 }
 
 bool Narrator::NEffectRunner::validateArguments()
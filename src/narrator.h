@@ -13,8 +13,10 @@
 #include "lib/effect_mixer.h"
 #include "lib/effect_runner.h"
 #include "lib/effect_tap.h"
+#include "lib/latency_calibrator.h"
 #include "lib/prng.h"
 #include "lib/sampler.h"
+#include "lib/camera.h"
 #include "lib/camera_flow.h"
 #include "lib/brightness.h"
 
@@ -30,6 +32,7 @@ public:
         bool setConfig(const char *filename);
 
         int initialState;
+        bool syntheticCamera;
         rapidjson::Document config;
 
     protected:
@@ -43,11 +46,19 @@ public:
     void setup();
     void run();
 
+    // Start the camera, or the synthetic camera if the config or command line asks for it
+    void startCamera(Camera::videoCallback_t callback, void *context);
+
     CameraFlowAnalyzer flow;
     NEffectRunner runner;
     EffectMixer mixer;
     Brightness brightness;
 
+    // Recent LED output, and the live latency estimate for looking it up. Add the
+    // calibrator to the camera's VideoBus; find delayed frames with calibrator.delayedFrame(tap).
+    EffectTap tap;
+    LatencyCalibrator calibrator;
+
 private:
     int script(int st, PRNG &prng);
     EffectRunner::FrameStatus doFrame();
@@ -11,6 +11,7 @@
 
 #include <vector>
 #include "lib/particle.h"
+#include "lib/neighbor_list.h"
 #include "lib/prng.h"
 #include "lib/noise.h"
 #include "lib/texture.h"
@@ -45,6 +46,7 @@ private:
     float stepSize;
     float seedRadius;
     float interactionSize;
+    float interactionSkin;
     float colorRate;
     float angleGainRate;
     float angleGainCenter;
@@ -61,6 +63,37 @@ private:
     float angleGain;
     Vec3 centerPosition;
 
+    // Positions after the step in progress
+    std::vector<Vec3> nextPoint;
+
+    // Interaction partners, kept across steps
+    NeighborList neighbors;
+
+    // Particles per parallelFor() chunk during runStep()
+    static const unsigned kStepChunkSize = 8;
+
+    /*
+     * Interactions between one particle and its neighbors, in gather form. Each
+     * particle only writes its own next position, so these can run in parallel.
+     */
+    struct InteractionGather {
+        const ParticleVector &particles;
+        Vec3 point;
+        float radius2;
+        float angleGain;
+        float angleIncrement;
+        Vec3 delta;
+
+        void operator() (unsigned i);
+    };
+
+    struct InteractionStep {
+        OrderParticles &effect;
+        float searchRadius;
+
+        void operator() (unsigned begin, unsigned end);
+    };
+
     void runStep(const FrameInfo &f);
 };
 
@@ -83,6 +116,7 @@ inline OrderParticles::OrderParticles(CameraFlowAnalyzer& flow, const rapidjson:
       stepSize(config["stepSize"].GetDouble()),
       seedRadius(config["seedRadius"].GetDouble()),
       interactionSize(config["interactionSize"].GetDouble()),
+      interactionSkin(config["interactionSkin"].GetDouble()),
       colorRate(config["colorRate"].GetDouble()),
       angleGainRate(config["angleGainRate"].GetDouble()),
       angleGainCenter(config["angleGainCenter"].GetDouble()),
@@ -101,7 +135,7 @@ inline void OrderParticles::reseed(unsigned seed)
     symmetry = 1000;
     lightAngle = 0;
 
-    appearance.resize(numParticles);
+    particles.resize(numParticles);
 
     PRNG prng;
     prng.seed(seed);
@@ -109,9 +143,9 @@ inline void OrderParticles::reseed(unsigned seed)
 
     colorCycle = prng.uniform(0, 1000);
 
-    for (unsigned i = 0; i < appearance.size(); i++) {
+    for (unsigned i = 0; i < particles.size(); i++) {
         Vec2 p = prng.ringVector(1e-4, seedRadius);
-        appearance[i].point = Vec3(p[0], 0, p[1]);
+        particles.point[i] = Vec3(p[0], 0, p[1]);
     }
 
     buildIndex();
@@ -127,12 +161,19 @@ inline void OrderParticles::beginFrame(const FrameInfo &f)
     timeDeltaRemainder = t - steps * stepSize;
 
     // Particle appearance
-    for (unsigned i = 0; i < appearance.size(); i++) {
-        appearance[i].intensity = intensity;
-        appearance[i].radius = f.modelRadius * relativeSize;
+    unsigned n = particles.size();
+    float radius = f.modelRadius * relativeSize;
+    for (unsigned i = 0; i < n; i++) {
+        particles.intensity[i] = intensity;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        particles.radius[i] = radius;
+    }
 
-        // Viewpoint adjustment
-        appearance[i].point += flow.model * flowScale;
+    // Viewpoint adjustment
+    Vec3 viewpoint = flow.model * flowScale;
+    for (unsigned i = 0; i < n; i++) {
+        particles.point[i] += viewpoint;
     }
 
     while (steps > 0) {
@@ -149,58 +190,67 @@ inline void OrderParticles::beginFrame(const FrameInfo &f)
     angleGain = angleGainCenter + angleGainVariation *
         fbm_noise2(colorCycle * angleGainRate, seed * 5e-7, 2);
 
-    ParticleEffect::beginFrame(f);
+    // Our shader samples intensity from the index, so we don't need a color splat
+    buildIndex();
 }
 
 inline void OrderParticles::runStep(const FrameInfo &f)
 {
-    // Calculate a new center position while we're here
+    unsigned n = particles.size();
+
+    // Slide toward center of model uniformly
+    Vec3 centering = centerPosition * centeringGain;
+    for (unsigned i = 0; i < n; i++) {
+        particles.point[i] -= centering;
+    }
+
+    // Particle interactions, each gathered from the same snapshot of positions
+    float searchRadius = interactionSize * f.modelRadius;
+    neighbors.update(particles.point, searchRadius, interactionSkin * f.modelRadius);
+    nextPoint.resize(n);
+    InteractionStep step = { *this, searchRadius };
+    f.parallelFor(n, kStepChunkSize, step);
+
+    // Calculate a new center position while we're here; in order, so it's repeatable
     Vec3 centerAccumulator(0, 0, 0);
+    for (unsigned i = 0; i < n; i++) {
+        particles.point[i] = nextPoint[i];
+        centerAccumulator += nextPoint[i];
+    }
+
+    centerPosition = n ? centerAccumulator / n : Vec3(0,0,0);
+}
+
+inline void OrderParticles::InteractionStep::operator() (unsigned begin, unsigned end)
+{
+    for (unsigned i = begin; i < end; i++) {
+        InteractionGather gather = {
+            effect.particles, effect.particles.point[i], sq(searchRadius),
+            effect.angleGain, float(2 * M_PI / effect.symmetry), Vec3(0, 0, 0) };
 
-    // Particle interactions
-    for (unsigned i = 0; i < appearance.size(); i++) {
-        ParticleAppearance pa = appearance[i];
-
-        // Slide toward center of model uniformly
-        pa.point -= centerPosition * centeringGain;
-
-        ResultSet_t hits;
-        float searchRadius = interactionSize * f.modelRadius;
-        index.radiusSearch(hits, pa.point, searchRadius);
-
-        for (unsigned i = 0; i < hits.size(); i++) {
-            if (hits[i].first <= i) {
-                // Only count each interaction once
-                continue;
-            }
-
-            // Check distance
-            ParticleAppearance &hit = appearance[hits[i].first];
-            float q2 = hits[i].second / sq(searchRadius);
-            if (q2 < 1.0f) {
-                // These particles influence each other
-                Vec3 d = hit.point - pa.point;
-
-                // Angular 'snap' force, operates at a distance
-                float angle = atan2(d[2], d[0]);
-                const float angleIncrement = 2 * M_PI / symmetry;
-                float snapAngle = roundf(angle / angleIncrement) * angleIncrement;
-                float angleDelta = fabsf(snapAngle - angle);
-
-                // Spin perpendicular to 'd'
-                Vec3 da = angleGain * angleDelta * Vec3( d[2], 0, -d[0] );
-
-                da *= kernel2(q2);
-                pa.point += da;
-                hit.point -= da;
-            }
-        }
-
-        centerAccumulator += pa.point;
-        appearance[i] = pa;
+        effect.neighbors.visitNeighbors(i, gather);
+        effect.nextPoint[i] = gather.point + gather.delta;
     }
+}
+
+inline void OrderParticles::InteractionGather::operator() (unsigned i)
+{
+    // Check distance
+    Vec3 d = particles.point[i] - point;
+    float q2 = sqrlen(d) / radius2;
+    if (q2 < 1.0f) {
+        // These particles influence each other
 
-    centerPosition = appearance.size() ? centerAccumulator / appearance.size() : Vec3(0,0,0);
+        // Angular 'snap' force, operates at a distance
+        float angle = atan2(d[2], d[0]);
+        float snapAngle = roundf(angle / angleIncrement) * angleIncrement;
+        float angleDelta = fabsf(snapAngle - angle);
+
+        // Spin perpendicular to 'd'. The neighbor gathers the opposite push.
+        Vec3 da = angleGain * angleDelta * Vec3( d[2], 0, -d[0] );
+
+        delta += da * kernel2(q2);
+    }
 }
 
 inline void OrderParticles::debug(const DebugInfo &di)
@@ -209,6 +259,7 @@ inline void OrderParticles::debug(const DebugInfo &di)
     fprintf(stderr, "\t[order-particles] colorCycle = %f\n", colorCycle);
     fprintf(stderr, "\t[order-particles] lightAngle = %f\n", lightAngle);
     fprintf(stderr, "\t[order-particles] center = (%f, %f, %f)\n", centerPosition[0], centerPosition[1], centerPosition[2]);
+    fprintf(stderr, "\t[order-particles] neighbor list builds = %d / %d steps\n", neighbors.numBuilds, neighbors.numUpdates);
     ParticleEffect::debug(di);
 }
 
@@ -216,8 +267,8 @@ inline void OrderParticles::shader(Vec3& rgb, const PixelInfo& p) const
 {
     // Metaball-style shading with lambertian diffuse lighting and an image-based color palette
 
-    float intensity = sampleIntensity(p.point);
-    Vec3 gradient = sampleIntensityGradient(p.point);
+    Vec3 gradient;
+    float intensity = sampleIntensityAndGradient(p.point, gradient);
     float gradientMagnitude = len(gradient);
     Vec3 normal = gradientMagnitude ? (gradient / gradientMagnitude) : Vec3(0, 0, 0);
     float lambert = 0.6f * std::max(0.0f, dot(normal, lightVec));
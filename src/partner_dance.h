@@ -11,6 +11,7 @@
 #include <vector>
 #include "lib/effect.h"
 #include "lib/particle.h"
+#include "lib/neighbor_list.h"
 #include "lib/texture.h"
 #include "lib/noise.h"
 
@@ -41,6 +42,7 @@ private:
     float minIntensity;
     float targetRadius;
     float interactionRadius;
+    float interactionSkin;
     float jitterRate;
     float jitterStrength;
     float jitterScale;
@@ -54,20 +56,27 @@ private:
     float positionFuzz;
     float separationRadius;
 
-    struct ParticleDynamics {
-        Vec2 position;
-        Vec2 velocity;
-    };
-
     CameraFlowCapture flow;
 
-    std::vector<ParticleDynamics> dynamics;
+    // Simulated positions on the XZ plane, before the flow offset. Velocities are in 'particles'.
+    std::vector<Vec3> positions;
+    NeighborList neighbors;
     float timeDeltaRemainder;
     float noiseCycle;
     Vec2 target;
     float damping;
 
-    void resetParticle(ParticleDynamics &pd, PRNG &prng, unsigned dancer) const;
+    // Interaction forces on one particle from the other dancer
+    struct InteractionVisitor {
+        const PartnerDance &effect;
+        unsigned p;
+        unsigned dancer;
+        Vec3 v;
+
+        void operator() (unsigned hit);
+    };
+
+    void resetParticle(unsigned i, PRNG &prng, unsigned dancer);
     void runStep(const FrameInfo &f);
 };
 
@@ -90,6 +99,7 @@ inline PartnerDance::PartnerDance(CameraFlowAnalyzer& flow, const rapidjson::Val
       minIntensity(config["minIntensity"].GetDouble()),
       targetRadius(config["targetRadius"].GetDouble()),
       interactionRadius(config["interactionRadius"].GetDouble()),
+      interactionSkin(config["interactionSkin"].GetDouble()),
       jitterRate(config["jitterRate"].GetDouble()),
       jitterStrength(config["jitterStrength"].GetDouble()),
       jitterScale(config["jitterScale"].GetDouble()),
@@ -119,18 +129,15 @@ inline void PartnerDance::reseed(uint32_t seed)
     noiseCycle = prng.uniform(0, 1000);
     damping = initialDamping;
 
-    appearance.resize(numParticles);
-    dynamics.resize(numParticles);
-
-    ParticleAppearance *pa = &appearance[0];
-    ParticleDynamics *pd = &dynamics[0]; 
+    particles.resize(numParticles);
+    positions.resize(numParticles);
 
-    for (unsigned dancer = 0; dancer < numDancers; dancer++) {
-        for (unsigned i = 0; i < particlesPerDancer; i++, pa++, pd++) {
+    for (unsigned dancer = 0, p = 0; dancer < numDancers; dancer++) {
+        for (unsigned i = 0; i < particlesPerDancer; i++, p++) {
 
-            resetParticle(*pd, prng, dancer);
+            resetParticle(p, prng, dancer);
 
-            pa->color = dancer ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
+            particles.color[p] = dancer ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
         }
     }
 }
@@ -154,102 +161,115 @@ inline void PartnerDance::beginFrame(const FrameInfo &f)
 
     // Update all particle radii
     float r = radius + radiusScale * sinf(angle3);
-    for (unsigned i = 0; i < appearance.size(); i++) {
-        appearance[i].radius = r;
+    for (unsigned i = 0; i < particles.size(); i++) {
+        particles.radius[i] = r;
     }
 
-    // Build first index
-    ParticleEffect::beginFrame(f);
-
     while (steps > 0) {
         runStep(f);
         steps--;
-
-        // Rebuild index
-        ParticleEffect::beginFrame(f);
     }
+
+    // Index and rendering setup
+    ParticleEffect::beginFrame(f);
 }
 
 inline void PartnerDance::debug(const DebugInfo& d)
 {
     fprintf(stderr, "\t[partner-dance] numParticles = %d\n", numParticles);
-    fprintf(stderr, "\t[partner-dance] radius = %f\n", appearance[0].radius);
+    fprintf(stderr, "\t[partner-dance] radius = %f\n", particles.radius[0]);
     fprintf(stderr, "\t[partner-dance] noiseCycle = %f\n", noiseCycle);
     fprintf(stderr, "\t[partner-dance] damping = %f\n", damping);
+    fprintf(stderr, "\t[partner-dance] neighbor list builds = %d / %d steps\n", neighbors.numBuilds, neighbors.numUpdates);
     fprintf(stderr, "\t[partner-dance] flow.model = [%f, %f]\n", flow.model[0], flow.model[2]);
     ParticleEffect::debug(d);
 }
 
 inline void PartnerDance::runStep(const FrameInfo &f)
 {
-    ParticleAppearance *pa = &appearance[0];
-    ParticleDynamics *pd = &dynamics[0]; 
-
     PRNG prng;
     prng.seed(42);
 
     flow.capture();
 
-    for (unsigned dancer = 0; dancer < numDancers; dancer++) {
-        for (unsigned i = 0; i < particlesPerDancer; i++, pa++, pd++) {
-
-            prng.remix(pd->position[0] * 1e8);
-            prng.remix(pd->position[1] * 1e8);
-
-            Vec2 fPos = pd->position + Vec2(flow.model[0], flow.model[2]) * flowScale;
-            Vec2 disparity = target - fPos;
-            Vec2 normal = Vec2(disparity[1], -disparity[0]);
-            Vec2 v = pd->velocity;
-
-            // Single-particle velocity updates
-            v *= 1.0 - damping;
-            v += disparity * targetGain;
-            v += normal * targetSpin;
-
-            // Particle interactions
-            ResultSet_t hits;
-            index.radiusSearch(hits, pa->point, interactionRadius);
-
-            for (unsigned i = 0; i < hits.size(); i++) {
-                unsigned hitDancer = hits[i].first / particlesPerDancer;
-                if (hitDancer == dancer) {
-                    // Only interact with other dancers
-                    continue;
-                }
-
-                // Check distance
-                float q2 = hits[i].second / sq(interactionRadius);
-                if (q2 >= 1.0f) {
-                    continue;
-                }
-                float k = dancer ? kernel2(q2) : -kernel(q2);
-
-                // Spin force, normal to the angle between us
-                ParticleDynamics &other = dynamics[hits[i].first];
-                Vec2 d = other.position - pd->position;
-                Vec2 normal = Vec2(d[1], -d[0]);
-                normal /= len(normal);
-
-                v += interactionRate * k * normal;
-            }
+    unsigned n = particles.size();
+    Vec3 flowOffset = Vec3(flow.model[0], 0, flow.model[2]) * flowScale;
+    Vec3 targetXZ = XZ(target);
+    float velocityKeep = 1.0 - damping;
+
+    // Single-particle velocity updates, in one flat loop
+
+    for (unsigned i = 0; i < n; i++) {
+        Vec3 disparity = targetXZ - (positions[i] + flowOffset);
+        Vec3 normal = Vec3(disparity[2], 0, -disparity[0]);
+        particles.velocity[i] = particles.velocity[i] * velocityKeep
+            + disparity * targetGain + normal * targetSpin;
+    }
+
+    /*
+     * Particle interactions, in order; each particle sees the latest positions of the others.
+     * The flow offset is the same for everyone, so neighbors are found in simulation space.
+     * Since particles move before the others are done looking for them, each move is
+     * reported to the neighbor list. Resets move particles far, but the list copes with
+     * a few of those between rebuilds.
+     */
+
+    neighbors.update(positions, interactionRadius, interactionSkin);
+
+    for (unsigned dancer = 0, p = 0; dancer < numDancers; dancer++) {
+        for (unsigned j = 0; j < particlesPerDancer; j++, p++) {
 
-            pd->velocity = v;
-            pd->position += v;
+            prng.remix(positions[p][0] * 1e8);
+            prng.remix(positions[p][2] * 1e8);
 
-            pa->point = Vec3(fPos[0], 0, fPos[1]);
-            pa->intensity = std::min(float(maxIntensity), intensityScale * len(v));
+            Vec3 fPos = positions[p] + flowOffset;
 
-            if (pa->intensity < minIntensity) {
-                resetParticle(*pd, prng, dancer);
+            InteractionVisitor interaction = { *this, p, dancer, particles.velocity[p] };
+            neighbors.visitNeighbors(p, interaction);
+            Vec3 v = interaction.v;
+
+            particles.velocity[p] = v;
+            positions[p] += v;
+            neighbors.moved(p, positions[p]);
+
+            particles.point[p] = fPos;
+            particles.intensity[p] = std::min(float(maxIntensity), intensityScale * len(v));
+
+            if (particles.intensity[p] < minIntensity) {
+                resetParticle(p, prng, dancer);
             }
         }
     }
 }
 
-inline void PartnerDance::resetParticle(ParticleDynamics &pd, PRNG &prng, unsigned dancer) const
+inline void PartnerDance::InteractionVisitor::operator() (unsigned hit)
+{
+    unsigned hitDancer = hit / effect.particlesPerDancer;
+    if (hitDancer == dancer) {
+        // Only interact with other dancers
+        return;
+    }
+
+    // Check distance
+    Vec3 d = effect.positions[hit] - effect.positions[p];
+    float q2 = sqrlen(d) / sq(effect.interactionRadius);
+    if (q2 >= 1.0f) {
+        return;
+    }
+    float k = dancer ? kernel2(q2) : -kernel(q2);
+
+    // Spin force, normal to the angle between us
+    Vec3 normal = Vec3(d[2], 0, -d[0]);
+    normal /= len(normal);
+
+    v += effect.interactionRate * k * normal;
+}
+
+inline void PartnerDance::resetParticle(unsigned i, PRNG &prng, unsigned dancer)
 {
-    pd.velocity = Vec2(0, 0);
-    pd.position = prng.circularVector() * positionFuzz + (dancer ? Vec2(separationRadius, 0) : Vec2(-separationRadius, 0));
+    particles.velocity[i] = Vec3(0, 0, 0);
+    positions[i] = XZ(prng.circularVector() * positionFuzz + (dancer ? Vec2(separationRadius, 0) : Vec2(-separationRadius, 0)));
+    neighbors.markEscaped(i);
 }
 
 inline void PartnerDance::shader(Vec3& rgb, const PixelInfo& p) const
@@ -260,7 +280,7 @@ inline void PartnerDance::shader(Vec3& rgb, const PixelInfo& p) const
         0);
 
     // Use 'color' to encode contributions from both partners
-    Vec3 c = sampleColor(p.point) + jitter;
+    Vec3 c = sampleColor(p) + jitter;
 
     // 2-dimensional palette lookup
     rgb = brightness * palette.sample(c[0], c[1]);
@@ -105,13 +105,12 @@ inline void Ants::reseed(unsigned seed)
 inline void Ants::shader(Vec3& rgb, const PixelInfo& p) const
 {
     Pixelator::shader(rgb, p);
-    rgb += darkness.sampleColor(p.point);
+    rgb += darkness.sampleColor(p);
 }
 
 inline void Ants::beginFrame(const FrameInfo& f)
 {
     Pixelator::beginFrame(f);
-    darkness.beginFrame(f);
 
     if (state.size() != width() * height()) {
         // Resize and erase parallel arrays, now that we know size
@@ -151,6 +150,9 @@ inline void Ants::beginFrame(const FrameInfo& f)
             filterColor(x, y);
         }
     }
+
+    // Darkness draws its particles as of now, after they've been pushed
+    darkness.beginFrame(f);
 }
 
 inline void Ants::filterColor(int x, int y)
@@ -0,0 +1,232 @@
+/*
+ * Storage formats for rows of the VisualMemory covariance matrix.
+ * Each row is one camera sample's covariance with every mapped LED.
+ *
+ * FloatRow keeps plain floats. QuantizedRow keeps blocks of 8-bit values
+ * that share one float scale, for a bit over a quarter of the memory.
+ * Rounding is stochastic, so the small per-cycle reinforcements still
+ * add up on average instead of rounding away.
+ *
+ * Neither one is low-rank: a row is still one cell per LED, so memory is
+ * a constant factor smaller but still proportional to samples x LEDs.
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+
+class FloatRow
+{
+public:
+    // Bytes needed for a row of 'n' cells
+    static size_t bytes(unsigned n);
+
+    /*
+     * Rank-1 update: cell = cell * keep + c * led. The random state is
+     * unused here, but keeps the same signature as QuantizedRow.
+     */
+    static void update(void *row, unsigned n, const float *led,
+        float c, float keep, uint32_t &rng);
+
+    // Weighted sum for recall: acc += w * cell
+    static void accumulate(const void *row, unsigned n, float w, float *acc);
+
+    static void read(const void *row, unsigned n, float *out);
+    static void write(void *row, unsigned n, const float *in, uint32_t &rng);
+};
+
+
+class QuantizedRow
+{
+public:
+    static const unsigned kBlockSize = 32;
+
+    struct Block {
+        float scale;
+        int8_t q[kBlockSize];
+    };
+
+    static size_t bytes(unsigned n);
+    static void update(void *row, unsigned n, const float *led,
+        float c, float keep, uint32_t &rng);
+    static void accumulate(const void *row, unsigned n, float w, float *acc);
+    static void read(const void *row, unsigned n, float *out);
+    static void write(void *row, unsigned n, const float *in, uint32_t &rng);
+
+private:
+    static void updateBlock(Block &b, const float *led, float c, float keep, uint32_t &rng);
+    static void encode(Block &b, const float *x, float peak, uint32_t &rng);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline size_t FloatRow::bytes(unsigned n)
+{
+    return n * sizeof(float);
+}
+
+inline void FloatRow::update(void *row, unsigned n, const float *led,
+    float c, float keep, uint32_t &rng)
+{
+    // Flat multiply-adds, for the compiler to vectorize
+
+    float * __restrict cell = (float*) row;
+    const float * __restrict l = led;
+
+    for (unsigned i = 0; i < n; i++) {
+        cell[i] = cell[i] * keep + c * l[i];
+    }
+}
+
+inline void FloatRow::accumulate(const void *row, unsigned n, float w, float *acc)
+{
+    const float * __restrict cell = (const float*) row;
+    float * __restrict a = acc;
+
+    for (unsigned i = 0; i < n; i++) {
+        a[i] += w * cell[i];
+    }
+}
+
+inline void FloatRow::read(const void *row, unsigned n, float *out)
+{
+    memcpy(out, row, bytes(n));
+}
+
+inline void FloatRow::write(void *row, unsigned n, const float *in, uint32_t &rng)
+{
+    memcpy(row, in, bytes(n));
+}
+
+inline size_t QuantizedRow::bytes(unsigned n)
+{
+    return (n + kBlockSize - 1) / kBlockSize * sizeof(Block);
+}
+
+inline void QuantizedRow::encode(Block &b, const float *x, float peak, uint32_t &rng)
+{
+    /*
+     * Scale to fit the block's largest value, then round with dither. The random
+     * state only advances once per block; each value's dither is a hash of it,
+     * so this loop has no serial dependency and can be vectorized.
+     */
+
+    float inv = peak > 0 ? 127.0f / peak : 0.0f;
+    b.scale = peak * (1.0f / 127.0f);
+
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    const uint32_t seed = rng;
+
+    for (unsigned i = 0; i < kBlockSize; i++) {
+        uint32_t h = seed + i * 0x9E3779B9u;
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        float dither = (h >> 8) * (1.0f / 16777216.0f);
+
+        // Clamp, then truncate with an offset; same as floor() over this range
+        float v = std::min(127.0f, std::max(-127.0f, x[i] * inv + dither));
+        b.q[i] = int(v + 128.0f) - 128;
+    }
+}
+
+inline void QuantizedRow::updateBlock(Block &b, const float *led, float c, float keep, uint32_t &rng)
+{
+    // Fixed-size loops; the compiler unrolls and vectorizes all of these
+
+    float x[kBlockSize];
+    float s = b.scale * keep;
+    float peak = 0;
+
+    for (unsigned i = 0; i < kBlockSize; i++) {
+        x[i] = b.q[i] * s + c * led[i];
+    }
+    for (unsigned i = 0; i < kBlockSize; i++) {
+        peak = std::max(peak, fabsf(x[i]));
+    }
+
+    encode(b, x, peak, rng);
+}
+
+inline void QuantizedRow::update(void *row, unsigned n, const float *led,
+    float c, float keep, uint32_t &rng)
+{
+    Block *b = (Block*) row;
+    unsigned whole = n / kBlockSize;
+
+    for (unsigned i = 0; i < whole; i++) {
+        updateBlock(b[i], led + i * kBlockSize, c, keep, rng);
+    }
+
+    // Partial last block, padded with zeroes. Padding cells stay zero.
+    unsigned tail = n - whole * kBlockSize;
+    if (tail) {
+        float ledTail[kBlockSize] = { 0 };
+        memcpy(ledTail, led + whole * kBlockSize, tail * sizeof(float));
+        updateBlock(b[whole], ledTail, c, keep, rng);
+    }
+}
+
+inline void QuantizedRow::accumulate(const void *row, unsigned n, float w, float *acc)
+{
+    const Block *b = (const Block*) row;
+    unsigned whole = n / kBlockSize;
+
+    for (unsigned i = 0; i < whole; i++) {
+        float s = w * b[i].scale;
+        float *a = acc + i * kBlockSize;
+        for (unsigned j = 0; j < kBlockSize; j++) {
+            a[j] += b[i].q[j] * s;
+        }
+    }
+
+    unsigned tail = n - whole * kBlockSize;
+    if (tail) {
+        float s = w * b[whole].scale;
+        for (unsigned j = 0; j < tail; j++) {
+            acc[whole * kBlockSize + j] += b[whole].q[j] * s;
+        }
+    }
+}
+
+inline void QuantizedRow::read(const void *row, unsigned n, float *out)
+{
+    const Block *b = (const Block*) row;
+
+    for (unsigned base = 0; base < n; base += kBlockSize, b++) {
+        unsigned len = std::min(kBlockSize, n - base);
+        for (unsigned i = 0; i < len; i++) {
+            out[base + i] = b->q[i] * b->scale;
+        }
+    }
+}
+
+inline void QuantizedRow::write(void *row, unsigned n, const float *in, uint32_t &rng)
+{
+    Block *b = (Block*) row;
+
+    for (unsigned base = 0; base < n; base += kBlockSize, b++) {
+        unsigned len = std::min(kBlockSize, n - base);
+        float x[kBlockSize] = { 0 };
+        float peak = 0;
+        for (unsigned i = 0; i < len; i++) {
+            x[i] = in[base + i];
+            peak = std::max(peak, fabsf(x[i]));
+        }
+        encode(*b, x, peak, rng);
+    }
+}
@@ -44,38 +44,40 @@ inline DarkFollowers::DarkFollowers()
 
 inline void DarkFollowers::reseed(unsigned seed)
 {
-    appearance.resize(numParticles);
+    particles.resize(numParticles);
 
     PRNG prng;
     prng.seed(seed);
 
-    for (unsigned i = 0; i < appearance.size(); i++) {
+    for (unsigned i = 0; i < particles.size(); i++) {
         Vec2 p = prng.ringVector(1e-4, seedRadius);
-        appearance[i].point = Vec3(p[0], 0, p[1]);
-        appearance[i].intensity = intensity;
-        appearance[i].radius = radius;
-        appearance[i].color = Vec3(-1, -1, -1);
+        particles.point[i] = Vec3(p[0], 0, p[1]);
+        particles.intensity[i] = intensity;
+        particles.radius[i] = radius;
+        particles.color[i] = Vec3(-1, -1, -1);
     }
+
+    // push() needs an index before the first frame
+    buildIndex();
 }
 
 inline void DarkFollowers::snap(Vec3 location, float rate)
 {
-    for (unsigned i = 0; i < appearance.size(); i++) {
-        Vec3& p = appearance[i].point;
+    for (unsigned i = 0; i < particles.size(); i++) {
+        Vec3& p = particles.point[i];
         p += (location - p) * rate;
     }
 }
 
 inline void DarkFollowers::push(Vec3 location, float radius, Vec3 displacement)
 {
-    std::vector<std::pair<size_t, Real> > hits;
+    ResultSet_t &hits = scratchHits;
     index.radiusSearch(hits, location, radius);
 
-    for (unsigned i = 0; i < numHits; i++) {
-        ParticleAppearance &hit = appearance[hits[i].first];
+    for (unsigned i = 0; i < hits.size(); i++) {
         float q2 = hits[i].second / sq(radius);
         if (q2 < 1.0f) {
-            hit.point += displacement * kernel2(q2);
+            particles.point[hits[i].first] += displacement * kernel2(q2);
         }
     }
 }
@@ -13,6 +13,7 @@
 #include "lib/camera.h"
 #include "lib/effect.h"
 #include "lib/effect_tap.h"
+#include "lib/latency_calibrator.h"
 
 
 // Effect to use with the latency timer: a slow square wave.
@@ -35,10 +36,11 @@ class LatencyTimer
 public:
     // Expected symmetric latency. I.e. if we shift video by this much, we'll have
     // symmetric rise and fall times. This turns out to be one NTSC video frame.
-    static const float kExpectedDelay = 1.0 / 29.97;
+    static constexpr float kExpectedDelay = LatencyCalibrator::kExpectedDelay;
 
-    // Uses EffectTap to test the calibrated delay
-    LatencyTimer(const EffectTap &tap);
+    // Uses EffectTap to test the calibrated delay: the calibrator's live estimate
+    // if we have one, or else kExpectedDelay.
+    LatencyTimer(const EffectTap &tap, const LatencyCalibrator *calibrator = 0);
 
     // Historgram for calculating camera transfer function and dumping out a CSV.
     void process(const Camera::VideoChunk &chunk);
@@ -65,6 +67,7 @@ private:
 
     // Testing our tap delay
     const EffectTap &tap;
+    const LatencyCalibrator *calibrator;
     float ledTapBins[kNumPhaseBins];
 
     static float binToPhase(unsigned bin);
@@ -99,8 +102,8 @@ inline float LatencyTimerEffect::brightnessAtPhase(float p)
     return p < 0.5 ? 0.8 : 0;
 }
 
-inline LatencyTimer::LatencyTimer(const EffectTap &tap)
-    : tap(tap)
+inline LatencyTimer::LatencyTimer(const EffectTap &tap, const LatencyCalibrator *calibrator)
+    : tap(tap), calibrator(calibrator)
 {
     frameTotal = 0;
     memset(frame, 0, sizeof frame);
@@ -131,7 +134,7 @@ inline void LatencyTimer::process(const Camera::VideoChunk &chunk)
     phaseBinDenominators[bin] += sizeof(frame) * 256 * 256;
 
     // Test the tap delay
-    const EffectTap::Frame *tf = tap.get(kExpectedDelay);
+    const EffectTap::Frame *tf = calibrator ? calibrator->delayedFrame(tap) : tap.get(kExpectedDelay);
     if (tf) {
         ledTapBins[bin] = tf->colors[0][0];
     }
@@ -13,6 +13,8 @@
 #include <string>
 #include <vector>
 #include <bitset>
+#include <atomic>
+#include <functional>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <fcntl.h>
@@ -22,14 +24,27 @@
 #include "lib/jpge.h"
 #include "lib/lodepng.h"
 #include "lib/prng.h"
+#include "lib/latency_calibrator.h"
 #include "latency_timer.h"
+#include "visual_memory_file.h"
 
 
 class VisualMemory
 {
 public:
-    // Starts a dedicated processing thread
-    void start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap);
+    VisualMemory();
+
+    // Covariance storage format. kInt8Block needs a bit over a quarter of the
+    // memory of kFloat32. Set before start(); existing files are converted.
+    // Either way the file still grows with samples x LEDs: for window6x12 it's
+    // about 854 MB as float, or 240 MB quantized, counting both generations.
+    VisualMemoryFile::DataType storage;
+
+    // Starts a dedicated processing thread, a pool of learning threads, and a recall
+    // thread. With a calibrator, we follow its live latency estimate; otherwise we
+    // assume LatencyTimer::kExpectedDelay.
+    void start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap,
+        const LatencyCalibrator *calibrator = 0);
 
     // Handle incoming video
     void process(const Camera::VideoChunk &chunk);
@@ -37,7 +52,12 @@ public:
     // Snapshot memory state as a PNG file
     void debug(const char *outputPngFilename) const;
 
-    // Read results, by LED pixel index. Between 0 and 1.
+    // Pick up the latest recall results. Call once per frame before shading, from
+    // beginFrame(); never while recall() may be running on other threads.
+    void latchRecall();
+
+    // Read results as of the last latchRecall(), by LED pixel index. Between 0 and 1.
+    // Safe to call from the render threads.
     float recall(unsigned ledIndex) const;
 
     // Camera feature extraction filters
@@ -48,36 +68,100 @@ public:
     std::bitset<CameraSampler8Q::kBlocks> recallFlags;
 
 private:
-    typedef double memory_t;
+    typedef VisualMemoryFile::memory_t memory_t;
     typedef std::vector<memory_t> memoryVector_t;
 
-    // Persistent mapped memory buffers updated on the learning thread
-    memory_t *covariance;
+    // Persistent mapped memory buffers updated on the learning thread.
+    // Readers use 'covariance', which points at the last checkpoint until the
+    // working generation has caught up with it, then at the working generation.
+    VisualMemoryFile file;
+    std::atomic<const uint8_t*> covariance;
+    size_t rowBytes;
     memory_t *sampleExpectedValue;
     memory_t *pixelExpectedValue;
 
-    // Recall buffers, updated during learning
-    memoryVector_t recallBuffer;
-    memoryVector_t recallAccumulator;
-    memoryVector_t recallTolerance;
-
     const EffectTap *tap;
+    const LatencyCalibrator *calibrator;
     std::vector<unsigned> denseToSparsePixelIndex;
 
     // Separate learning thread
     tthread::thread *learnThread;
     static void learnThreadFunc(void *context);
 
+    // Camera samples we're learning from this cycle
+    struct LearningRow {
+        unsigned sampleIndex;
+        memory_t cSample;           // Camera sample relative to its expected value
+    };
+    std::vector<LearningRow> learningRows;
+
+    // Delayed LED samples relative to their expected values, by dense index
+    memoryVector_t ledDelta;
+
+    // Pool of threads that share the learning rows for each cycle
+    struct LearnTask {
+        VisualMemory *self;
+        unsigned index;
+        tthread::thread *thread;
+        uint32_t rng;
+    };
+    std::vector<LearnTask*> learnTasks;
+    tthread::mutex taskLock;
+    tthread::condition_variable taskCond;
+    tthread::condition_variable taskDoneCond;
+    unsigned taskGeneration;
+    unsigned tasksDone;
+
+    static void learnTaskFunc(void *context);
+    void runLearnTasks();
+    void learnRows(LearnTask &task);
+
+    /*
+     * Recall runs on its own thread, once per camera field. It only reads the
+     * covariance rows for the most active motion blocks, so it keeps up with
+     * the camera no matter how slow a full learning cycle is.
+     *
+     * Results are triple buffered. We fill in the back buffer and swap it with
+     * the middle one, marking it fresh. latchRecall() swaps a fresh middle
+     * buffer for the front one, which readers use for the whole frame. Neither
+     * side ever touches a buffer the other one owns.
+     */
+    tthread::thread *recallThread;
+    tthread::mutex recallLock;
+    tthread::condition_variable recallCond;
+    unsigned recallFieldCount;
+    std::vector<float> recallMotion;        // Motion snapshot from the camera thread
+
+    memoryVector_t recallBuffers[3];
+    memoryVector_t recallFiltered;          // Filter state, by dense index
+    unsigned recallBack;                    // Owned by the recall thread
+    std::atomic<unsigned> recallMiddle;     // Buffer index, plus kRecallFresh until latched
+    unsigned recallFront;                   // Owned by readers, changed only by latchRecall()
+    tthread::mutex recallLatchLock;
+    static const unsigned kRecallFresh = 4;
+    memoryVector_t recallAccumulator;
+    memoryVector_t recallTolerance;
+    std::vector< std::pair< float, unsigned > > cMotion;
+    std::vector< std::pair< float, unsigned > > recallRows;
+    float cMotionThresholdPeak;
+
+    static void recallThreadFunc(void *context);
+    void recallWorker();
+    void recallField(const float *motion);
+
     // Learning parameters
     static constexpr memory_t kMotionLearningThreshold = 3e-2;
     static constexpr memory_t kPermeability = 1e-5;
     static constexpr memory_t kExpectedValueGain = 1e-3;
+    static constexpr double kCheckpointInterval = 5 * 60;
+    static const size_t kCatchUpBytesPerCycle = 4 << 20;
 
     // Recall parameters
     static constexpr float kMotionRecallProportion = 0.30;
     static constexpr float kMotionRecallThresholdDecay = 1e-4;
     static constexpr float kMotionRecallThresholdLimit = 1e-4;
     static constexpr float kMotionThresholdMaxPeakRatio = 1e6;
+    static const unsigned kMaxRecallRows = 2048;
 
     static constexpr memory_t kRecallFilterGain = 0.08;
     static constexpr memory_t kRecallToleranceGain = 0.001;
@@ -85,6 +169,9 @@ private:
     // Main loop for learning thread
     void learnWorker();
 
+    // What the LEDs were doing when the camera saw its latest frame
+    const EffectTap::Frame* delayedFrame() const;
+
     // Scalar sample utilities
     memory_t cameraSample(int sample);
     memory_t ledSample(int sparseIndex, const EffectTap::Frame *frame);
@@ -98,6 +185,10 @@ public:
     RecallDebugEffect(VisualMemory *mem) : mem(mem) {}
     VisualMemory *mem;
 
+    virtual void beginFrame(const FrameInfo &f) {
+        mem->latchRecall();
+    }
+
     virtual void shader(Vec3& rgb, const PixelInfo &p) const {
         float f = mem->recall(p.index);
         rgb = Vec3(0,f,0);
@@ -110,9 +201,17 @@ public:
  *****************************************************************************************/
 
 
-inline void VisualMemory::start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap)
+inline VisualMemory::VisualMemory()
+    : storage(VisualMemoryFile::kFloat32), covariance(0), rowBytes(0), tap(0), calibrator(0),
+      learnThread(0), recallThread(0), recallFieldCount(0), recallMotion(CameraSampler8Q::kSamples),
+      recallBack(0), recallMiddle(1), recallFront(2), cMotionThresholdPeak(0)
+{}
+
+inline void VisualMemory::start(const char *memoryPath, const EffectRunner *runner, const EffectTap *tap,
+    const LatencyCalibrator *calibrator)
 {
     this->tap = tap;
+    this->calibrator = calibrator;
     const Effect::PixelInfoVec &pixelInfo = runner->getPixelInfo();
 
     // Make a densely packed pixel index, skipping any unmapped pixels
@@ -125,59 +224,74 @@ inline void VisualMemory::start(const char *memoryPath, const EffectRunner *runn
         }
     }
 
-    // Calculate size of full visual memory
-
-    unsigned denseSize = denseToSparsePixelIndex.size();
-    unsigned cells = CameraSampler8Q::kSamples * denseSize;
-    unsigned mappingSize = sizeof(memory_t) * (cells + denseSize + CameraSampler8Q::kSamples);
-    int pagesize = getpagesize();
-    mappingSize += pagesize - 1;
-    mappingSize -= mappingSize % pagesize;
-
     // Recall and camera buffers
 
-    recallBuffer.resize(pixelInfo.size());
+    unsigned denseSize = denseToSparsePixelIndex.size();
+    for (unsigned i = 0; i < 3; i++) {
+        recallBuffers[i].assign(pixelInfo.size(), 0);
+    }
+    recallFiltered.assign(denseSize, 0);
     recallAccumulator.resize(denseSize);
-    recallTolerance.resize(denseSize);
-
-    std::fill(recallTolerance.begin(), recallTolerance.end(), 0);
+    recallTolerance.assign(denseSize, 0);
+    cMotion.resize(CameraSampler8Q::kBlocks);
+    recallRows.reserve(CameraSampler8Q::kSamples);
 
-    // Memory mapped file
+    // Memory mapped file, which knows which LED positions it was learned with
 
-    int fd = open(memoryPath, O_CREAT | O_RDWR | O_NOFOLLOW, 0666);
-    if (fd < 0) {
-        perror("vismem: Error opening mapping file");
-        return;
+    std::vector<Vec3> positions;
+    for (unsigned denseIndex = 0; denseIndex < denseSize; denseIndex++) {
+        positions.push_back(pixelInfo[denseToSparsePixelIndex[denseIndex]].point);
     }
 
-    if (ftruncate(fd, mappingSize)) {
-        perror("vismem: Error setting length of mapping file");
-        close(fd);
+    if (!file.open(memoryPath, CameraSampler8Q::kSamples, positions, storage)) {
         return;
     }
 
-    memory_t *mappedMemory = (memory_t*) mmap(0, mappingSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fd, 0);
-
-    if (!mappedMemory) {
-        perror("vismem: Error mapping memory file");
-        close(fd);
-        return;
+    covariance = file.activeCovariance();
+    rowBytes = file.rowBytes();
+    sampleExpectedValue = file.sampleExpectedValue();
+    pixelExpectedValue = file.pixelExpectedValue();
+
+    // One learning task per CPU. The learning thread itself only coordinates.
+
+    ledDelta.resize(denseSize);
+    learningRows.reserve(CameraSampler8Q::kSamples);
+    taskGeneration = 0;
+    tasksDone = 0;
+
+    unsigned numTasks = std::max(1u, tthread::thread::hardware_concurrency());
+    for (unsigned i = 0; i < numTasks; i++) {
+        LearnTask *task = new LearnTask;
+        task->self = this;
+        task->index = i;
+        task->rng = 1 + i;
+        learnTasks.push_back(task);
+    }
+    for (unsigned i = 0; i < numTasks; i++) {
+        learnTasks[i]->thread = new tthread::thread(learnTaskFunc, learnTasks[i]);
     }
-
-    covariance = mappedMemory;
-    sampleExpectedValue = covariance + cells;
-    pixelExpectedValue = sampleExpectedValue + CameraSampler8Q::kSamples;
 
     // Let the thread loose. This starts learning right away- no other thread should be
     // writing to the memory buffer from now on.
 
     learnThread = new tthread::thread(learnThreadFunc, this);
+    recallThread = new tthread::thread(recallThreadFunc, this);
+}
+
+inline void VisualMemory::latchRecall()
+{
+    // Several effects may share one VisualMemory, and latch from parallel beginFrame()s
+    tthread::lock_guard<tthread::mutex> guard(recallLatchLock);
+
+    if (recallMiddle.load(std::memory_order_relaxed) & kRecallFresh) {
+        recallFront = recallMiddle.exchange(recallFront, std::memory_order_acq_rel) & ~kRecallFresh;
+    }
 }
 
 inline float VisualMemory::recall(unsigned ledIndex) const
 {
     // Clamped and nonlinearly scaled
-    float r = recallBuffer[ledIndex];
+    float r = recallBuffers[recallFront][ledIndex];
     r += 0.793;  // Cube root of 0.5
     r = std::max(0.0f, std::min(1.0f, r));
     return r*r*r;
@@ -187,6 +301,16 @@ inline void VisualMemory::process(const Camera::VideoChunk &chunk)
 {
     luminance.process(chunk);
     sobel.process(chunk);
+
+    // Hand each finished field's motion to the recall thread
+
+    if (chunk.line == Camera::kLinesPerField - 1 &&
+        chunk.byteCount + chunk.byteOffset == Camera::kBytesPerLine) {
+        tthread::lock_guard<tthread::mutex> guard(recallLock);
+        memcpy(&recallMotion[0], sobel.motion, sizeof sobel.motion);
+        recallFieldCount++;
+        recallCond.notify_one();
+    }
 }
 
 inline void VisualMemory::learnThreadFunc(void *context)
@@ -195,6 +319,11 @@ inline void VisualMemory::learnThreadFunc(void *context)
     self->learnWorker();
 }
 
+inline const EffectTap::Frame* VisualMemory::delayedFrame() const
+{
+    return calibrator ? calibrator->delayedFrame(*tap) : tap->get(LatencyTimer::kExpectedDelay);
+}
+
 inline VisualMemory::memory_t VisualMemory::cameraSample(int sample)
 {
     int l = luminance.buffer[sample];
@@ -212,6 +341,72 @@ inline VisualMemory::memory_t VisualMemory::ledSample(int sparseIndex, const Eff
     return (r*r + g*g + b*b) / 3.0f;
 }
 
+inline void VisualMemory::learnTaskFunc(void *context)
+{
+    LearnTask *task = static_cast<LearnTask*>(context);
+    VisualMemory *self = task->self;
+    unsigned seenGeneration = 0;
+
+    while (true) {
+        self->taskLock.lock();
+        while (self->taskGeneration == seenGeneration) {
+            self->taskCond.wait(self->taskLock);
+        }
+        seenGeneration = self->taskGeneration;
+        self->taskLock.unlock();
+
+        self->learnRows(*task);
+
+        self->taskLock.lock();
+        if (++self->tasksDone == self->learnTasks.size()) {
+            self->taskDoneCond.notify_all();
+        }
+        self->taskLock.unlock();
+    }
+}
+
+inline void VisualMemory::runLearnTasks()
+{
+    // Wake every learning task for one pass over learningRows, and wait for all of them
+
+    tthread::lock_guard<tthread::mutex> guard(taskLock);
+    tasksDone = 0;
+    taskGeneration++;
+    taskCond.notify_all();
+    while (tasksDone < learnTasks.size()) {
+        taskDoneCond.wait(taskLock);
+    }
+}
+
+inline void VisualMemory::learnRows(LearnTask &task)
+{
+    /*
+     * Rank-1 covariance update over this task's share of the learning rows.
+     * Rows are dealt out round-robin, so busy regions of the image are spread
+     * across tasks. Each row is a contiguous run of cells, updated by one of
+     * the row kernels in covariance_rows.h.
+     */
+
+    const unsigned denseSize = ledDelta.size();
+    const unsigned numTasks = learnTasks.size();
+    const memory_t keep = 1 - kPermeability;
+    const memory_t *led = &ledDelta[0];
+    uint8_t *matrix = file.covariance();
+    bool quantized = file.dataType() == VisualMemoryFile::kInt8Block;
+
+    for (unsigned r = task.index; r < learningRows.size(); r += numTasks) {
+        const LearningRow &row = learningRows[r];
+        uint8_t *cells = matrix + row.sampleIndex * rowBytes;
+        file.touchRow(row.sampleIndex);
+
+        if (quantized) {
+            QuantizedRow::update(cells, denseSize, led, row.cSample, keep, task.rng);
+        } else {
+            FloatRow::update(cells, denseSize, led, row.cSample, keep, task.rng);
+        }
+    }
+}
+
 inline void VisualMemory::learnWorker()
 {
     unsigned denseSize = denseToSparsePixelIndex.size();
@@ -220,27 +415,29 @@ inline void VisualMemory::learnWorker()
     PRNG prng;
     prng.seed(84);
 
-    // Coordinated motion sorting buffer
-    std::vector< std::pair< float, unsigned > > cMotion;
-    cMotion.resize(CameraSampler8Q::kBlocks);
-    float cMotionThresholdPeak = 0.0f;
-
     // Performance counters
     unsigned loopCount = 0;
-    struct timeval timeA, timeB;
+    struct timeval timeA, timeB, timeCheckpoint;
+    bool caughtUp = false;
 
     gettimeofday(&timeA, 0);
     gettimeofday(&timeB, 0);
+    timeCheckpoint = timeA;
 
     // Keep iterating over the memory buffer in the order it's stored
     while (true) {
 
-        // For each cycle, keep an accumulator for the next recall buffer
-        double recallTotal = 0;
-        std::fill(recallAccumulator.begin(), recallAccumulator.end(), 0);
+        // Look up a delayed version of what the LEDs were doing then, to adjust for the system latency
+        const EffectTap::Frame *effectFrame = delayedFrame();
+        if (!effectFrame) {
+            // This frame isn't in our buffer yet
+            usleep(10 * 1000);
+            continue;
+        }
 
         /*
-         * Update expected value filters
+         * Update expected value filters. The LED side is sampled once per cycle
+         * into a dense vector, relative to its expected value, for the big loop below.
          */
 
         for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
@@ -250,59 +447,23 @@ inline void VisualMemory::learnWorker()
             sampleExpectedValue[sampleIndex] = ev;
         }
 
-        {
-            const EffectTap::Frame *effectFrame = tap->get(LatencyTimer::kExpectedDelay);
-            if (effectFrame) {
-                for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
-                    unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
-                    memory_t v = ledSample(sparseIndex, effectFrame);
-                    memory_t ev = pixelExpectedValue[denseIndex];
-                    ev += (v * v - ev) * kExpectedValueGain;
-                    pixelExpectedValue[denseIndex] = ev;
-                }
-            }
-        }
-
-        /*
-         * Coordinated motion filter: sum of camera motion per-block, to detect clumps of motion
-         * in a tight area for recall.
-         */
-
-        // 1. Clear coordinated motion accumulator, reset order
-        for (unsigned blockIndex = 0; blockIndex != cMotion.size(); blockIndex++) {
-            cMotion[blockIndex].first = 0;
-            cMotion[blockIndex].second = blockIndex;
-            recallFlags[blockIndex] = false;
-        }
-
-        // 2. Accumulate motion for each block
-        for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
-            unsigned blockIndex = CameraSampler8Q::blockIndex(sampleIndex);
-            cMotion[blockIndex].first += sq(sobel.motion[sampleIndex]);
-        }
-
-        // 3. Sort accumulators by total motion
-        std::sort(cMotion.begin(), cMotion.end());
-
-        // 4. Target the blocks within the top kMotionRecallProportion, smoothed with a leaky peak detector
-        float cMotionThresholdTarget = cMotion[cMotion.size() * (1.0 - kMotionRecallProportion)].first;
-        cMotionThresholdPeak = std::max( cMotionThresholdTarget,
-                                std::min( kMotionThresholdMaxPeakRatio * cMotionThresholdTarget,
-                                 cMotionThresholdPeak - cMotionThresholdPeak * kMotionRecallThresholdDecay));
-
-        // printf("cMotion threshold filter=%e target=%e\n", cMotionThresholdPeak, cMotionThresholdTarget);
-
-        // 5. Set recallFlags[] for use below and in the debug window
-        for (unsigned i = 0; i < cMotion.size(); ++i) {
-            recallFlags[cMotion[i].second] = cMotion[i].first >= cMotionThresholdPeak;
+        for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
+            unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
+            memory_t v = ledSample(sparseIndex, effectFrame);
+            memory_t ev = pixelExpectedValue[denseIndex];
+            ev += (v * v - ev) * kExpectedValueGain;
+            pixelExpectedValue[denseIndex] = ev;
+            ledDelta[denseIndex] = v - ev;
         }
 
         /*
-         * Big loop, iterate over the huge covariance matrix. We update this matrix
+         * Pick the rows of the huge covariance matrix to update. We update this matrix
          * sparsely, using a motion heuristic to avoid learning from areas of the image
          * that aren't moving.
          */
 
+        learningRows.clear();
+
         for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
             float motion = sobel.motion[sampleIndex];
 
@@ -319,82 +480,199 @@ inline void VisualMemory::learnWorker()
                 continue;
             }
 
-            // Look up a delayed version of what the LEDs were doing then, to adjust for the system latency
-            const EffectTap::Frame *effectFrame = tap->get(LatencyTimer::kExpectedDelay);
-            if (!effectFrame) {
-                // This frame isn't in our buffer yet
-                usleep(10 * 1000);
-                continue;
-            }
-
-            memory_t* cell = &covariance[sampleIndex * denseSize];
-            memory_t cSample = cameraSample(sampleIndex) - sampleExpectedValue[sampleIndex];
-
-            // Recall occurs when we exceed the coordinated motion threshold
-            unsigned blockIndex = CameraSampler8Q::blockIndex(sampleIndex);
-            bool isRecalling = recallFlags[blockIndex];
-
-            // Learning and occurs on all LEDs for this sample
-            for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++, cell++) {
-                unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
-                memory_t state = *cell;
-
-                // Compute covariance incrementally
-                memory_t lSample = ledSample(sparseIndex, effectFrame);
-                memory_t reinforcement = cSample * (lSample - pixelExpectedValue[denseIndex]);
-                state = (state - state * kPermeability) + reinforcement;
-                *cell = state;
+            LearningRow row;
+            row.sampleIndex = sampleIndex;
+            row.cSample = cameraSample(sampleIndex) - sampleExpectedValue[sampleIndex];
+            learningRows.push_back(row);
+        }
 
-                if (isRecalling) {
-                    double acc = motion * motion * state;
+        // Learning occurs on all LEDs for each of these samples
+        runLearnTasks();
 
-                    // Integrate over all camera samples
-                    recallAccumulator[sparseIndex] += acc;
-                    recallTotal += acc;
-                }
-            }
+        /*
+         * Periodic performance stats
+         */
+        
+        loopCount++;
+        gettimeofday(&timeB, 0);
+        double timeDelta = (timeB.tv_sec - timeA.tv_sec) + 1e-6 * (timeB.tv_usec - timeA.tv_usec);
+        if (timeDelta > 2.0f) {
+            fprintf(stderr, "vismem: %.02f cycles / second, %d learning rows, %d threads\n",
+                loopCount / timeDelta, (int)learningRows.size(), (int)learnTasks.size());
+            loopCount = 0;
+            timeA = timeB;
         }
 
         /*
-         * Update recallBuffer
+         * Between cycles while the learning tasks are idle: bring a slice of the working
+         * generation up to date, and once it's complete, let readers follow it there.
+         * Periodic checkpoints switch generations, and readers go back to the synced one.
          */
 
-        double recallScale = recallTotal ? denseSize / recallTotal : 0.0;
+        if (!caughtUp && file.catchUp(kCatchUpBytesPerCycle)) {
+            caughtUp = true;
+            covariance.store(file.covariance(), std::memory_order_release);
+        }
 
-        // printf("recallTotal %e recallScale %e\n", recallTotal, recallScale);
+        if ((timeB.tv_sec - timeCheckpoint.tv_sec) > kCheckpointInterval) {
+            file.checkpoint();
+            covariance.store(file.activeCovariance(), std::memory_order_release);
+            sampleExpectedValue = file.sampleExpectedValue();
+            pixelExpectedValue = file.pixelExpectedValue();
+            timeCheckpoint = timeB;
+            caughtUp = false;
+        }
+    }
+}
 
-        for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
-            unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
+inline void VisualMemory::recallThreadFunc(void *context)
+{
+    VisualMemory *self = static_cast<VisualMemory*>(context);
+    self->recallWorker();
+}
 
-            memory_t tol = recallTolerance[denseIndex];
-            memory_t target = recallAccumulator[denseIndex] * recallScale + tol;
+inline void VisualMemory::recallWorker()
+{
+    std::vector<float> motion(CameraSampler8Q::kSamples);
+    unsigned seenFieldCount = 0;
 
-            // Filtered update for recall buffer
-            memory_t r = recallBuffer[sparseIndex];
-            r += (target - r) * kRecallFilterGain;
-            recallBuffer[sparseIndex] = r;
+    // Performance counters
+    unsigned fieldCount = 0;
+    double recallSeconds = 0;
+    struct timeval timeA, timeB, timeC;
+    gettimeofday(&timeA, 0);
 
-            if (recallTotal) {
-                // Filtered update for tolerance
-                recallTolerance[denseIndex] = tol - r * kRecallToleranceGain;
-            }
+    while (true) {
+        // Wait for the next field. If we fell behind, skip straight to the latest one.
+        recallLock.lock();
+        while (recallFieldCount == seenFieldCount) {
+            recallCond.wait(recallLock);
         }
+        seenFieldCount = recallFieldCount;
+        std::swap(motion, recallMotion);
+        recallLock.unlock();
 
-        /*
-         * Periodic performance stats
-         */
-        
-        loopCount++;
         gettimeofday(&timeB, 0);
-        double timeDelta = (timeB.tv_sec - timeA.tv_sec) + 1e-6 * (timeB.tv_usec - timeA.tv_usec);
+        recallField(&motion[0]);
+        gettimeofday(&timeC, 0);
+
+        fieldCount++;
+        recallSeconds += (timeC.tv_sec - timeB.tv_sec) + 1e-6 * (timeC.tv_usec - timeB.tv_usec);
+
+        double timeDelta = (timeC.tv_sec - timeA.tv_sec) + 1e-6 * (timeC.tv_usec - timeA.tv_usec);
         if (timeDelta > 2.0f) {
-            fprintf(stderr, "vismem: %.02f cycles / second\n", loopCount / timeDelta);
-            loopCount = 0;
-            timeA = timeB;
+            fprintf(stderr, "vismem: %.02f recall fields / second, %.02f ms each, %d rows\n",
+                fieldCount / timeDelta, recallSeconds * 1e3 / fieldCount, (int)recallRows.size());
+            fieldCount = 0;
+            recallSeconds = 0;
+            timeA = timeC;
         }
     }
 }
 
+inline void VisualMemory::recallField(const float *motion)
+{
+    unsigned denseSize = denseToSparsePixelIndex.size();
+
+    /*
+     * Coordinated motion filter: sum of camera motion per-block, to detect clumps of motion
+     * in a tight area for recall.
+     */
+
+    // 1. Clear coordinated motion accumulator, reset order
+    for (unsigned blockIndex = 0; blockIndex != cMotion.size(); blockIndex++) {
+        cMotion[blockIndex].first = 0;
+        cMotion[blockIndex].second = blockIndex;
+    }
+
+    // 2. Accumulate motion for each block
+    for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
+        unsigned blockIndex = CameraSampler8Q::blockIndex(sampleIndex);
+        cMotion[blockIndex].first += sq(motion[sampleIndex]);
+    }
+
+    // 3. Sort accumulators by total motion
+    std::sort(cMotion.begin(), cMotion.end());
+
+    // 4. Target the blocks within the top kMotionRecallProportion, smoothed with a leaky peak detector
+    float cMotionThresholdTarget = cMotion[cMotion.size() * (1.0 - kMotionRecallProportion)].first;
+    cMotionThresholdPeak = std::max( cMotionThresholdTarget,
+                            std::min( kMotionThresholdMaxPeakRatio * cMotionThresholdTarget,
+                             cMotionThresholdPeak - cMotionThresholdPeak * kMotionRecallThresholdDecay));
+
+    // 5. Set recallFlags[] for use below and in the debug window
+    for (unsigned i = 0; i < cMotion.size(); ++i) {
+        recallFlags[cMotion[i].second] = cMotion[i].first >= cMotionThresholdPeak;
+    }
+
+    /*
+     * Sparse matrix-vector product: each sample in a recalling block contributes its
+     * covariance row, weighted by its squared motion. Only the heaviest kMaxRecallRows
+     * rows are read, which bounds the time per field.
+     */
+
+    recallRows.clear();
+    for (unsigned sampleIndex = 0; sampleIndex != CameraSampler8Q::kSamples; sampleIndex++) {
+        float weight = sq(motion[sampleIndex]);
+        if (weight > 0 && recallFlags[CameraSampler8Q::blockIndex(sampleIndex)]) {
+            recallRows.push_back(std::make_pair(weight, sampleIndex));
+        }
+    }
+    if (recallRows.size() > kMaxRecallRows) {
+        std::nth_element(recallRows.begin(), recallRows.begin() + kMaxRecallRows, recallRows.end(),
+            std::greater< std::pair< float, unsigned > >());
+        recallRows.resize(kMaxRecallRows);
+    }
+
+    // Rows may be mid-update on a learning thread; any error is brief and gets filtered below.
+
+    const uint8_t *matrix = covariance.load(std::memory_order_acquire);
+    bool quantized = file.dataType() == VisualMemoryFile::kInt8Block;
+    memory_t *acc = &recallAccumulator[0];
+
+    std::fill(recallAccumulator.begin(), recallAccumulator.end(), 0);
+    for (unsigned r = 0; r < recallRows.size(); r++) {
+        const uint8_t *cells = matrix + recallRows[r].second * rowBytes;
+        if (quantized) {
+            QuantizedRow::accumulate(cells, denseSize, recallRows[r].first, acc);
+        } else {
+            FloatRow::accumulate(cells, denseSize, recallRows[r].first, acc);
+        }
+    }
+
+    double recallTotal = 0;
+    for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
+        recallTotal += acc[denseIndex];
+    }
+
+    /*
+     * Filter into the back buffer, then publish it
+     */
+
+    memoryVector_t &next = recallBuffers[recallBack];
+    double recallScale = recallTotal ? denseSize / recallTotal : 0.0;
+
+    for (unsigned denseIndex = 0; denseIndex != denseSize; denseIndex++) {
+        unsigned sparseIndex = denseToSparsePixelIndex[denseIndex];
+
+        memory_t tol = recallTolerance[denseIndex];
+        memory_t target = acc[denseIndex] * recallScale + tol;
+
+        // Filtered update for recall buffer
+        memory_t r = recallFiltered[denseIndex];
+        r += (target - r) * kRecallFilterGain;
+        recallFiltered[denseIndex] = r;
+        next[sparseIndex] = r;
+
+        if (recallTotal) {
+            // Filtered update for tolerance
+            recallTolerance[denseIndex] = tol - r * kRecallToleranceGain;
+        }
+    }
+
+    recallBack = recallMiddle.exchange(recallBack | kRecallFresh, std::memory_order_acq_rel) & ~kRecallFresh;
+}
+
 inline void VisualMemory::debug(const char *filename) const
 {
     unsigned denseSize = denseToSparsePixelIndex.size();
@@ -407,10 +685,18 @@ inline void VisualMemory::debug(const char *filename) const
     std::vector<uint8_t> image;
     image.resize(width * height * 3);
 
+    // Unpack the whole matrix; this is only for occasional debugging
+    const uint8_t *matrix = covariance.load(std::memory_order_acquire);
+    memoryVector_t cells(CameraSampler8Q::kSamples * denseSize);
+    for (unsigned sample = 0; sample < CameraSampler8Q::kSamples; sample++) {
+        VisualMemoryFile::readRow(file.dataType(), matrix + sample * rowBytes,
+            denseSize, &cells[sample * denseSize]);
+    }
+
     // Maximum covariance
-    memory_t cellMax = covariance[0];
-    for (unsigned c = 1; c < (CameraSampler8Q::kSamples * denseSize); c++) {
-        memory_t l = covariance[c];
+    memory_t cellMax = cells[0];
+    for (unsigned c = 1; c < cells.size(); c++) {
+        memory_t l = cells[c];
         cellMax = std::max(cellMax, l);
     }
 
@@ -425,7 +711,7 @@ inline void VisualMemory::debug(const char *filename) const
             int x = sx + (led % ledsWide) * CameraSampler8Q::kBlocksWide;
             int y = sy + (led / ledsWide) * CameraSampler8Q::kBlocksHigh;
 
-            memory_t cell = covariance[ sample * denseSize + led ];
+            memory_t cell = cells[ sample * denseSize + led ];
             uint8_t *pixel = &image[ 3 * (y * width + x) ];
 
             // Some cheesy HDR, so we can see more detail
@@ -0,0 +1,645 @@
+/*
+ * On-disk format for VisualMemory.
+ * A header describes what's in the file, so old learning is never
+ * silently misread. Two generations of data take turns, so a crash
+ * only ever loses the work since the last checkpoint.
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "lib/effect.h"
+#include "covariance_rows.h"
+
+
+/*
+ * File layout:
+ *
+ *   Header, then the dense LED positions it was learned with, padded to a page
+ *   Generation 0: covariance rows[samples], sampleExpectedValue[samples],
+ *                 pixelExpectedValue[denseSize], padded to a page
+ *   Generation 1: same
+ *
+ * The header's activeGeneration was completely written and synced. We work in
+ * the other one. A checkpoint syncs the working generation, points the header at
+ * it, then continues in the older generation.
+ *
+ * The older generation is only behind by the rows that changed since the last
+ * checkpoint, so only those are copied, and not all at once. Each stale row is
+ * copied just before the learner first touches it, and catchUp() handles the
+ * rest a slice at a time between learning cycles. Until that finishes, readers
+ * use the active generation, which is complete.
+ *
+ * Covariance rows are stored in one of the formats from covariance_rows.h.
+ * Expected values are always floats.
+ */
+class VisualMemoryFile
+{
+public:
+    typedef float memory_t;
+
+    static const uint32_t kVersion = 1;
+
+    enum DataType {
+        kFloat32 = 1,       // FloatRow
+        kInt8Block = 2,     // QuantizedRow
+    };
+
+    VisualMemoryFile();
+    ~VisualMemoryFile();
+
+    // Open or create the file for 'samples' camera samples and LEDs at 'positions'. Files from
+    // an older version, a different LED layout, or another data type are migrated. A file with
+    // our header that can't be migrated is moved aside to "<path>.old", if that name is free.
+    // A headerless file of any size but the original format's is left alone, and we refuse to
+    // open it. Returns false on I/O errors or if the file was refused.
+    bool open(const char *path, unsigned samples, const std::vector<Vec3> &positions,
+        DataType dataType = kFloat32);
+
+    // Working generation, valid after open(). These move after each checkpoint.
+    uint8_t *covariance() const;
+    memory_t *sampleExpectedValue() const;
+    memory_t *pixelExpectedValue() const;
+
+    // Rows as of the last checkpoint. Read-only, and complete even while catching up.
+    const uint8_t *activeCovariance() const;
+
+    // Call before modifying a covariance() row. Safe to call concurrently for different rows.
+    void touchRow(unsigned row);
+
+    // Copy up to about 'maxBytes' of stale rows into the working generation. Returns true
+    // once the working generation is completely up to date. Not concurrent with touchRow().
+    bool catchUp(size_t maxBytes);
+
+    // Covariance row layout
+    DataType dataType() const;
+    size_t rowBytes() const;
+
+    // Convert whole rows of any data type to and from floats
+    static size_t rowBytes(DataType type, unsigned n);
+    static void readRow(DataType type, const void *row, unsigned n, float *out);
+    static void writeRow(DataType type, void *row, unsigned n, const float *in, uint32_t &rng);
+
+    // Make the working generation durable, and switch to the other one. Nothing may
+    // modify memory during this call. Rows start catching up afterward.
+    void checkpoint();
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t dataType;
+        uint32_t samples;
+        uint32_t denseSize;
+        uint64_t layoutHash;
+        uint64_t headerSize;            // Bytes before the first generation
+        uint64_t generationSize;        // Bytes per generation
+        uint32_t activeGeneration;      // Last generation to be completely written
+        uint32_t reserved;
+        uint64_t checkpoints;           // Checkpoints since the file was created
+    };
+
+    int fd;
+    uint8_t *mapping;
+    size_t mappingSize;
+    Header *header;
+    unsigned working;
+
+    // State of each row in the working generation
+    enum RowState {
+        kRowClean = 0,          // Same as the active generation
+        kRowStale,              // Behind the active generation
+        kRowDirty,              // Changed since the last checkpoint
+    };
+    std::vector<uint8_t> rowState;
+    unsigned catchUpCursor;
+
+    static const char *magic();
+    static size_t pageRound(size_t bytes);
+    static size_t headerBytes(unsigned denseSize);
+    static size_t generationBytes(unsigned samples, unsigned denseSize, DataType type);
+    static size_t legacyBytes(unsigned samples, unsigned denseSize);
+    static uint64_t layoutHash(unsigned samples, const std::vector<Vec3> &positions);
+
+    static bool create(const char *path, unsigned samples, const std::vector<Vec3> &positions, DataType type);
+    static bool migrateLegacy(const char *path, unsigned samples, const std::vector<Vec3> &positions, DataType type);
+    static bool migrate(const char *path, unsigned samples, const std::vector<Vec3> &positions, DataType type);
+    static bool moveAside(const char *path);
+
+    bool map(const char *path);
+    void unmap();
+    uint8_t *generation(unsigned g) const;
+    const float *positions() const;
+    size_t expectedValueBytes() const;
+    void copyRow(unsigned row);
+    void beginWorking(unsigned g);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline VisualMemoryFile::VisualMemoryFile()
+    : fd(-1), mapping(0), mappingSize(0), header(0), working(0), catchUpCursor(0)
+{}
+
+inline VisualMemoryFile::~VisualMemoryFile()
+{
+    unmap();
+}
+
+inline const char *VisualMemoryFile::magic()
+{
+    return "VISMEM\r\n";
+}
+
+inline size_t VisualMemoryFile::pageRound(size_t bytes)
+{
+    size_t pagesize = getpagesize();
+    return (bytes + pagesize - 1) / pagesize * pagesize;
+}
+
+inline size_t VisualMemoryFile::headerBytes(unsigned denseSize)
+{
+    return pageRound(sizeof(Header) + sizeof(float) * 3 * denseSize);
+}
+
+inline size_t VisualMemoryFile::rowBytes(DataType type, unsigned n)
+{
+    return type == kInt8Block ? QuantizedRow::bytes(n) : FloatRow::bytes(n);
+}
+
+inline void VisualMemoryFile::readRow(DataType type, const void *row, unsigned n, float *out)
+{
+    if (type == kInt8Block) {
+        QuantizedRow::read(row, n, out);
+    } else {
+        FloatRow::read(row, n, out);
+    }
+}
+
+inline void VisualMemoryFile::writeRow(DataType type, void *row, unsigned n, const float *in, uint32_t &rng)
+{
+    if (type == kInt8Block) {
+        QuantizedRow::write(row, n, in, rng);
+    } else {
+        FloatRow::write(row, n, in, rng);
+    }
+}
+
+inline size_t VisualMemoryFile::generationBytes(unsigned samples, unsigned denseSize, DataType type)
+{
+    return pageRound(rowBytes(type, denseSize) * samples + sizeof(memory_t) * (samples + denseSize));
+}
+
+inline size_t VisualMemoryFile::legacyBytes(unsigned samples, unsigned denseSize)
+{
+    // Original headerless format: the same arrays, as doubles
+    return pageRound(sizeof(double) * (size_t(samples) * denseSize + samples + denseSize));
+}
+
+inline uint64_t VisualMemoryFile::layoutHash(unsigned samples, const std::vector<Vec3> &positions)
+{
+    // FNV-1a over everything that determines what a cell means
+
+    uint64_t h = 14695981039346656037ULL;
+    std::vector<float> words;
+    words.push_back(samples);
+    for (unsigned i = 0; i < positions.size(); i++) {
+        words.push_back(positions[i][0]);
+        words.push_back(positions[i][1]);
+        words.push_back(positions[i][2]);
+    }
+
+    const uint8_t *bytes = (const uint8_t*) &words[0];
+    for (size_t i = 0; i < words.size() * sizeof(float); i++) {
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+inline uint8_t *VisualMemoryFile::generation(unsigned g) const
+{
+    return mapping + header->headerSize + g * header->generationSize;
+}
+
+inline const float *VisualMemoryFile::positions() const
+{
+    return (const float*) (header + 1);
+}
+
+inline uint8_t *VisualMemoryFile::covariance() const
+{
+    return generation(working);
+}
+
+inline const uint8_t *VisualMemoryFile::activeCovariance() const
+{
+    return generation(header->activeGeneration & 1);
+}
+
+inline VisualMemoryFile::DataType VisualMemoryFile::dataType() const
+{
+    return DataType(header->dataType);
+}
+
+inline size_t VisualMemoryFile::rowBytes() const
+{
+    return rowBytes(dataType(), header->denseSize);
+}
+
+inline VisualMemoryFile::memory_t *VisualMemoryFile::sampleExpectedValue() const
+{
+    return (memory_t*) (covariance() + rowBytes() * header->samples);
+}
+
+inline VisualMemoryFile::memory_t *VisualMemoryFile::pixelExpectedValue() const
+{
+    return sampleExpectedValue() + header->samples;
+}
+
+inline bool VisualMemoryFile::create(const char *path, unsigned samples, const std::vector<Vec3> &positions, DataType type)
+{
+    // New file with zeroed data in both generations. The header goes in last,
+    // so a crash here leaves a file we'll recognize as unusable.
+
+    unsigned denseSize = positions.size();
+    size_t headerSize = headerBytes(denseSize);
+    size_t generationSize = generationBytes(samples, denseSize, type);
+    size_t size = headerSize + 2 * generationSize;
+
+    int fd = ::open(path, O_CREAT | O_TRUNC | O_RDWR | O_NOFOLLOW, 0666);
+    if (fd < 0) {
+        perror("vismem: Error creating memory file");
+        return false;
+    }
+    if (ftruncate(fd, size)) {
+        perror("vismem: Error setting length of memory file");
+        close(fd);
+        return false;
+    }
+
+    std::vector<uint8_t> buffer(headerSize);
+    Header *h = (Header*) &buffer[0];
+    memcpy(h->magic, magic(), sizeof h->magic);
+    h->version = kVersion;
+    h->dataType = type;
+    h->samples = samples;
+    h->denseSize = denseSize;
+    h->layoutHash = layoutHash(samples, positions);
+    h->headerSize = headerSize;
+    h->generationSize = generationSize;
+    h->activeGeneration = 0;
+    h->checkpoints = 0;
+
+    float *p = (float*) (h + 1);
+    for (unsigned i = 0; i < denseSize; i++) {
+        p[i*3 + 0] = positions[i][0];
+        p[i*3 + 1] = positions[i][1];
+        p[i*3 + 2] = positions[i][2];
+    }
+
+    bool ok = pwrite(fd, &buffer[0], headerSize, 0) == ssize_t(headerSize) && fsync(fd) == 0;
+    if (!ok) {
+        perror("vismem: Error writing memory file header");
+    }
+    close(fd);
+    return ok;
+}
+
+inline bool VisualMemoryFile::moveAside(const char *path)
+{
+    std::string old = std::string(path) + ".old";
+    struct stat st;
+    if (stat(old.c_str(), &st) == 0) {
+        fprintf(stderr, "vismem: %s is not usable, and %s is in the way. Not touching either one.\n",
+            path, old.c_str());
+        return false;
+    }
+
+    fprintf(stderr, "vismem: %s is not usable, moving it to %s\n", path, old.c_str());
+    if (rename(path, old.c_str())) {
+        perror("vismem: Error renaming old memory file");
+        return false;
+    }
+    return true;
+}
+
+inline bool VisualMemoryFile::migrateLegacy(const char *path, unsigned samples, const std::vector<Vec3> &positions, DataType type)
+{
+    // Convert a headerless double-precision file. It has no record of its LED layout,
+    // so all we can do is assume it's the current one.
+
+    unsigned denseSize = positions.size();
+    size_t size = legacyBytes(samples, denseSize);
+    std::string tmp = std::string(path) + ".tmp";
+
+    fprintf(stderr, "vismem: Converting %s from the original format\n", path);
+
+    int oldFd = ::open(path, O_RDONLY);
+    if (oldFd < 0) {
+        perror("vismem: Error opening old memory file");
+        return false;
+    }
+    const double *old = (const double*) mmap(0, size, PROT_READ, MAP_FILE | MAP_SHARED, oldFd, 0);
+    close(oldFd);
+    if (old == MAP_FAILED) {
+        perror("vismem: Error mapping old memory file");
+        return false;
+    }
+    madvise((void*) old, size, MADV_SEQUENTIAL);
+
+    VisualMemoryFile next;
+    bool ok = create(tmp.c_str(), samples, positions, type) && next.map(tmp.c_str());
+    if (ok) {
+        std::vector<float> row(std::max(denseSize, samples));
+        uint32_t rng = 1;
+        uint8_t *dest = next.generation(0);
+        size_t destRowBytes = next.rowBytes();
+
+        for (unsigned s = 0; s < samples; s++) {
+            for (unsigned i = 0; i < denseSize; i++) {
+                row[i] = old[size_t(s) * denseSize + i];
+            }
+            writeRow(type, dest + s * destRowBytes, denseSize, &row[0], rng);
+        }
+
+        const double *oldEV = old + size_t(samples) * denseSize;
+        memory_t *ev = (memory_t*) (dest + samples * destRowBytes);
+        for (unsigned i = 0; i < samples + denseSize; i++) {
+            ev[i] = oldEV[i];
+        }
+
+        ok = msync(next.mapping, next.mappingSize, MS_SYNC) == 0;
+        next.unmap();
+    }
+    munmap((void*) old, size);
+
+    return ok && rename(tmp.c_str(), path) == 0;
+}
+
+inline bool VisualMemoryFile::migrate(const char *path, unsigned samples, const std::vector<Vec3> &positions, DataType type)
+{
+    // The LEDs or the storage format changed. Carry over what we learned for each
+    // LED that's still at the same position; new LEDs start from scratch.
+
+    const float kEpsilon = 1e-4;
+    unsigned denseSize = positions.size();
+    std::string tmp = std::string(path) + ".tmp";
+
+    VisualMemoryFile prev, next;
+    if (!prev.map(path)) {
+        return false;
+    }
+    if (!create(tmp.c_str(), samples, positions, type) || !next.map(tmp.c_str())) {
+        return false;
+    }
+
+    unsigned prevSize = prev.header->denseSize;
+    const float *prevPositions = prev.positions();
+    std::vector<int> prevIndex(denseSize, -1);
+    unsigned matched = 0;
+
+    for (unsigned i = 0; i < denseSize; i++) {
+        for (unsigned j = 0; j < prevSize; j++) {
+            if (fabsf(prevPositions[j*3 + 0] - positions[i][0]) < kEpsilon &&
+                fabsf(prevPositions[j*3 + 1] - positions[i][1]) < kEpsilon &&
+                fabsf(prevPositions[j*3 + 2] - positions[i][2]) < kEpsilon) {
+                prevIndex[i] = j;
+                matched++;
+                break;
+            }
+        }
+    }
+
+    fprintf(stderr, "vismem: Migrating %s, keeping %d of %d LEDs, data type %d -> %d\n",
+        path, matched, denseSize, prev.header->dataType, type);
+
+    unsigned prevActive = prev.header->activeGeneration & 1;
+    const uint8_t *src = prev.generation(prevActive);
+    uint8_t *dest = next.generation(0);
+    size_t srcRowBytes = prev.rowBytes();
+    size_t destRowBytes = next.rowBytes();
+    madvise((void*) src, prev.header->generationSize, MADV_SEQUENTIAL);
+
+    std::vector<float> srcRow(prevSize + 1);
+    std::vector<float> destRow(denseSize + 1);
+    uint32_t rng = 1;
+
+    for (unsigned s = 0; s < samples; s++) {
+        readRow(prev.dataType(), src + s * srcRowBytes, prevSize, &srcRow[0]);
+        for (unsigned i = 0; i < denseSize; i++) {
+            destRow[i] = prevIndex[i] >= 0 ? srcRow[prevIndex[i]] : 0;
+        }
+        writeRow(type, dest + s * destRowBytes, denseSize, &destRow[0], rng);
+    }
+
+    const memory_t *srcEV = (const memory_t*) (src + samples * srcRowBytes);
+    memory_t *destEV = (memory_t*) (dest + samples * destRowBytes);
+    memcpy(destEV, srcEV, sizeof(memory_t) * samples);
+    for (unsigned i = 0; i < denseSize; i++) {
+        if (prevIndex[i] >= 0) {
+            destEV[samples + i] = srcEV[samples + prevIndex[i]];
+        }
+    }
+
+    bool ok = msync(next.mapping, next.mappingSize, MS_SYNC) == 0;
+    next.unmap();
+    prev.unmap();
+
+    return ok && rename(tmp.c_str(), path) == 0;
+}
+
+inline bool VisualMemoryFile::map(const char *path)
+{
+    fd = ::open(path, O_RDWR | O_NOFOLLOW);
+    if (fd < 0) {
+        perror("vismem: Error opening memory file");
+        return false;
+    }
+
+    struct stat st;
+    Header h;
+    if (fstat(fd, &st) || pread(fd, &h, sizeof h, 0) != sizeof h ||
+        size_t(st.st_size) < h.headerSize + 2 * h.generationSize) {
+        fprintf(stderr, "vismem: %s is truncated\n", path);
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    mappingSize = h.headerSize + 2 * h.generationSize;
+    mapping = (uint8_t*) mmap(0, mappingSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        perror("vismem: Error mapping memory file");
+        mapping = 0;
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    header = (Header*) mapping;
+    return true;
+}
+
+inline void VisualMemoryFile::unmap()
+{
+    if (mapping) {
+        munmap(mapping, mappingSize);
+        mapping = 0;
+        header = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+inline bool VisualMemoryFile::open(const char *path, unsigned samples, const std::vector<Vec3> &positions,
+    DataType dataType)
+{
+    unsigned denseSize = positions.size();
+    struct stat st;
+    bool ok = true;
+
+    if (stat(path, &st)) {
+        ok = create(path, samples, positions, dataType);
+
+    } else {
+        Header h;
+        memset(&h, 0, sizeof h);
+        int f = ::open(path, O_RDONLY);
+        if (f >= 0) {
+            if (pread(f, &h, sizeof h, 0) != sizeof h) {
+                memset(&h, 0, sizeof h);
+            }
+            close(f);
+        }
+
+        if (memcmp(h.magic, magic(), sizeof h.magic) == 0) {
+            bool knownType = h.dataType == kFloat32 || h.dataType == kInt8Block;
+            if (h.version != kVersion || !knownType || h.samples != samples) {
+                ok = moveAside(path) && create(path, samples, positions, dataType);
+            } else if (h.dataType != uint32_t(dataType) || h.denseSize != denseSize ||
+                       h.layoutHash != layoutHash(samples, positions)) {
+                ok = migrate(path, samples, positions, dataType);
+            }
+        } else if (size_t(st.st_size) == legacyBytes(samples, denseSize)) {
+            ok = migrateLegacy(path, samples, positions, dataType);
+        } else {
+            // Not ours, or cut short by the interim headerless float build, which
+            // truncated files to its own size. Either way, never resize it here.
+            fprintf(stderr, "vismem: %s has no header and is %lld bytes, expected %lld. Refusing to open it.\n",
+                path, (long long) st.st_size, (long long) legacyBytes(samples, denseSize));
+            return false;
+        }
+    }
+
+    if (!ok || !map(path)) {
+        return false;
+    }
+
+    // Work in the generation that isn't active. Any of its rows could be behind.
+
+    rowState.assign(header->samples, kRowStale);
+    beginWorking((header->activeGeneration & 1) ^ 1);
+
+    // The learner touches scattered rows from here on
+    madvise(generation(working), header->generationSize, MADV_RANDOM);
+
+    fprintf(stderr, "vismem: Opened %s, %d samples x %d LEDs, data type %d, %d checkpoints, %.1f MB\n",
+        path, header->samples, header->denseSize, header->dataType, (int)header->checkpoints,
+        mappingSize / (1024.0 * 1024.0));
+    return true;
+}
+
+inline void VisualMemoryFile::checkpoint()
+{
+    if (!mapping) {
+        return;
+    }
+
+    // The working generation has to be complete before it can become active
+    catchUp(header->generationSize);
+
+    // Data first, then the header that points to it. Only dirty pages get written.
+
+    if (msync(generation(working), header->generationSize, MS_SYNC)) {
+        perror("vismem: Error writing checkpoint");
+        return;
+    }
+
+    header->activeGeneration = working;
+    header->checkpoints++;
+    if (msync(mapping, header->headerSize, MS_SYNC)) {
+        perror("vismem: Error writing checkpoint header");
+        return;
+    }
+
+    // Continue in the older generation, which is behind by exactly the rows we changed
+
+    for (unsigned row = 0; row < rowState.size(); row++) {
+        rowState[row] = rowState[row] == kRowDirty ? kRowStale : kRowClean;
+    }
+    beginWorking(working ^ 1);
+}
+
+inline size_t VisualMemoryFile::expectedValueBytes() const
+{
+    return sizeof(memory_t) * (header->samples + header->denseSize);
+}
+
+inline void VisualMemoryFile::beginWorking(unsigned g)
+{
+    // Expected values are small, and updated every cycle; copy them right away
+
+    unsigned active = g ^ 1;
+    size_t offset = rowBytes() * header->samples;
+    memcpy(generation(g) + offset, generation(active) + offset, expectedValueBytes());
+
+    working = g;
+    catchUpCursor = 0;
+}
+
+inline void VisualMemoryFile::copyRow(unsigned row)
+{
+    size_t offset = rowBytes() * row;
+    memcpy(generation(working) + offset, activeCovariance() + offset, rowBytes());
+}
+
+inline void VisualMemoryFile::touchRow(unsigned row)
+{
+    if (rowState[row] == kRowStale) {
+        copyRow(row);
+    }
+    rowState[row] = kRowDirty;
+}
+
+inline bool VisualMemoryFile::catchUp(size_t maxBytes)
+{
+    size_t budget = std::max<size_t>(1, maxBytes / rowBytes());
+
+    while (catchUpCursor < rowState.size() && budget) {
+        if (rowState[catchUpCursor] == kRowStale) {
+            copyRow(catchUpCursor);
+            rowState[catchUpCursor] = kRowClean;
+            budget--;
+        }
+        catchUpCursor++;
+    }
+    return catchUpCursor == rowState.size();
+}
@@ -0,0 +1,297 @@
+/*
+ * Benchmark ParticleEffect's spatial index: the old nanoflann KD-tree against
+ * the uniform SpatialGrid, at the particle counts and radii our effects use.
+ *
+ * For each effect, random particles are scattered over the window6x12 model
+ * area. Each frame rebuilds the index, runs one query per LED at the particle
+ * radius (rendering), and one query per particle at the interaction radius
+ * (physics). Both indexes must find the same hits.
+ *
+ * Then it builds FrameInfo's k-nearest-LED table for the same LED layout, and
+ * checks it against a brute-force search. Last, it renders one workload with
+ * each particle kernel policy, gathering and splatting, and checks that both
+ * directions agree.
+ *
+ * Usage: particle_index_bench [frames]
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <sys/time.h>
+#include "lib/particle.h"
+#include "lib/nanoflann.h"
+#include "lib/spatial_grid.h"
+#include "lib/prng.h"
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+typedef std::vector<std::pair<size_t, Real> > ResultSet_t;
+
+struct PointCloud
+{
+    std::vector<Vec3> points;
+
+    size_t kdtree_get_point_count() const {
+        return points.size();
+    }
+
+    Real kdtree_distance(const Real *p1, const size_t idx, size_t size) const {
+        return sqrlen(Vec3(p1[0], p1[1], p1[2]) - points[idx]);
+    }
+
+    Real kdtree_get_pt(const size_t idx, int dim) const {
+        return points[idx][dim];
+    }
+
+    template <class BBOX> bool kdtree_get_bbox(BBOX &bb) const {
+        return false;
+    }
+
+    Vec3 operator() (unsigned i) const {
+        return points[i];
+    }
+};
+
+typedef nanoflann::KDTreeSingleIndexAdaptor<
+    nanoflann::L2_Simple_Adaptor< Real, PointCloud >,
+    PointCloud, 3> KDTree;
+
+struct GridCollector
+{
+    ResultSet_t &hits;
+    const PointCloud &cloud;
+    Vec3 point;
+    Real radius2;
+
+    void operator() (unsigned i) {
+        Real dist2 = sqrlen(cloud.points[i] - point);
+        if (dist2 < radius2) {
+            hits.push_back(std::make_pair(size_t(i), dist2));
+        }
+    }
+};
+
+struct Workload
+{
+    const char *name;
+    unsigned particles;
+    float radius;
+    float interactionRadius;
+};
+
+// Model radius of window6x12 is about 1.95; radii below are from data/config.json
+static const Workload workloads[] = {
+    { "OrderParticles",  40, 0.42 * 1.95, 0.55 * 1.95 },
+    { "PartnerDance",   120, 0.73, 0.2 },
+    { "ChaosParticles", 250, 0.32 * 1.95, 0.32 * 1.95 },
+    { "TreeGrowth",     300, 0.22, 0.22 },
+    { "Forest",         800, 0.48, 0.48 },
+};
+
+static void initLayout(rapidjson::Document &layout, Effect::FrameInfo &f, const std::vector<Vec3> &leds)
+{
+    std::string json = "[";
+    for (unsigned i = 0; i < leds.size(); i++) {
+        char buf[128];
+        snprintf(buf, sizeof buf, "%s{\"point\": [%f, %f, %f]}", i ? ", " : "",
+            leds[i][0], leds[i][1], leds[i][2]);
+        json += buf;
+    }
+    json += "]";
+
+    layout.Parse<0>(json.c_str());
+    f.init(layout);
+}
+
+static void benchNearest(const Effect::FrameInfo &f, unsigned k)
+{
+    bool ok = f.nearest(0) == 0 && f.nearestDist2(0) == 0;
+
+    double t0 = now();
+    f.requireNearest(k);
+    double t1 = now();
+
+    // Every pixel's table must hold the same distances as a full sort, and each
+    // listed neighbor must really be at its listed distance.
+    std::vector<Real> dist2;
+    ok = ok && f.nearestCount() == k;
+    for (unsigned i = 0; ok && i < f.pixels.size(); i++) {
+        dist2.clear();
+        for (unsigned j = 0; j < f.pixels.size(); j++) {
+            if (j != i) {
+                dist2.push_back(sqrlen(f.pixels[j].point - f.pixels[i].point));
+            }
+        }
+        std::partial_sort(dist2.begin(), dist2.begin() + k, dist2.end());
+
+        const unsigned *nearest = f.nearest(i);
+        const Real *nearestDist2 = f.nearestDist2(i);
+        for (unsigned j = 0; j < k; j++) {
+            if (nearest[j] == i || nearestDist2[j] != dist2[j] ||
+                sqrlen(f.pixels[nearest[j]].point - f.pixels[i].point) != dist2[j]) {
+                ok = false;
+            }
+        }
+    }
+
+    printf("\n%u-nearest LED table, %d LEDs: %.2f ms%s\n",
+        k, int(f.pixels.size()), (t1 - t0) * 1e3, ok ? "" : "  MISMATCH");
+}
+
+// Random particles for one workload, drawn with each Kernel policy
+template <typename Kernel>
+class KernelWorkload : public ParticleEffectT<Kernel> {
+public:
+    void scatter(PRNG &prng, const Workload &wl)
+    {
+        this->particles.resize(wl.particles);
+        for (unsigned i = 0; i < this->particles.size(); i++) {
+            this->particles.point[i] = Vec3(prng.uniform(-1.1, 1.1), 0, prng.uniform(-2.1, 2.1));
+            this->particles.color[i] = Vec3(prng.uniform(), prng.uniform(), prng.uniform());
+            this->particles.radius[i] = wl.radius;
+            this->particles.intensity[i] = 1;
+        }
+    }
+};
+
+template <typename Kernel>
+static void benchKernel(const char *name, const Effect::FrameInfo &f, const Workload &wl, unsigned frames)
+{
+    KernelWorkload<Kernel> effect;
+    std::vector<Vec3> gathered(f.pixels.size());
+    double elapsed[2] = { 0, 0 };
+    bool ok = true;
+
+    for (unsigned frame = 0; frame < frames; frame++) {
+        PRNG prng;
+        prng.seed(frame + 1);
+        effect.scatter(prng, wl);
+
+        for (int pass = 0; pass < 2; pass++) {
+            effect.renderMode = pass ? effect.kRenderSplat : effect.kRenderGather;
+
+            double t0 = now();
+            effect.beginFrame(f);
+            for (unsigned i = 0; i < f.pixels.size(); i++) {
+                Vec3 rgb(0, 0, 0);
+                effect.shader(rgb, f.pixels[i]);
+                if (!pass) {
+                    gathered[i] = rgb;
+                } else if (len(rgb - gathered[i]) > 1e-4 * (1 + len(rgb))) {
+                    ok = false;
+                }
+            }
+            elapsed[pass] += now() - t0;
+        }
+    }
+
+    printf("%-18s %10.3f %10.3f%s\n", name,
+        elapsed[0] * 1e3 / frames, elapsed[1] * 1e3 / frames, ok ? "" : "  MISMATCH");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned frames = argc > 1 ? atoi(argv[1]) : 200;
+
+    // LED positions, like the window6x12 layout: 36 x 72 in the XZ plane
+    std::vector<Vec3> leds;
+    for (unsigned x = 0; x < 36; x++) {
+        for (unsigned z = 0; z < 72; z++) {
+            leds.push_back(Vec3(-0.8625 + x * 0.049286, 0, -1.7625 + z * 0.049648));
+        }
+    }
+
+    printf("%-16s %6s   %22s   %22s   %22s\n", "", "", "build (us)", "render (ms)", "interact (us)");
+    printf("%-16s %6s   %10s %10s   %10s %10s   %10s %10s\n",
+        "effect", "count", "kd-tree", "grid", "kd-tree", "grid", "kd-tree", "grid");
+
+    for (unsigned w = 0; w < sizeof workloads / sizeof workloads[0]; w++) {
+        const Workload &wl = workloads[w];
+
+        PRNG prng;
+        prng.seed(w + 1);
+        PointCloud cloud;
+        cloud.points.resize(wl.particles);
+
+        KDTree tree(3, cloud);
+        SpatialGrid grid;
+        ResultSet_t hits;
+        nanoflann::SearchParams params;
+        params.sorted = false;
+
+        double kdBuild = 0, gridBuild = 0, kdRender = 0, gridRender = 0, kdInteract = 0, gridInteract = 0;
+        size_t kdHits = 0, gridHits = 0;
+
+        for (unsigned frame = 0; frame < frames; frame++) {
+            for (unsigned i = 0; i < cloud.points.size(); i++) {
+                cloud.points[i] = Vec3(prng.uniform(-1.1, 1.1), 0, prng.uniform(-2.1, 2.1));
+            }
+
+            double t0 = now();
+            tree.buildIndex();
+            double t1 = now();
+            grid.build(cloud.points.size(), wl.radius, cloud);
+            double t2 = now();
+
+            kdBuild += t1 - t0;
+            gridBuild += t2 - t1;
+
+            for (int pass = 0; pass < 2; pass++) {
+                const std::vector<Vec3> &queries = pass ? cloud.points : leds;
+                float radius = pass ? wl.interactionRadius : wl.radius;
+
+                double t3 = now();
+                for (unsigned q = 0; q < queries.size(); q++) {
+                    tree.radiusSearch(&queries[q][0], radius * radius, hits, params);
+                    kdHits += hits.size();
+                }
+                double t4 = now();
+                for (unsigned q = 0; q < queries.size(); q++) {
+                    hits.clear();
+                    GridCollector collector = { hits, cloud, queries[q], radius * radius };
+                    grid.visitCandidates(queries[q], radius, collector);
+                    gridHits += hits.size();
+                }
+                double t5 = now();
+
+                (pass ? kdInteract : kdRender) += t4 - t3;
+                (pass ? gridInteract : gridRender) += t5 - t4;
+            }
+        }
+
+        printf("%-16s %6d   %10.2f %10.2f   %10.3f %10.3f   %10.2f %10.2f%s\n",
+            wl.name, wl.particles,
+            kdBuild * 1e6 / frames, gridBuild * 1e6 / frames,
+            kdRender * 1e3 / frames, gridRender * 1e3 / frames,
+            kdInteract * 1e6 / frames, gridInteract * 1e6 / frames,
+            kdHits == gridHits ? "" : "  MISMATCH");
+    }
+
+    rapidjson::Document layout;
+    Effect::FrameInfo f;
+    initLayout(layout, f, leds);
+
+    benchNearest(f, 8);
+
+    const Workload &wl = workloads[3];
+    printf("\n%s workload, render (ms)\n", wl.name);
+    printf("%-18s %10s %10s\n", "kernel", "gather", "splat");
+    benchKernel<Poly6Kernel>("Poly6Kernel", f, wl, frames);
+    benchKernel<CubicSplineKernel>("CubicSplineKernel", f, wl, frames);
+    benchKernel<GaussianKernel>("GaussianKernel", f, wl, frames);
+    benchKernel<BoxKernel>("BoxKernel", f, wl, frames);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Compare VisualMemory's quantized covariance storage against plain floats.
+ *
+ * Runs the same synthetic learning workload through FloatRow and
+ * QuantizedRow side by side, then reports memory use, update speed,
+ * how far the quantized matrix drifted from the float one, and how
+ * closely recall results built from each of them agree.
+ *
+ * Usage: vismem_accuracy [leds] [samples] [cycles]
+ *
+ * (c) 2014 Micah Elizabeth Scott
+ * http://creativecommons.org/licenses/by/3.0/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <sys/time.h>
+#include "spare/covariance_rows.h"
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static float randomFloat(uint32_t &rng)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return (rng >> 8) * (1.0f / 16777216.0f);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned leds = argc > 1 ? atoi(argv[1]) : 2592;
+    unsigned samples = argc > 2 ? atoi(argv[2]) : 4000;
+    unsigned cycles = argc > 3 ? atoi(argv[3]) : 2000;
+
+    const float keep = 1 - 1e-5;
+    const float learningProportion = 0.05;
+    const unsigned influences = 8;
+
+    size_t floatBytes = FloatRow::bytes(leds);
+    size_t quantizedBytes = QuantizedRow::bytes(leds);
+    std::vector<uint8_t> floatMatrix(floatBytes * samples);
+    std::vector<uint8_t> quantizedMatrix(quantizedBytes * samples);
+
+    // Each camera sample sees a few LEDs, with random weights
+    uint32_t rng = 1234;
+    std::vector<unsigned> influenceLed(samples * influences);
+    std::vector<float> influenceWeight(samples * influences);
+    for (unsigned i = 0; i < influenceLed.size(); i++) {
+        influenceLed[i] = std::min<unsigned>(leds - 1, randomFloat(rng) * leds);
+        influenceWeight[i] = randomFloat(rng);
+    }
+
+    std::vector<float> led(leds);
+    std::vector<float> floatAcc(leds), quantizedAcc(leds);
+    uint32_t floatRng = 1, quantizedRng = 1;
+    double floatTime = 0, quantizedTime = 0;
+    unsigned rowUpdates = 0;
+
+    for (unsigned cycle = 0; cycle < cycles; cycle++) {
+        for (unsigned i = 0; i < leds; i++) {
+            led[i] = randomFloat(rng) - 0.5f;
+        }
+
+        std::vector<unsigned> rows;
+        std::vector<float> cSamples;
+        for (unsigned s = 0; s < samples; s++) {
+            if (randomFloat(rng) < learningProportion) {
+                float c = 0;
+                for (unsigned k = 0; k < influences; k++) {
+                    c += influenceWeight[s * influences + k] * led[influenceLed[s * influences + k]];
+                }
+                rows.push_back(s);
+                cSamples.push_back(c + 0.1f * (randomFloat(rng) - 0.5f));
+            }
+        }
+        rowUpdates += rows.size();
+
+        double t0 = now();
+        for (unsigned r = 0; r < rows.size(); r++) {
+            FloatRow::update(&floatMatrix[rows[r] * floatBytes], leds, &led[0],
+                cSamples[r], keep, floatRng);
+        }
+        double t1 = now();
+        for (unsigned r = 0; r < rows.size(); r++) {
+            QuantizedRow::update(&quantizedMatrix[rows[r] * quantizedBytes], leds, &led[0],
+                cSamples[r], keep, quantizedRng);
+        }
+        double t2 = now();
+
+        floatTime += t1 - t0;
+        quantizedTime += t2 - t1;
+    }
+
+    // Matrix error, relative to the float matrix
+
+    std::vector<float> floatRow(leds), quantizedRow(leds);
+    double errorSq = 0, normSq = 0, maxError = 0;
+
+    for (unsigned s = 0; s < samples; s++) {
+        FloatRow::read(&floatMatrix[s * floatBytes], leds, &floatRow[0]);
+        QuantizedRow::read(&quantizedMatrix[s * quantizedBytes], leds, &quantizedRow[0]);
+        for (unsigned i = 0; i < leds; i++) {
+            double e = quantizedRow[i] - floatRow[i];
+            errorSq += e * e;
+            normSq += double(floatRow[i]) * floatRow[i];
+            maxError = std::max(maxError, fabs(e));
+        }
+    }
+
+    // Recall agreement: weight a random subset of rows, as motion would, and correlate
+
+    double floatRecallTime = 0, quantizedRecallTime = 0;
+    unsigned recallRows = 0;
+
+    for (unsigned s = 0; s < samples; s++) {
+        float w = randomFloat(rng);
+        if (w < 0.3f) {
+            double t0 = now();
+            FloatRow::accumulate(&floatMatrix[s * floatBytes], leds, w, &floatAcc[0]);
+            double t1 = now();
+            QuantizedRow::accumulate(&quantizedMatrix[s * quantizedBytes], leds, w, &quantizedAcc[0]);
+            double t2 = now();
+
+            floatRecallTime += t1 - t0;
+            quantizedRecallTime += t2 - t1;
+            recallRows++;
+        }
+    }
+
+    double meanF = 0, meanQ = 0;
+    for (unsigned i = 0; i < leds; i++) {
+        meanF += floatAcc[i];
+        meanQ += quantizedAcc[i];
+    }
+    meanF /= leds;
+    meanQ /= leds;
+
+    double sFF = 0, sQQ = 0, sFQ = 0;
+    for (unsigned i = 0; i < leds; i++) {
+        double f = floatAcc[i] - meanF;
+        double q = quantizedAcc[i] - meanQ;
+        sFF += f * f;
+        sQQ += q * q;
+        sFQ += f * q;
+    }
+
+    printf("%d LEDs, %d samples, %d cycles, %d row updates\n", leds, samples, cycles, rowUpdates);
+    printf("memory:     float %.1f MB, quantized %.1f MB (full %d sample matrix: %.1f MB vs %.1f MB)\n",
+        floatMatrix.size() / 1e6, quantizedMatrix.size() / 1e6, 43200,
+        floatBytes * 43200.0 / 1e6, quantizedBytes * 43200.0 / 1e6);
+    printf("update:     float %.2f us/row, quantized %.2f us/row\n",
+        floatTime * 1e6 / rowUpdates, quantizedTime * 1e6 / rowUpdates);
+    printf("matrix:     relative RMS error %.4f, max error %g\n",
+        sqrt(errorSq / normSq), maxError);
+    printf("recall:     correlation %.5f, float %.2f us/row, quantized %.2f us/row\n",
+        sFQ / sqrt(sFF * sQQ), floatRecallTime * 1e6 / recallRows, quantizedRecallTime * 1e6 / recallRows);
+
+    return 0;
+}
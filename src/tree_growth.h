@@ -54,14 +54,39 @@ private:
     float spuriousLaunchSpeedMin;
     float spuriousLaunchSpeedMax;
 
-    struct ParticleDynamics {
-        Vec3 velocity;
-        float time;
+    CameraFlowCapture flow;
+
+    // Per-step scratch space
+    std::vector<Vec3> gradient;
+    std::vector<uint8_t> keep;
+
+    // The layout's "blockXY" for each pixel, so we don't parse JSON on every search hit
+    std::vector<Vec2> ledBlockXY;
+    const PixelInfo *ledBlockLayout;
+
+    // Particles per parallelFor() chunk during runStep()
+    static const unsigned kStepChunkSize = 32;
+
+    struct GradientStep {
+        TreeGrowth &effect;
+        void operator() (unsigned begin, unsigned end);
     };
 
-    CameraFlowCapture flow;
+    struct LedPullStep {
+        TreeGrowth &effect;
+        const FrameInfo &f;
+        void operator() (unsigned begin, unsigned end);
+    };
+
+    // Pull on one particle from a nearby LED, via FrameInfo::visitRadius()
+    struct LedPull {
+        const TreeGrowth &effect;
+        const FrameInfo &f;
+        Vec3 point;
+        Vec3 velocity;
+        void operator() (unsigned index, Real dist2);
+    };
 
-    std::vector<ParticleDynamics> dynamics;
     PRNG prng;
     float timeDeltaRemainder;
     float spuriousLaunchProbability;
@@ -105,6 +130,7 @@ inline TreeGrowth::TreeGrowth(const CameraFlowAnalyzer& flow, const rapidjson::V
       spuriousLaunchSpeedMin(config["spuriousLaunchSpeedMin"].GetDouble()),      
       spuriousLaunchSpeedMax(config["spuriousLaunchSpeedMax"].GetDouble()),      
       flow(flow),
+      ledBlockLayout(0),
       timeDeltaRemainder(0)
 {
     reseed(42);
@@ -132,6 +158,15 @@ inline void TreeGrowth::beginFrame(const FrameInfo &f)
     int steps = t * stepRate;
     timeDeltaRemainder = t - steps / stepRate;
 
+    // Same layout-change test as LedTiles: the pixel array moves when the layout does
+    if (!f.pixels.empty() && (ledBlockLayout != &f.pixels[0] || ledBlockXY.size() != f.pixels.size())) {
+        ledBlockLayout = &f.pixels[0];
+        ledBlockXY.resize(f.pixels.size());
+        for (unsigned i = 0; i < f.pixels.size(); i++) {
+            ledBlockXY[i] = f.pixels[i].getVec2("blockXY");
+        }
+    }
+
     while (steps > 0) {
         runStep(f);
         steps--;
@@ -142,7 +177,7 @@ inline void TreeGrowth::beginFrame(const FrameInfo &f)
 
 inline void TreeGrowth::debug(const DebugInfo &di)
 {
-    fprintf(stderr, "\t[tree-growth] particles = %d\n", (int)appearance.size());
+    fprintf(stderr, "\t[tree-growth] particles = %d\n", (int)particles.size());
     fprintf(stderr, "\t[tree-growth] motionLength = %f\n", flow.motionLength);
     fprintf(stderr, "\t[tree-growth] instantaneousMotion = %f\n", flow.instantaneousMotion());
     fprintf(stderr, "\t[tree-growth] spuriousLaunchProbability = %f\n", spuriousLaunchProbability);
@@ -150,17 +185,13 @@ inline void TreeGrowth::debug(const DebugInfo &di)
 
 inline void TreeGrowth::launch(Vec3 point, Vec3 velocity)
 {
-    ParticleAppearance pa;
-    ParticleDynamics pd;
-
-    pa.color = Vec3(1,1,1);
-    pa.point = point;
-    pa.radius = visibleRadius;
-    pd.velocity = velocity;
-    pd.time = 0;
+    unsigned i = particles.add();
 
-    appearance.push_back(pa);
-    dynamics.push_back(pd);
+    particles.color[i] = Vec3(1,1,1);
+    particles.point[i] = point;
+    particles.radius[i] = visibleRadius;
+    particles.velocity[i] = velocity;
+    particles.age[i] = 0;
 }
 
 inline Vec3 TreeGrowth::launchPosition(const FrameInfo &f, Vec3 direction) const
@@ -194,7 +225,7 @@ inline void TreeGrowth::runStep(const FrameInfo &f)
     // This helps demarcate the transition into this effect, plus it gives us a backup
     // trigger in case our camera input is disabled or broken.
     if (spuriousLaunchProbability > 0) { 
-        int launchCount = std::min<int>(maxParticles - appearance.size(),
+        int launchCount = std::min<int>(maxParticles - particles.size(),
             prng.uniform(0, 1.0f + spuriousLaunchProbability));
         spuriousLaunchProbability += spuriousLaunchProbabilityRate;
 
@@ -210,7 +241,7 @@ inline void TreeGrowth::runStep(const FrameInfo &f)
         flow.capture(flowFilterRate);
         flow.origin();
 
-        int launchCount = std::min<int>(maxParticles - appearance.size(),
+        int launchCount = std::min<int>(maxParticles - particles.size(),
             prng.uniform(0, 1.0f + flow.instantaneousMotion() * flowLaunchScale));
 
         while (launchCount--) {
@@ -219,87 +250,98 @@ inline void TreeGrowth::runStep(const FrameInfo &f)
     }
 
     // Launch new particles based on random parent particles
-    if (!appearance.empty()) {
+    if (!particles.empty()) {
         int launchCount =
             std::max<int>(0,
-            std::min<int>(maxParticles - appearance.size(),
+            std::min<int>(maxParticles - particles.size(),
                 prng.uniform(0, 1.0f + launchProbability)));
 
         while (launchCount--) {
-            int p = std::max<int>(0, appearance.size() - prng.uniform(1, 1 + launchHistoryDepth));
-            launch(appearance[p].point + XZ(prng.circularVector() * launchPointNoise),
-                   dynamics[p].velocity + XZ(prng.circularVector() * launchVelocityNoise));
+            int p = std::max<int>(0, particles.size() - prng.uniform(1, 1 + launchHistoryDepth));
+            launch(particles.point[p] + XZ(prng.circularVector() * launchPointNoise),
+                   particles.velocity[p] + XZ(prng.circularVector() * launchVelocityNoise));
         }
     }
 
-    // Iterate through and update all particles, discarding any that have expired
-    unsigned j = 0;
-    for (unsigned i = 0; i < appearance.size(); i++) {
-        ParticleAppearance pa = appearance[i];
-        ParticleDynamics pd = dynamics[i];
+    // Sample the intensity gradient for every particle before moving any of them.
+    // The index must be current; particles were added and removed since it was built.
 
-        // Update simulation
+    buildIndex();
+    unsigned n = particles.size();
+    gradient.resize(n);
+    GradientStep gradientStep = { *this };
+    f.parallelFor(n, kStepChunkSize, gradientStep);
 
-        Vec3 v = pd.velocity * (1.0f - damping);
-        Vec3 pt = pa.point;
-        float t = pd.time;
+    // Update simulation, in flat loops over each attribute
 
-        v += gradientPull * sampleIntensityGradient(pa.point);
-        pt += v;
-        t += 1.0f / stepRate / particleDuration;
+    float velocityKeep = 1.0f - damping;
+    float timeStep = 1.0f / stepRate / particleDuration;
 
-        pd.velocity = v;
-        pa.point = pt;
-        pd.time = t;
+    for (unsigned i = 0; i < n; i++) {
+        particles.velocity[i] = particles.velocity[i] * velocityKeep + gradientPull * gradient[i];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        particles.point[i] += particles.velocity[i];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        particles.age[i] += timeStep;
+    }
 
-        if (pd.time >= 1.0f) {
-            // Discard, too old
-            continue;
-        }
+    // Discard particles that are too old, or outside the bounding box
 
-        if (f.distanceOutsideBoundingBox(pt) > outsideMargin * visibleRadius) {
-            // Outside bounding box, discard
-            continue;
-        }
+    keep.resize(n);
+    for (unsigned i = 0; i < n; i++) {
+        keep[i] = particles.age[i] < 1.0f &&
+            !(f.distanceOutsideBoundingBox(particles.point[i]) > outsideMargin * visibleRadius);
+    }
+    n = particles.compact(keep);
 
-        pa.intensity = particleIntensity(t);
+    for (unsigned i = 0; i < n; i++) {
+        particles.intensity[i] = particleIntensity(particles.age[i]);
+    }
 
-        // Pull toward nearby LEDs, so the particles kinda-follow the grid.
+    // Pull toward nearby LEDs, so the particles kinda-follow the grid.
 
-        ResultSet_t hits;
-        f.radiusSearch(hits, pa.point, std::max(ledPullRadius, blockPullRadius));
-        for (unsigned h = 0; h < hits.size(); h++) {
-            const PixelInfo &hit = f.pixels[hits[h].first];
-            if (!hit.isMapped()) {
-                continue;
-            }
+    LedPullStep ledPullStep = { *this, f };
+    f.parallelFor(n, kStepChunkSize, ledPullStep);
+}
 
-            Vec3 v = pd.velocity;
+inline void TreeGrowth::GradientStep::operator() (unsigned begin, unsigned end)
+{
+    for (unsigned i = begin; i < end; i++) {
+        effect.gradient[i] = effect.sampleIntensityGradient(effect.particles.point[i]);
+    }
+}
 
-            // Pull toward LED
-            Vec3 d = hit.point - pt;
-            float q2 = hits[h].second / sq(ledPullRadius);
-            if (q2 < 1.0f) {
-                v += ledPull * kernel2(q2) * d;
-            }
+inline void TreeGrowth::LedPullStep::operator() (unsigned begin, unsigned end)
+{
+    float searchRadius = std::max(effect.ledPullRadius, effect.blockPullRadius);
 
-            // Pull toward grid square center
-            q2 = hits[h].second / sq(blockPullRadius);
-            if (q2 < 1.0f) {
-                Vec2 blockXY = hit.getVec2("blockXY");
-                Vec2 b = blockPull * kernel2(q2) * blockXY;
-                v += Vec3(-b[0], 0, b[1]);
-            }
+    for (unsigned i = begin; i < end; i++) {
+        LedPull pull = { effect, f, effect.particles.point[i], effect.particles.velocity[i] };
+        f.visitRadius(pull.point, searchRadius, pull);
+        effect.particles.velocity[i] = pull.velocity;
+    }
+}
 
-            pd.velocity = v;
-        }
+inline void TreeGrowth::LedPull::operator() (unsigned index, Real dist2)
+{
+    const PixelInfo &hit = f.pixels[index];
+    if (!hit.isMapped()) {
+        return;
+    }
 
-        // Write out
-        appearance[j] = pa;
-        dynamics[j] = pd;
-        j++;
+    // Pull toward LED
+    Vec3 d = hit.point - point;
+    float q2 = dist2 / sq(effect.ledPullRadius);
+    if (q2 < 1.0f) {
+        velocity += effect.ledPull * kernel2(q2) * d;
     }
 
-    appearance.resize(j);
-    dynamics.resize(j);
+    // Pull toward grid square center
+    q2 = dist2 / sq(effect.blockPullRadius);
+    if (q2 < 1.0f) {
+        Vec2 b = effect.blockPull * kernel2(q2) * effect.ledBlockXY[index];
+        velocity += Vec3(-b[0], 0, b[1]);
+    }
 }